@@ -89,7 +89,6 @@
 
 #include <stdio.h>
 #include <stdlib.h>
-#include <malloc.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -99,11 +98,11 @@
 #include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <fcntl.h>
-#include <libgen.h>
 #include <syslog.h>
 #include <signal.h>
 #include <errno.h>
 #include <clplumbing/cl_log.h>
+#include "announce.h"
 
 
 #define PIDFILE_BASE HA_RSCTMPDIR  "/IPv6addr-"
@@ -147,12 +146,10 @@ const char*	RELOAD_CMD 	= "reload";
 const char*	META_DATA_CMD 	= "meta-data";
 const char*	VALIDATE_CMD 	= "validate-all";
 
-char		BCAST_ADDR[]	= "ff02::1";
 const int	UA_REPEAT_COUNT	= 5;
+const long	UA_INTERVAL_MS	= 1000;
 const int	QUERY_COUNT	= 5;
 
-#define 	HWADDR_LEN 	6 /* mac address length */
-
 struct in6_ifreq {
 	struct in6_addr ifr6_addr;
 	uint32_t ifr6_prefixlen;
@@ -168,8 +165,6 @@ static int meta_data_addr6(void);
 
 
 static void usage(const char* self);
-int write_pid_file(const char *pid_file);
-int create_pid_directory(const char *pid_file);
 static void byebye(int nsig);
 
 static char* scan_if(struct in6_addr* addr_target, int* plen_target,
@@ -179,7 +174,7 @@ static char* get_if(struct in6_addr* addr_target, int* plen_target, char* prov_i
 static int assign_addr6(struct in6_addr* addr6, int prefix_len, char* if_name);
 static int unassign_addr6(struct in6_addr* addr6, int prefix_len, char* if_name);
 int is_addr6_available(struct in6_addr* addr6);
-static int send_ua(struct in6_addr* src_ip, char* if_name);
+static int send_ua(struct in6_addr* src_ip, char* if_name, int count);
 
 int
 main(int argc, char* argv[])
@@ -206,6 +201,7 @@ main(int argc, char* argv[])
 	/* open system log */
 	cl_log_set_entity(APP_NAME);
 	cl_log_set_facility(LOG_DAEMON);
+	ann_log_init(APP_NAME, cl_log);
 
 	/* the meta-data dont need any parameter */
 	if (0 == strncmp(META_DATA_CMD, argv[1], strlen(META_DATA_CMD))) {
@@ -275,7 +271,7 @@ main(int argc, char* argv[])
 		return OCF_ERR_GENERIC;
 	}
 
-	if (write_pid_file(pid_file) < 0) {
+	if (ann_write_pid_file(pid_file) < 0) {
 		return OCF_ERR_GENERIC;
 	}
 
@@ -343,10 +339,7 @@ start_addr6(struct in6_addr* addr6, int prefix_len, char* prov_ifname)
 	}
 
 	/* Send unsolicited advertisement packet to neighbor */
-	for (i = 0; i < UA_REPEAT_COUNT; i++) {
-		send_ua(addr6, if_name);
-		sleep(1);
-	}
+	send_ua(addr6, if_name, UA_REPEAT_COUNT);
 	return OCF_SUCCESS;
 }
 
@@ -355,16 +348,12 @@ advt_addr6(struct in6_addr* addr6, int prefix_len, char* prov_ifname)
 {
 	/* First, we need to find a proper device to assign the address */
 	char*	if_name = get_if(addr6, &prefix_len, prov_ifname);
-	int	i;
 	if (NULL == if_name) {
 		cl_log(LOG_ERR, "no valid mecahnisms");
 		return OCF_ERR_GENERIC;
 	}
 	/* Send unsolicited advertisement packet to neighbor */
-	for (i = 0; i < UA_REPEAT_COUNT; i++) {
-		send_ua(addr6, if_name);
-		sleep(1);
-	}
+	send_ua(addr6, if_name, UA_REPEAT_COUNT);
 	return OCF_SUCCESS;
 }
 
@@ -412,110 +401,46 @@ monitor_addr6(struct in6_addr* addr6, int prefix_len)
 	return OCF_NOT_RUNNING;
 }
 
-/* Send an unsolicited advertisement packet
- * Please refer to rfc4861 / rfc3542
+/* Send count unsolicited advertisement packets, UA_INTERVAL_MS apart,
+ * over one socket. Please refer to rfc4861 / rfc3542
  */
 int
-send_ua(struct in6_addr* src_ip, char* if_name)
+send_ua(struct in6_addr* src_ip, char* if_name, int count)
 {
-	int status = -1;
+	int status = 0;
 	int fd;
+	int i;
+	struct ann_link *link;
+	unsigned char payload[ANN_NA_LEN];
+	struct timespec due;
+
+	/* the hardware address, and the outgoing interface */
+	if ((link = ann_link_get(if_name)) == NULL || link->halen == 0) {
+		cl_log(LOG_ERR, "Cannot get the hardware address of %s"
+		,	if_name);
+		return -1;
+	}
+	if ((fd = ann_na_socket(src_ip, link->ifindex)) < 0) {
+		return -1;
+	}
+
+	/* build the neighbor advertisement message once */
+	ann_na_frame(payload, src_ip, link->hwaddr);
 
-	int ifindex;
-	int hop;
-	struct ifreq ifr;
-	u_int8_t *payload = NULL;
-	int    payload_size;
-	struct nd_neighbor_advert *na;
-	struct nd_opt_hdr *opt;
-	struct sockaddr_in6 src_sin6;
-	struct sockaddr_in6 dst_sin6;
-
-	if ((fd = socket(AF_INET6, SOCK_RAW, IPPROTO_ICMPV6)) == 0) {
-		cl_log(LOG_ERR, "socket(IPPROTO_ICMPV6) failed: %s",
-		       strerror(errno));
-		goto err;
-	}
-	/* set the outgoing interface */
-	ifindex = if_nametoindex(if_name);
-	if (setsockopt(fd, IPPROTO_IPV6, IPV6_MULTICAST_IF,
-		       &ifindex, sizeof(ifindex)) < 0) {
-		cl_log(LOG_ERR, "setsockopt(IPV6_MULTICAST_IF) failed: %s",
-		       strerror(errno));
-		goto err;
-	}
-	/* set the hop limit */
-	hop = 255; /* 255 is required. see rfc4861 7.1.2 */
-	if (setsockopt(fd, IPPROTO_IPV6, IPV6_MULTICAST_HOPS,
-		       &hop, sizeof(hop)) < 0) {
-		cl_log(LOG_ERR, "setsockopt(IPV6_MULTICAST_HOPS) failed: %s",
-		       strerror(errno));
-		goto err;
+	/* sending unsolicited neighbor advertisements to all */
+	ann_now(&due);
+	for (i = 0; i < count; i++) {
+		if (i > 0) {
+			ann_add_ms(&due, UA_INTERVAL_MS);
+			ann_sleep_until(&due);
+		}
+		if (ann_na_send(fd, payload, sizeof(payload)) < 0) {
+			cl_log(LOG_ERR, "sendto(%s) failed", if_name);
+			status = -1;
+		}
 	}
-	
-	/* set the source address */
-	memset(&src_sin6, 0, sizeof(src_sin6));
-	src_sin6.sin6_family = AF_INET6;
-	src_sin6.sin6_addr = *src_ip;
-	src_sin6.sin6_port = 0;
-	if (bind(fd, (struct sockaddr *)&src_sin6, sizeof(src_sin6)) < 0) {
-		cl_log(LOG_ERR, "bind() failed: %s", strerror(errno));
-		goto err;
-	}
-
-
-	/* get the hardware address */
-	memset(&ifr, 0, sizeof(ifr));
-	strncpy(ifr.ifr_name, if_name, sizeof(ifr.ifr_name) - 1);
-	if (ioctl(fd, SIOCGIFHWADDR, &ifr) < 0) {
-		cl_log(LOG_ERR, "ioctl(SIOCGIFHWADDR) failed: %s", strerror(errno));
-		goto err;
-	}
-
-	/* build a neighbor advertisement message */
-	payload_size = sizeof(struct nd_neighbor_advert)
-			 + sizeof(struct nd_opt_hdr) + HWADDR_LEN;
-	payload = memalign(sysconf(_SC_PAGESIZE), payload_size);
-	if (!payload) {
-		cl_log(LOG_ERR, "malloc for payload failed");
-		goto err;
-	}
-	memset(payload, 0, payload_size);
-
-	/* Ugly typecast from ia64 hell! */
-	na = (struct nd_neighbor_advert *)((void *)payload);
-	na->nd_na_type = ND_NEIGHBOR_ADVERT;
-	na->nd_na_code = 0;
-	na->nd_na_cksum = 0; /* calculated by kernel */
-	na->nd_na_flags_reserved = ND_NA_FLAG_OVERRIDE;
-	na->nd_na_target = *src_ip;
-
-	/* options field; set the target link-layer address */
-	opt = (struct nd_opt_hdr *)(payload + sizeof(struct nd_neighbor_advert));
-	opt->nd_opt_type = ND_OPT_TARGET_LINKADDR;
-	opt->nd_opt_len = 1; /* The length of the option in units of 8 octets */
-	memcpy(payload + sizeof(struct nd_neighbor_advert)
-			+ sizeof(struct nd_opt_hdr),
-	       &ifr.ifr_hwaddr.sa_data, HWADDR_LEN);
-
-	/* sending an unsolicited neighbor advertisement to all */
-	memset(&dst_sin6, 0, sizeof(dst_sin6));
-	dst_sin6.sin6_family = AF_INET6;
-	inet_pton(AF_INET6, BCAST_ADDR, &dst_sin6.sin6_addr); /* should not fail */
-
-	if (sendto(fd, payload, payload_size, 0,
-		   (struct sockaddr *)&dst_sin6, sizeof(dst_sin6))
-	    != payload_size) {
-		cl_log(LOG_ERR, "sendto(%s) failed: %s",
-		       if_name, strerror(errno));
-		goto err;
-	}
-
-	status = 0;
-
-err:
+
 	close(fd);
-	free(payload);
 	return status;
 }
 
@@ -760,168 +685,6 @@ byebye(int nsig)
 	exit(0);
 }
 
-int
-create_pid_directory(const char *pid_file)
-{
-	int status;
-	int return_status = -1;
-	struct stat stat_buf;
-	char* dir;
-
-	dir = strdup(pid_file);
-	if (!dir) {
-		cl_log(LOG_INFO, "Memory allocation failure: %s",
-				strerror(errno));
-		return -1;
-	}
-
-	dirname(dir);
-
-	status = stat(dir, &stat_buf);
-
-	if (status < 0 && errno != ENOENT && errno != ENOTDIR) {
-		cl_log(LOG_INFO, "Could not stat pid-file directory "
-				"[%s]: %s", dir, strerror(errno));
-		goto err;
-	}
-
-	if (!status) {
-		if (S_ISDIR(stat_buf.st_mode)) {
-			goto out;
-		}
-		cl_log(LOG_INFO, "Pid-File directory exists but is "
-				"not a directory [%s]", dir);
-		goto err;
-        }
-
-	if (mkdir(dir, S_IRUSR|S_IWUSR|S_IXUSR | S_IRGRP|S_IXGRP) < 0) {
-		cl_log(LOG_INFO, "Could not create pid-file directory "
-				"[%s]: %s", dir, strerror(errno));
-		goto err;
-	}
-
-out:
-	return_status = 0;
-err:
-	free(dir);
-	return return_status;
-}
-
-int
-write_pid_file(const char *pid_file)
-{
-
-	int     	pidfilefd;
-	char    	pidbuf[11];
-	unsigned long   pid;
-	ssize_t 	bytes;
-
-	if (*pid_file != '/') {
-		cl_log(LOG_INFO, "Invalid pid-file name, must begin with a "
-				"'/' [%s]\n", pid_file);
-		return -1;
-	}
-
-	if (create_pid_directory(pid_file) < 0) {
-		return -1;
-	}
-
-	while (1) {
-		pidfilefd = open(pid_file, O_CREAT|O_EXCL|O_RDWR,
-				S_IRUSR|S_IWUSR);
-		if (pidfilefd < 0) {
-			if (errno != EEXIST) { /* Old PID file */
-				cl_log(LOG_INFO, "Could not open pid-file "
-						"[%s]: %s", pid_file,
-						strerror(errno));
-				return -1;
-			}
-		}
-		else {
-			break;
-		}
-
-		pidfilefd = open(pid_file, O_RDONLY, S_IRUSR|S_IWUSR);
-		if (pidfilefd < 0) {
-			cl_log(LOG_INFO, "Could not open pid-file "
-					"[%s]: %s", pid_file,
-					strerror(errno));
-			return -1;
-		}
-
-		while (1) {
-			bytes = read(pidfilefd, pidbuf, sizeof(pidbuf)-1);
-			if (bytes < 0) {
-				if (errno == EINTR) {
-					continue;
-				}
-				cl_log(LOG_INFO, "Could not read pid-file "
-						"[%s]: %s", pid_file,
-						strerror(errno));
-				return -1;
-			}
-			pidbuf[bytes] = '\0';
-			break;
-		}
-
-		if(unlink(pid_file) < 0) {
-			cl_log(LOG_INFO, "Could not delete pid-file "
-	 				"[%s]: %s", pid_file,
-					strerror(errno));
-			return -1;
-		}
-
-		if (!bytes) {
-			cl_log(LOG_INFO, "Invalid pid in pid-file "
-	 				"[%s]: %s", pid_file,
-					strerror(errno));
-			return -1;
-		}
-
-		close(pidfilefd);
-
-		pid = strtoul(pidbuf, NULL, 10);
-		if (pid == ULONG_MAX && errno == ERANGE) {
-			cl_log(LOG_INFO, "Invalid pid in pid-file "
-	 				"[%s]: %s", pid_file,
-					strerror(errno));
-			return -1;
-		}
-
-		if (kill(pid, SIGKILL) < 0 && errno != ESRCH) {
-			cl_log(LOG_INFO, "Error killing old proccess [%lu] "
-	 				"from pid-file [%s]: %s", pid,
-					pid_file, strerror(errno));
-			return -1;
-		}
-
-		cl_log(LOG_INFO, "Killed old send_arp process [%lu]", pid);
-	}
-
-	if (snprintf(pidbuf, sizeof(pidbuf), "%u"
-	,	getpid()) >= (int)sizeof(pidbuf)) {
-		cl_log(LOG_INFO, "Pid too long for buffer [%u]", getpid());
-		return -1;
-	}
-
-	while (1) {
-		bytes = write(pidfilefd, pidbuf, strlen(pidbuf));
-		if (bytes != strlen(pidbuf)) {
-			if (bytes < 0 && errno == EINTR) {
-				continue;
-			}
-			cl_log(LOG_INFO, "Could not write pid-file "
-					"[%s]: %s", pid_file,
-					strerror(errno));
-			return -1;
-		}
-		break;
-	}
-
-	close(pidfilefd);
-
-	return 0;
-}
 static int
 meta_data_addr6(void)
 {
@@ -0,0 +1,490 @@
+/*
+   Address announcement core shared by send_arp (both backends) and
+   IPv6addr.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+   02110-1301, USA.
+*/
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <signal.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <net/if.h>
+#include <arpa/inet.h>
+#ifdef HAVE_NETINET_ICMP6_H
+#include <netinet/icmp6.h>
+#endif
+#ifdef HAVE_LINUX_IF_PACKET_H
+#include <linux/if_packet.h>
+#endif
+#include "announce.h"
+
+static const char *log_ident = "announce";
+static ann_log_fn log_fn;
+
+#define ann_log(prio, fmt, ...)						\
+	do {								\
+		if (log_fn)						\
+			log_fn(prio, fmt, ##__VA_ARGS__);		\
+		else							\
+			fprintf(stderr, "%s: " fmt "\n", log_ident,	\
+				##__VA_ARGS__);				\
+	} while (0)
+
+void ann_log_init(const char *ident, ann_log_fn fn)
+{
+	if (ident)
+		log_ident = ident;
+	log_fn = fn;
+}
+
+int ann_create_pid_directory(const char *pidfilename)
+{
+	struct stat st;
+	char *copy, *dir;
+	int ret = -1;
+
+	if (!(copy = strdup(pidfilename))) {
+		ann_log(LOG_INFO, "Memory allocation failure: %s",
+			strerror(errno));
+		return -1;
+	}
+	dir = dirname(copy);
+
+	if (stat(dir, &st) == 0) {
+		if (S_ISDIR(st.st_mode))
+			ret = 0;
+		else
+			ann_log(LOG_INFO, "Pid-File directory exists but is "
+				"not a directory [%s]", dir);
+	} else if (errno != ENOENT && errno != ENOTDIR) {
+		ann_log(LOG_INFO, "Could not stat pid-file directory "
+			"[%s]: %s", dir, strerror(errno));
+	} else if (mkdir(dir, S_IRUSR|S_IWUSR|S_IXUSR | S_IRGRP|S_IXGRP) == 0) {
+		ret = 0;
+	} else if (errno == EEXIST && stat(dir, &st) == 0 && S_ISDIR(st.st_mode)) {
+		/* someone else made it while we were trying */
+		ret = 0;
+	} else {
+		ann_log(LOG_INFO, "Could not create pid-file directory "
+			"[%s]: %s", dir, strerror(errno));
+	}
+	free(copy);
+	return ret;
+}
+
+/* Remove an old pid file and kill the process it names */
+static int kill_old(const char *pidfilename)
+{
+	char pidbuf[11];
+	unsigned long pid;
+	ssize_t bytes;
+	int fd;
+
+	if ((fd = open(pidfilename, O_RDONLY)) < 0) {
+		/* gone in the meantime: try to create it again */
+		if (errno == ENOENT)
+			return 0;
+		ann_log(LOG_INFO, "Could not open pid-file [%s]: %s",
+			pidfilename, strerror(errno));
+		return -1;
+	}
+	do {
+		bytes = read(fd, pidbuf, sizeof(pidbuf) - 1);
+	} while (bytes < 0 && errno == EINTR);
+	close(fd);
+	if (bytes < 0) {
+		ann_log(LOG_INFO, "Could not read pid-file [%s]: %s",
+			pidfilename, strerror(errno));
+		return -1;
+	}
+	pidbuf[bytes] = '\0';
+
+	if (unlink(pidfilename) < 0) {
+		ann_log(LOG_INFO, "Could not delete pid-file [%s]: %s",
+			pidfilename, strerror(errno));
+		return -1;
+	}
+
+	errno = 0;
+	pid = strtoul(pidbuf, NULL, 10);
+	if (!bytes || pid == 0 || (pid == ULONG_MAX && errno == ERANGE)) {
+		ann_log(LOG_INFO, "Invalid pid in pid-file [%s]", pidfilename);
+		return -1;
+	}
+
+	if (kill(pid, SIGKILL) < 0 && errno != ESRCH) {
+		ann_log(LOG_INFO, "Error killing old process [%lu] "
+			"from pid-file [%s]: %s", pid, pidfilename,
+			strerror(errno));
+		return -1;
+	}
+	ann_log(LOG_INFO, "Killed old %s process [%lu]", log_ident, pid);
+	return 0;
+}
+
+int ann_write_pid_file(const char *pidfilename)
+{
+	char pidbuf[11];
+	ssize_t bytes;
+	int fd, len;
+
+	if (*pidfilename != '/') {
+		ann_log(LOG_INFO, "Invalid pid-file name, must begin with a "
+			"'/' [%s]", pidfilename);
+		return -1;
+	}
+	if (ann_create_pid_directory(pidfilename) < 0)
+		return -1;
+
+	while ((fd = open(pidfilename, O_CREAT|O_EXCL|O_RDWR,
+			  S_IRUSR|S_IWUSR)) < 0) {
+		if (errno != EEXIST) {
+			ann_log(LOG_INFO, "Could not open pid-file [%s]: %s",
+				pidfilename, strerror(errno));
+			return -1;
+		}
+		if (kill_old(pidfilename) < 0)
+			return -1;
+	}
+
+	len = snprintf(pidbuf, sizeof(pidbuf), "%u", (unsigned)getpid());
+	do {
+		bytes = write(fd, pidbuf, len);
+	} while (bytes < 0 && errno == EINTR);
+	close(fd);
+	if (bytes != len) {
+		ann_log(LOG_INFO, "Could not write pid-file [%s]: %s",
+			pidfilename, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+static struct ann_link *links;
+
+struct ann_link *ann_link_get(const char *name)
+{
+	struct ann_link *l;
+	struct ifreq ifr;
+	int s, idx;
+
+	for (l = links; l; l = l->next) {
+		if (!strcmp(l->name, name))
+			return l;
+	}
+
+	if (strlen(name) >= ANN_IFNAMSIZ || !(idx = if_nametoindex(name))) {
+		ann_log(LOG_ERR, "unknown iface %s", name);
+		return NULL;
+	}
+	if ((s = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+		ann_log(LOG_ERR, "socket: %s", strerror(errno));
+		return NULL;
+	}
+	if (!(l = calloc(1, sizeof(*l)))) {
+		ann_log(LOG_ERR, "Memory allocation failure: %s",
+			strerror(errno));
+		close(s);
+		return NULL;
+	}
+	strncpy(l->name, name, ANN_IFNAMSIZ-1);
+	l->ifindex = idx;
+	l->hatype = -1;
+
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, name, IFNAMSIZ-1);
+	if (ioctl(s, SIOCGIFFLAGS, &ifr) == 0)
+		l->flags = ifr.ifr_flags;
+#ifdef SIOCGIFHWADDR
+	if (ioctl(s, SIOCGIFHWADDR, &ifr) == 0) {
+		l->hatype = ifr.ifr_hwaddr.sa_family;
+		/* no way to ask for the length; every type we announce on
+		 * uses Ethernet style addresses */
+		l->halen = 6;
+		memcpy(l->hwaddr, ifr.ifr_hwaddr.sa_data, l->halen);
+	}
+#endif
+	close(s);
+
+	l->next = links;
+	links = l;
+	return l;
+}
+
+/* After ENXIO or ENODEV: the index may belong to a new device later */
+void ann_link_forget(int ifindex)
+{
+	struct ann_link *l, **lp;
+
+	for (lp = &links; (l = *lp); lp = &l->next) {
+		if (l->ifindex == ifindex) {
+			*lp = l->next;
+			free(l);
+			return;
+		}
+	}
+}
+
+void ann_link_flush(void)
+{
+	struct ann_link *l;
+
+	while ((l = links)) {
+		links = l->next;
+		free(l);
+	}
+}
+
+int ann_arp_frame(unsigned char *buf, int hrd, int op, int hln,
+		  const unsigned char *sha, struct in_addr sip,
+		  const unsigned char *tha, struct in_addr tip)
+{
+	unsigned char *p = buf;
+	uint16_t v;
+
+	v = htons(hrd);
+	memcpy(p, &v, 2);
+	v = htons(0x0800);		/* ETH_P_IP */
+	memcpy(p + 2, &v, 2);
+	p[4] = hln;
+	p[5] = 4;
+	v = htons(op);
+	memcpy(p + 6, &v, 2);
+	p += 8;
+
+	memcpy(p, sha, hln);
+	memcpy(p + hln, &sip, 4);
+	p += hln + 4;
+	if (tha)
+		memcpy(p, tha, hln);
+	else
+		memset(p, 0, hln);
+	memcpy(p + hln, &tip, 4);
+	return ANN_ARP_LEN(hln);
+}
+
+#ifdef HAVE_NETINET_ICMP6_H
+int ann_na_frame(unsigned char *buf, const struct in6_addr *target,
+		 const unsigned char *mac)
+{
+	struct nd_neighbor_advert na;
+	struct nd_opt_hdr opt;
+
+	memset(&na, 0, sizeof(na));
+	na.nd_na_type = ND_NEIGHBOR_ADVERT;
+	na.nd_na_code = 0;
+	na.nd_na_cksum = 0;		/* calculated by the kernel */
+	na.nd_na_flags_reserved = ND_NA_FLAG_OVERRIDE;
+	na.nd_na_target = *target;
+
+	/* the length of the option is in units of 8 octets */
+	opt.nd_opt_type = ND_OPT_TARGET_LINKADDR;
+	opt.nd_opt_len = 1;
+
+	memcpy(buf, &na, sizeof(na));
+	memcpy(buf + sizeof(na), &opt, sizeof(opt));
+	memcpy(buf + sizeof(na) + sizeof(opt), mac, 6);
+	return ANN_NA_LEN;
+}
+
+int ann_na_socket(const struct in6_addr *src, int ifindex)
+{
+	struct sockaddr_in6 sin6;
+	int s, hop = 255;	/* required, see RFC 4861 7.1.2 */
+
+	if ((s = socket(AF_INET6, SOCK_RAW, IPPROTO_ICMPV6)) < 0) {
+		ann_log(LOG_ERR, "socket(IPPROTO_ICMPV6) failed: %s",
+			strerror(errno));
+		return -1;
+	}
+	if (setsockopt(s, IPPROTO_IPV6, IPV6_MULTICAST_IF,
+		       &ifindex, sizeof(ifindex)) < 0) {
+		ann_log(LOG_ERR, "setsockopt(IPV6_MULTICAST_IF) failed: %s",
+			strerror(errno));
+		goto err;
+	}
+	if (setsockopt(s, IPPROTO_IPV6, IPV6_MULTICAST_HOPS,
+		       &hop, sizeof(hop)) < 0) {
+		ann_log(LOG_ERR, "setsockopt(IPV6_MULTICAST_HOPS) failed: %s",
+			strerror(errno));
+		goto err;
+	}
+
+	memset(&sin6, 0, sizeof(sin6));
+	sin6.sin6_family = AF_INET6;
+	sin6.sin6_addr = *src;
+	if (bind(s, (struct sockaddr *)&sin6, sizeof(sin6)) < 0) {
+		ann_log(LOG_ERR, "bind() failed: %s", strerror(errno));
+		goto err;
+	}
+	return s;
+err:
+	close(s);
+	return -1;
+}
+
+int ann_na_send(int s, const unsigned char *frame, size_t len)
+{
+	struct sockaddr_in6 dst;
+
+	memset(&dst, 0, sizeof(dst));
+	dst.sin6_family = AF_INET6;
+	inet_pton(AF_INET6, "ff02::1", &dst.sin6_addr);
+	if (sendto(s, frame, len, 0, (struct sockaddr *)&dst, sizeof(dst))
+	    != (ssize_t)len) {
+		ann_log(LOG_ERR, "sendto(ff02::1) failed: %s", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+#endif /* HAVE_NETINET_ICMP6_H */
+
+#ifdef HAVE_LINUX_IF_PACKET_H
+int ann_send_frames(int s, const struct ann_frame *f, int n, int proto,
+		    const unsigned char *dst, int dstlen)
+{
+	struct sockaddr_ll to[ANN_BATCH];
+	struct iovec iov[ANN_BATCH];
+#ifdef HAVE_SENDMMSG
+	struct mmsghdr msg[ANN_BATCH];
+#else
+	struct { struct msghdr msg_hdr; } msg[ANN_BATCH];
+#endif
+	int i, j, done, ret, failed = 0;
+
+	for (i = 0; i < n; i += j) {
+		for (j = 0; j < ANN_BATCH && i + j < n; j++) {
+			memset(&to[j], 0, sizeof(to[j]));
+			to[j].sll_family   = AF_PACKET;
+			to[j].sll_protocol = htons(proto);
+			to[j].sll_ifindex  = f[i+j].ifindex;
+			to[j].sll_halen    = dstlen;
+			memcpy(to[j].sll_addr, dst, dstlen);
+			iov[j].iov_base = f[i+j].data;
+			iov[j].iov_len  = f[i+j].len;
+			memset(&msg[j], 0, sizeof(msg[j]));
+			msg[j].msg_hdr.msg_name    = &to[j];
+			msg[j].msg_hdr.msg_namelen = sizeof(to[j]);
+			msg[j].msg_hdr.msg_iov     = &iov[j];
+			msg[j].msg_hdr.msg_iovlen  = 1;
+		}
+		for (done = 0; done < j; done += ret) {
+#ifdef HAVE_SENDMMSG
+			ret = sendmmsg(s, msg + done, j - done, 0);
+#else
+			ret = sendmsg(s, &msg[done].msg_hdr, 0) == -1 ? -1 : 1;
+#endif
+			if (ret > 0)
+				continue;
+			if (errno == EINTR) {
+				ret = 0;
+				continue;
+			}
+			/* skip the frame the kernel refused */
+			ann_log(LOG_ERR, "sendmmsg: %s", strerror(errno));
+			failed++;
+			ret = 1;
+		}
+	}
+	return failed;
+}
+#endif /* HAVE_LINUX_IF_PACKET_H */
+
+void ann_now(struct timespec *t)
+{
+#ifdef CLOCK_MONOTONIC
+	clock_gettime(CLOCK_MONOTONIC, t);
+#else
+	clock_gettime(CLOCK_REALTIME, t);
+#endif
+}
+
+void ann_add_us(struct timespec *t, long us)
+{
+	t->tv_sec += us / 1000000;
+	t->tv_nsec += (us % 1000000) * 1000L;
+	if (t->tv_nsec >= 1000000000L) {
+		t->tv_sec++;
+		t->tv_nsec -= 1000000000L;
+	}
+}
+
+void ann_add_ms(struct timespec *t, long ms)
+{
+	t->tv_sec += ms / 1000;
+	ann_add_us(t, (ms % 1000) * 1000L);
+}
+
+int ann_before(const struct timespec *a, const struct timespec *b)
+{
+	return a->tv_sec < b->tv_sec ||
+	       (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+void ann_sleep_until(const struct timespec *t)
+{
+#if defined(HAVE_CLOCK_NANOSLEEP) && defined(CLOCK_MONOTONIC)
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, t, NULL) == EINTR)
+		;
+#else
+	struct timespec now, d;
+
+	ann_now(&now);
+	while (ann_before(&now, t)) {
+		d.tv_sec = t->tv_sec - now.tv_sec;
+		d.tv_nsec = t->tv_nsec - now.tv_nsec;
+		if (d.tv_nsec < 0) {
+			d.tv_sec--;
+			d.tv_nsec += 1000000000L;
+		}
+		nanosleep(&d, NULL);
+		ann_now(&now);
+	}
+#endif
+}
+
+void ann_pace_init(struct ann_pace *p, long rate)
+{
+	p->rate = rate;
+	ann_now(&p->next);
+}
+
+void ann_pace(struct ann_pace *p, int n)
+{
+	struct timespec now;
+
+	if (p->rate <= 0)
+		return;
+	ann_now(&now);
+	if (ann_before(&now, &p->next))
+		ann_sleep_until(&p->next);
+	else
+		p->next = now;
+	ann_add_us(&p->next, n * 1000000L / p->rate);
+}
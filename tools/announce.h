@@ -0,0 +1,138 @@
+/*
+   Address announcement core shared by send_arp (both backends) and
+   IPv6addr: pid files, interface lookup with cached link-layer
+   addresses, gratuitous ARP and unsolicited neighbour advertisement
+   frames, batched transmit and monotonic millisecond scheduling.
+
+   The library does not log by itself: messages go to the function set
+   with ann_log_init(), cl_log() in the heartbeat tools, or to stderr.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+   02110-1301, USA.
+*/
+
+#ifndef ANNOUNCE_H
+#define ANNOUNCE_H
+
+#include <stddef.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+typedef void (*ann_log_fn)(int priority, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+/* Messages are "ident: text" on stderr unless fn is set */
+void ann_log_init(const char *ident, ann_log_fn fn);
+
+/*
+ * Create pidfilename for this process.  A process named in an old pid
+ * file is killed first, as a new announcement supersedes it.
+ */
+int ann_write_pid_file(const char *pidfilename);
+int ann_create_pid_directory(const char *pidfilename);
+
+/*
+ * Interfaces, looked up once by name and kept until forgotten.  The
+ * name size is IFNAMSIZ, without <net/if.h>: that clashes with the
+ * <linux/if.h> send_arp uses.
+ */
+#define ANN_IFNAMSIZ	16
+#define ANN_HWADDR_MAX	8
+
+struct ann_link {
+	struct ann_link	*next;
+	char		name[ANN_IFNAMSIZ];
+	int		ifindex;
+	int		flags;		/* IFF_* when looked up */
+	int		hatype;		/* ARPHRD_*, or -1 if unknown */
+	int		halen;		/* 0 if unknown */
+	unsigned char	hwaddr[ANN_HWADDR_MAX];
+};
+
+struct ann_link *ann_link_get(const char *name);
+void ann_link_forget(int ifindex);
+void ann_link_flush(void);
+
+/*
+ * An ARP packet for IPv4 over hardware type hrd with hln byte
+ * addresses, without the link-layer header.  tha NULL is all zeros.
+ * Returns its length, ANN_ARP_LEN(hln).
+ */
+#define ANN_ARP_LEN(hln)	(8 + 2 * ((hln) + 4))
+
+int ann_arp_frame(unsigned char *buf, int hrd, int op, int hln,
+		  const unsigned char *sha, struct in_addr sip,
+		  const unsigned char *tha, struct in_addr tip);
+
+#ifdef HAVE_NETINET_ICMP6_H
+/*
+ * An unsolicited neighbour advertisement (RFC 4861 7.2.6) for target,
+ * carrying the 6 byte mac as target link-layer address.  The kernel
+ * fills in the checksum.  Returns ANN_NA_LEN.
+ */
+#define ANN_NA_LEN	32
+
+int ann_na_frame(unsigned char *buf, const struct in6_addr *target,
+		 const unsigned char *mac);
+
+/*
+ * A raw ICMPv6 socket bound to src that sends to the all-nodes group
+ * out of ifindex with hop limit 255, to be kept for every repeat.
+ */
+int ann_na_socket(const struct in6_addr *src, int ifindex);
+int ann_na_send(int s, const unsigned char *frame, size_t len);
+#endif
+
+#ifdef HAVE_LINUX_IF_PACKET_H
+/*
+ * Frames for a PF_PACKET/SOCK_DGRAM socket, sent in batches of up to
+ * ANN_BATCH with sendmmsg() where there is one.  A frame the kernel
+ * refuses is logged and skipped; returns the number of such frames.
+ */
+#define ANN_BATCH	256
+
+struct ann_frame {
+	int		ifindex;
+	void		*data;		/* not const, like iov_base */
+	size_t		len;
+};
+
+int ann_send_frames(int s, const struct ann_frame *f, int n, int proto,
+		    const unsigned char *dst, int dstlen);
+#endif
+
+/* Scheduling on CLOCK_MONOTONIC, immune to the clock being set */
+void ann_now(struct timespec *t);
+void ann_add_us(struct timespec *t, long us);
+void ann_add_ms(struct timespec *t, long ms);
+int ann_before(const struct timespec *a, const struct timespec *b);
+void ann_sleep_until(const struct timespec *t);
+
+/*
+ * At most rate frames per second, 0 for no limit.  ann_pace() waits
+ * for the slot of the next n frames; after a pause it starts again
+ * from now rather than catching up in a burst.
+ */
+struct ann_pace {
+	long		rate;
+	struct timespec	next;
+};
+
+void ann_pace_init(struct ann_pace *p, long rate);
+void ann_pace(struct ann_pace *p, int n);
+
+#endif /* ANNOUNCE_H */
@@ -0,0 +1,175 @@
+#!/bin/sh
+#
+# findif-bench.sh: measure how findif scales with the size of the
+#		   routing table.
+#
+# For every table size a fresh network namespace is created and filled
+# with synthetic routes, so findif sees them through the same
+# /proc/net/route and netlink interfaces it uses in production.
+# The binary timed is findif_bench, findif built with the -M (one
+# mechanism) and -n (repeat) options that the installed findif leaves
+# out.  Each search mechanism is timed three ways:
+#
+#   single_us	one findif run, start-up and all
+#   exec_us/op	the mean of a series of findif runs
+#   batch_us/op	one findif run searching batch times (-n), divided by
+#		batch: the mechanism without the process around it
+#
+# When valgrind is installed the heap allocation count of one run is
+# reported as well.  All timing happens inside the namespace, so
+# entering it is not part of the figures.
+#
+# Must be run as root. Nothing outside the namespaces is touched.
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public License
+# as published by the Free Software Foundation; either version 2
+# of the License, or (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+#
+
+FINDIF=./findif_bench
+SIZES="100 1000 10000 100000 1000000"
+MECHS="netlink proc"
+BATCH=100
+NETNS=findif-bench-$$
+
+usage() {
+	[ "x$1" = "x0" ] || exec >&2
+	echo "Usage: findif-bench.sh [-f findif] [-s \"sizes\"] [-m \"mechanisms\"] [-b batch]"
+	echo ""
+	echo "  -f findif	findif_bench binary to measure (default ./findif_bench)"
+	echo "  -s sizes	route table sizes (default \"$SIZES\")"
+	echo "  -m mechanisms	findif -M mechanisms to time (default \"$MECHS\")"
+	echo "  -b batch	runs and searches per measurement (default $BATCH)"
+	exit $1
+}
+
+while getopts "f:s:m:b:h" opt; do
+	case $opt in
+	f)	FINDIF=$OPTARG;;
+	s)	SIZES=$OPTARG;;
+	m)	MECHS=$OPTARG;;
+	b)	BATCH=$OPTARG;;
+	h)	usage 0;;
+	*)	usage 1;;
+	esac
+done
+
+[ -x "$FINDIF" ] || {
+	echo "findif-bench: $FINDIF is not executable" >&2
+	exit 1
+}
+case $FINDIF in
+/*)	;;
+*)	FINDIF=`pwd`/$FINDIF;;
+esac
+
+# A microsecond clock for the shell.  date +%N is a GNU and busybox
+# extension; elsewhere use perl, or whole seconds as a last resort.
+if date +%N | grep '^[0-9][0-9]*$' >/dev/null; then
+	CLOCK='echo $((`date +%s%N` / 1000))'
+elif perl -MTime::HiRes -e 1 2>/dev/null; then
+	CLOCK='perl -MTime::HiRes=time -e "printf qq(%d\\n), time * 1e6"'
+else
+	echo "findif-bench: no sub-second clock, timings are in whole seconds" >&2
+	CLOCK='echo $((`date +%s` * 1000000))'
+fi
+
+cleanup() {
+	ip netns del $NETNS 2>/dev/null
+}
+trap cleanup EXIT INT TERM
+
+# gen_routes count dev
+#	Emit "ip -batch" input for count distinct routes, one per /24
+#	starting at 10.0.0.0. Prefix lengths cycle through /24../32 so
+#	the lookup has to compare masks rather than find an exact /32.
+gen_routes() {
+	awk -v n=$1 -v dev=$2 'BEGIN {
+		for (i = 0; i < n; i++) {
+			printf "route add %d.%d.%d.0/%d dev %s metric %d\n",
+				10 + int(i / 65536), int(i / 256) % 256, i % 256,
+				24 + i % 9, dev, i % 100
+		}
+	}'
+}
+
+# Run in the namespace with FINDIF, MECH, TARGET, BATCH and CLOCK set;
+# prints "single exec batch" in microseconds.
+TIMER='
+now_us() { eval "$CLOCK"; }
+run() { OCF_RESKEY_ip=$TARGET "$FINDIF" -C -M $MECH "$@" >/dev/null 2>&1; }
+
+start=`now_us`
+run
+single=$((`now_us` - start))
+
+start=`now_us`
+i=0
+while [ $i -lt $BATCH ]; do
+	run
+	i=$((i + 1))
+done
+exec=$(((`now_us` - start) / BATCH))
+
+start=`now_us`
+run -n $BATCH
+batch=$(((`now_us` - start) / BATCH))
+
+echo $single $exec $batch
+'
+
+printf "%-9s %-8s %-10s %-11s %-12s %s\n" \
+	routes mech single_us exec_us/op batch_us/op allocs
+
+for n in $SIZES; do
+	cleanup
+	ip netns add $NETNS || exit 1
+	ip netns exec $NETNS ip link set lo up
+	dev=lo
+	if ip netns exec $NETNS ip link add bench0 type dummy 2>/dev/null
+	then
+		ip netns exec $NETNS ip link set bench0 up
+		dev=bench0
+	fi
+	gen_routes $n $dev | ip netns exec $NETNS ip -batch - || {
+		echo "findif-bench: could not load $n routes" >&2
+		exit 1
+	}
+	# The generated prefixes do not overlap, so exactly one route
+	# matches any address.  Which one does not change the cost: the
+	# proc mechanism reads all of /proc/net/route and picks the best
+	# line, and netlink asks the kernel, whose lookup does not depend
+	# on where a route sits in a dump.  Take the last route.
+	target=`gen_routes $n $dev | tail -1 | awk '{print $3}' | cut -d/ -f1`
+
+	for mech in $MECHS; do
+		if ! OCF_RESKEY_ip=$target ip netns exec $NETNS \
+			$FINDIF -C -M $mech >/dev/null 2>&1; then
+			printf "%-9s %-8s %s\n" $n $mech "no answer, skipped"
+			continue
+		fi
+		times=`FINDIF=$FINDIF MECH=$mech TARGET=$target BATCH=$BATCH \
+			CLOCK=$CLOCK ip netns exec $NETNS sh -c "$TIMER"`
+
+		allocs=n/a
+		if command -v valgrind >/dev/null 2>&1; then
+			allocs=`OCF_RESKEY_ip=$target ip netns exec $NETNS \
+				valgrind $FINDIF -C -M $mech 2>&1 >/dev/null |
+				sed -n 's/.*total heap usage: \([0-9,]*\) allocs.*/\1/p'`
+		fi
+
+		set -- $times
+		printf "%-9s %-8s %-10s %-11s %-12s %s\n" \
+			$n $mech $1 $2 $3 "$allocs"
+	done
+done
@@ -66,6 +66,7 @@
 #endif
 #include <net/if.h>
 #include <sys/ioctl.h>
+#include <fcntl.h>
 #include <errno.h>
 #ifdef __linux__
 #undef __OPTIMIZE__
@@ -78,6 +79,11 @@
 
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#ifdef HAVE_LINUX_RTNETLINK_H
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include "nl_dump.h"
+#endif
 #include <agent_config.h>
 #include <config.h>
 
@@ -109,6 +115,34 @@
 #endif
 
 static int OutputInCIDR=0;
+static int OutputJSON=0;
+
+/*
+ * What we learned about the route that won, for -J output.
+ * Only mechanisms that can see the whole route fill it in.
+ */
+static struct {
+	int		valid;
+	struct in_addr	dest;
+	struct in_addr	mask;
+	struct in_addr	gateway;
+	long		metric;
+	unsigned int	table;
+} best_route;
+
+/*
+ * Extra keys for the kernel's route lookup (-s, -i, -m), so that
+ * "ip rule" policy routing picks the same table it will use for the
+ * traffic.  -t and -a instead compare the candidates from one or all
+ * tables in a single route dump.
+ */
+static struct {
+	struct in_addr	src;
+	int		iif;
+	unsigned int	mark;
+	unsigned int	table;
+	int		all_tables;
+} route_hints;
 
 
 /*
@@ -128,15 +162,78 @@ typedef int SearchRoute (char *address, struct in_addr *in
 ,        unsigned long *best_netmask, char *errmsg
 ,	int errmsglen);
 
+/*
+ * Interface index, filled from one RTM_GETLINK and one RTM_GETADDR dump.
+ * When it is available, nic validation, the loopback lookup and the
+ * broadcast address are answered from here rather than by scanning
+ * /proc/net/dev and issuing an ioctl per interface.
+ */
+struct if_addr4 {
+	struct in_addr	addr;
+	struct in_addr	bcast;		/* INADDR_ANY if none */
+	int		prefixlen;
+};
+
+struct if_info {
+	char		name[IFNAMSIZ];
+	int		index;
+	unsigned int	flags;
+	int		mtu;		/* -1 if unknown */
+	int		operstate;	/* IF_OPER_*, -1 if unknown */
+	int		naddr;
+	struct if_addr4	*addr;
+};
+
+static struct if_info	*if_table = NULL;
+static int		if_count = 0;
+
 static SearchRoute SearchUsingProcRoute;
 static SearchRoute SearchUsingRouteCmd;
+#ifdef HAVE_LINUX_RTNETLINK_H
+static SearchRoute SearchUsingNetlink;
+#endif
 
 static SearchRoute *search_mechs[] = {
+#ifdef HAVE_LINUX_RTNETLINK_H
+	&SearchUsingNetlink,
+#endif
 	&SearchUsingProcRoute,
 	&SearchUsingRouteCmd,
 	NULL
 };
 
+#ifdef FINDIF_BENCH
+/*
+ * -M and -n only exist in findif_bench, the copy findif-bench.sh times;
+ * the agents' findif does not take them.
+ */
+#define FINDIF_OPTS	"CJs:i:m:t:aM:n:"
+#define BENCH_USAGE	"          [-M mechanism] [-n count]\n"
+#define BENCH_HELP \
+	"    -M mechanism: Find the route only with netlink, proc " \
+		"(/proc/net/route)\n" \
+	"        or route (the route command).\n" \
+	"    -n count: Search count times, to time the mechanism " \
+		"(findif-bench.sh).\n"
+
+/* -M: the names of search_mechs[], in the same order */
+static const char *search_mech_names[] = {
+#ifdef HAVE_LINUX_RTNETLINK_H
+	"netlink",
+#endif
+	"proc",
+	"route",
+	NULL
+};
+#else
+#define FINDIF_OPTS	"CJs:i:m:t:a"
+#define BENCH_USAGE	""
+#define BENCH_HELP	""
+#endif
+
+/* Set by a mechanism whose failure is the answer: try no other one */
+static int search_final = 0;
+
 void GetAddress (char **address, char **netmaskbits
 ,	 char **bcast_arg, char **if_specified);
 
@@ -150,6 +247,11 @@ char * get_first_loopback_netdev(char * ifname);
 int is_loopback_interface(char * ifname);
 char * get_ifname(char * buf, char * ifname);
 
+static int load_if_table(void);
+static struct if_info * if_table_lookup(const char *ifname);
+static int if_table_broadcast(const char *ifname, struct in_addr *in
+,	unsigned long netmask, unsigned long *bcast);
+
 int ConvertQuadToInt(char *dest);
 
 static const char *cmdname = "findif";
@@ -168,62 +270,187 @@ void usage(int ec);
 #define	BAD_BROADCAST	(0L)
 #define	MAXSTR	128
 
+/*
+ * /proc/net/route is read in large chunks straight into one buffer and
+ * parsed in place; on routers with very large tables the old
+ * fgets()/sscanf() loop was where findif spent nearly all its time.
+ */
+#define	PROCROUTE_BUFSIZ	65536
+#define	PROCROUTE_NFIELDS	7	/* Destination .. Mask */
+
+/* Value of each hex digit, 0xff for everything else */
+static unsigned char hexval[256];
+
+static void
+init_hexval(void)
+{
+	int	c;
+
+	if (hexval[0] == 0xff) {
+		return;
+	}
+	memset(hexval, 0xff, sizeof(hexval));
+	for (c = 0; c < 10; ++c) {
+		hexval['0' + c] = c;
+	}
+	for (c = 0; c < 6; ++c) {
+		hexval['a' + c] = hexval['A' + c] = 10 + c;
+	}
+}
+
+/*
+ * Parse one whitespace separated hex field starting at *pp.
+ * Returns 0 and advances *pp past the field on success,
+ * -1 if no hex digits were found before the end of the line.
+ */
+static int
+parse_hex_field(const char **pp, const char *end, unsigned long *val)
+{
+	const char	*p = *pp;
+	unsigned long	v = 0;
+	unsigned char	d;
+
+	while (p < end && (*p == ' ' || *p == '\t')) {
+		++p;
+	}
+	if (p == end || (d = hexval[(unsigned char)*p]) == 0xff) {
+		return -1;
+	}
+	do {
+		v = (v << 4) | d;
+		++p;
+	} while (p < end && (d = hexval[(unsigned char)*p]) != 0xff);
+
+	*pp = p;
+	*val = v;
+	return 0;
+}
+
+/*
+ * Look at one line of /proc/net/route (without its newline).
+ * Lines which do not parse are skipped rather than failing the lookup.
+ * The interface name is only copied out when the route wins.
+ */
+static void
+scan_proc_route_line(const char *line, const char *end, struct in_addr *in
+,	char *best_if, size_t best_iflen, unsigned long *best_netmask
+,	long *best_metric)
+{
+	const char	*tab;
+	const char	*p;
+	unsigned long	field[PROCROUTE_NFIELDS];
+	size_t		namelen;
+	int		j;
+
+	tab = memchr(line, '\t', end - line);
+	if (tab == NULL || tab == line) {
+		return;
+	}
+	p = tab + 1;
+	for (j = 0; j < PROCROUTE_NFIELDS; ++j) {
+		if (parse_hex_field(&p, end, &field[j]) < 0) {
+			return;
+		}
+	}
+
+	/* field[]: dest, gw, flags, refcnt, use, metric, mask */
+	if ((in->s_addr & field[6]) != (in_addr_t)(field[0] & field[6])
+	||	(long)field[5] >= *best_metric) {
+		return;
+	}
+
+	*best_metric = field[5];
+	*best_netmask = field[6];
+	best_route.valid = 1;
+	best_route.dest.s_addr = field[0] & field[6];
+	best_route.mask.s_addr = field[6];
+	best_route.gateway.s_addr = field[1];
+	best_route.metric = field[5];
+	best_route.table = 254;		/* RT_TABLE_MAIN */
+	namelen = tab - line;
+	if (namelen >= best_iflen) {
+		namelen = best_iflen - 1;
+	}
+	memcpy(best_if, line, namelen);
+	best_if[namelen] = EOS;
+}
+
 static int
 SearchUsingProcRoute (char *address, struct in_addr *in
 , 	struct in_addr *addr_out, char *best_if, size_t best_iflen
 ,	unsigned long *best_netmask
 ,	char *errmsg, int errmsglen)
 {
-	unsigned long	flags, refcnt, use, gw, mask;
-	unsigned long   dest;
-	long		metric = LONG_MAX;
+	static char	buf[PROCROUTE_BUFSIZ];
 	long		best_metric = LONG_MAX;
+	size_t		len = 0;
+	int		header = 1;
+	int		discard = 0;
+	int		eof = 0;
 	int		rc = OCF_SUCCESS;
-	
-	char	buf[2048];
-	char	interface[MAXSTR];
-	FILE *routefd = NULL;
+	int		fd;
 
-	if ((routefd = fopen(PROCROUTE, "r")) == NULL) {
+	if ((fd = open(PROCROUTE, O_RDONLY)) < 0) {
 		snprintf(errmsg, errmsglen
 		,	"Cannot open %s for reading"
 		,	PROCROUTE);
-		rc = OCF_ERR_GENERIC; goto out;
+		return(OCF_ERR_GENERIC);
 	}
+	init_hexval();
+	best_route.valid = 0;
 
-	/* Skip first (header) line */
-	if (fgets(buf, sizeof(buf), routefd) == NULL) {
-		snprintf(errmsg, errmsglen
-		,	"Cannot skip first line from %s"
-		,	PROCROUTE);
-		rc = OCF_ERR_GENERIC; goto out;
-	}
-	while (fgets(buf, sizeof(buf), routefd) != NULL) {
-		if (sscanf(buf, "%[^\t]\t%lx%lx%lx%lx%lx%lx%lx"
-		,	interface, &dest, &gw, &flags, &refcnt, &use
-		,	&metric, &mask)
-		!= 8) {
-			snprintf(errmsg, errmsglen, "Bad line in %s: %s"
-			,	PROCROUTE, buf);
+	while (!eof) {
+		char	*p, *nl, *end;
+		ssize_t	n;
+
+		n = read(fd, buf + len, sizeof(buf) - len);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			snprintf(errmsg, errmsglen, "Cannot read %s: %s"
+			,	PROCROUTE, strerror(errno));
 			rc = OCF_ERR_GENERIC; goto out;
 		}
-		if ( (in->s_addr&mask) == (in_addr_t)(dest&mask)
-		&&	metric < best_metric) {
-			best_metric = metric;
-			*best_netmask = mask;
-			strncpy(best_if, interface, best_iflen);
+		eof = (n == 0);
+		len += n;
+		p = buf;
+		end = buf + len;
+
+		while ((nl = memchr(p, '\n', end - p)) != NULL
+		||	(eof && p < end && (nl = end) != NULL)) {
+			if (header || discard) {
+				/* Skip first (header) line */
+				header = discard = 0;
+			}else{
+				scan_proc_route_line(p, nl, in, best_if
+				,	best_iflen, best_netmask, &best_metric);
+			}
+			p = nl + (nl < end);
+		}
+
+		len = end - p;
+		if (len == sizeof(buf)) {
+			/* No sane route line is this long; drop it */
+			discard = 1;
+			len = 0;
+		}else if (len) {
+			memmove(buf, p, len);
 		}
 	}
 
-	if (best_metric == LONG_MAX) {
+	if (header) {
+		snprintf(errmsg, errmsglen
+		,	"Cannot skip first line from %s"
+		,	PROCROUTE);
+		rc = OCF_ERR_GENERIC;
+	}else if (best_metric == LONG_MAX) {
 		snprintf(errmsg, errmsglen, "No route to %s\n", address);
 		rc = OCF_ERR_GENERIC; 
 	}
 
   out:
-	if (routefd) {
-		fclose(routefd);
-	}
+	close(fd);
 
 	return(rc);
 }
@@ -404,17 +631,514 @@ ValidateNetmaskBits (char *netmaskbits, unsigned long *netmask)
 	}
 }
 
+#ifdef HAVE_LINUX_RTNETLINK_H
+static int
+if_table_add_link(struct nlmsghdr *nh, void *arg)
+{
+	struct ifinfomsg	*ifi = NLMSG_DATA(nh);
+	struct rtattr		*rta = IFLA_RTA(ifi);
+	int			len = IFLA_PAYLOAD(nh);
+	struct if_info		*ifp;
+
+	if (nh->nlmsg_type != RTM_NEWLINK) {
+		return 0;
+	}
+	ifp = realloc(if_table, (if_count + 1) * sizeof(*if_table));
+	if (ifp == NULL) {
+		return -1;
+	}
+	if_table = ifp;
+	ifp = &if_table[if_count];
+	memset(ifp, 0, sizeof(*ifp));
+	ifp->index = ifi->ifi_index;
+	ifp->flags = ifi->ifi_flags;
+	ifp->mtu = -1;
+	ifp->operstate = -1;
+
+	for (; RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+		switch (rta->rta_type) {
+		case IFLA_IFNAME:
+			strncpy(ifp->name, RTA_DATA(rta), IFNAMSIZ - 1);
+			break;
+		case IFLA_MTU:
+			ifp->mtu = *(unsigned int *)RTA_DATA(rta);
+			break;
+		case IFLA_OPERSTATE:
+			ifp->operstate = *(unsigned char *)RTA_DATA(rta);
+			break;
+		}
+	}
+	if (ifp->name[0] != EOS) {
+		++if_count;
+	}
+	return 0;
+}
+
+static int
+if_table_add_addr(struct nlmsghdr *nh, void *arg)
+{
+	static struct if_info	*last = NULL;
+	struct ifaddrmsg	*ifa = NLMSG_DATA(nh);
+	struct rtattr		*rta = IFA_RTA(ifa);
+	int			len = IFA_PAYLOAD(nh);
+	struct if_addr4		a, *ap;
+	int			have_addr = 0;
+	int			j;
+
+	if (nh->nlmsg_type != RTM_NEWADDR || ifa->ifa_family != AF_INET) {
+		return 0;
+	}
+	memset(&a, 0, sizeof(a));
+	a.prefixlen = ifa->ifa_prefixlen;
+	for (; RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+		switch (rta->rta_type) {
+		case IFA_LOCAL:
+			memcpy(&a.addr, RTA_DATA(rta), sizeof(a.addr));
+			have_addr = 1;
+			break;
+		case IFA_ADDRESS:
+			if (!have_addr) {
+				memcpy(&a.addr, RTA_DATA(rta), sizeof(a.addr));
+			}
+			break;
+		case IFA_BROADCAST:
+			memcpy(&a.bcast, RTA_DATA(rta), sizeof(a.bcast));
+			break;
+		}
+	}
+
+	/* The kernel dumps addresses grouped by interface */
+	if (last == NULL || last->index != (int)ifa->ifa_index) {
+		last = NULL;
+		for (j = 0; j < if_count; ++j) {
+			if (if_table[j].index == (int)ifa->ifa_index) {
+				last = &if_table[j];
+				break;
+			}
+		}
+		if (last == NULL) {
+			return 0;
+		}
+	}
+	ap = realloc(last->addr, (last->naddr + 1) * sizeof(*ap));
+	if (ap == NULL) {
+		return -1;
+	}
+	last->addr = ap;
+	last->addr[last->naddr++] = a;
+	return 0;
+}
+#endif /* HAVE_LINUX_RTNETLINK_H */
+
+/*
+ * Build the interface index.  Returns 0 if it is usable; on failure,
+ * or where netlink does not exist, callers fall back to ioctl()s.
+ * The dump is done at most once per run.
+ */
+static int
+load_if_table(void)
+{
+#ifdef HAVE_LINUX_RTNETLINK_H
+	static int	loaded = 0;	/* 1: usable, -1: unavailable */
+	int		fd;
+
+	if (loaded) {
+		return loaded > 0 ? 0 : -1;
+	}
+	loaded = -1;
+	if ((fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE)) < 0) {
+		return -1;
+	}
+	if (nl_dump(fd, RTM_GETLINK, AF_PACKET, if_table_add_link, NULL) == 0
+	&&	nl_dump(fd, RTM_GETADDR, AF_INET, if_table_add_addr, NULL) == 0) {
+		loaded = 1;
+	}
+	close(fd);
+	return loaded > 0 ? 0 : -1;
+#else
+	return -1;
+#endif
+}
+
+/*
+ * Find an interface by name.  A ":label" suffix is ignored, just as
+ * SIOCGIFFLAGS ignores it.
+ */
+static struct if_info *
+if_table_lookup(const char *ifname)
+{
+	size_t	len = strcspn(ifname, ":");
+	int	j;
+
+	if (load_if_table() < 0) {
+		return NULL;
+	}
+	for (j = 0; j < if_count; ++j) {
+		if (strncmp(if_table[j].name, ifname, len) == 0
+		&&	if_table[j].name[len] == EOS) {
+			return &if_table[j];
+		}
+	}
+	return NULL;
+}
+
+/*
+ * If ifname already carries an address in the same subnet as in,
+ * report the broadcast address the kernel has for it.
+ * netmask and *bcast are in network byte order.
+ */
+static int
+if_table_broadcast(const char *ifname, struct in_addr *in
+,	unsigned long netmask, unsigned long *bcast)
+{
+	struct if_info	*ifp = if_table_lookup(ifname);
+	int		j;
+
+	if (ifp == NULL) {
+		return -1;
+	}
+	for (j = 0; j < ifp->naddr; ++j) {
+		struct if_addr4	*a = &ifp->addr[j];
+
+		if (a->bcast.s_addr == INADDR_ANY
+		||	a->prefixlen != netmask_bits(ntohl(netmask))
+		||	(a->addr.s_addr & netmask) != (in->s_addr & netmask)) {
+			continue;
+		}
+		*bcast = a->bcast.s_addr;
+		return 0;
+	}
+	return -1;
+}
+
+#ifdef HAVE_LINUX_RTNETLINK_H
+/* The parts of an RTM_NEWROUTE message findif cares about */
+struct nl_route {
+	int		type;
+	int		cloned;
+	unsigned int	table;
+	int		dst_len;
+	struct in_addr	dst;
+	struct in_addr	gateway;
+	int		oif;
+	long		metric;
+};
+
+/* Candidate filter and result for a route dump */
+struct nl_route_match {
+	struct in_addr	addr;
+	unsigned int	table;		/* 0: any table but local */
+	int		oif;		/* 0: any interface */
+	int		found;
+	struct nl_route	best;
+};
+
+static void
+nl_addattr(struct nlmsghdr *nh, int type, const void *data, int len)
+{
+	struct rtattr	*rta;
+
+	rta = (struct rtattr *)((char *)nh + NLMSG_ALIGN(nh->nlmsg_len));
+	rta->rta_type = type;
+	rta->rta_len = RTA_LENGTH(len);
+	memcpy(RTA_DATA(rta), data, len);
+	nh->nlmsg_len = NLMSG_ALIGN(nh->nlmsg_len) + RTA_ALIGN(rta->rta_len);
+}
+
+static void
+nl_parse_route(struct nlmsghdr *nh, struct nl_route *r)
+{
+	struct rtmsg	*rtm = NLMSG_DATA(nh);
+	struct rtattr	*rta = RTM_RTA(rtm);
+	int		len = RTM_PAYLOAD(nh);
+
+	memset(r, 0, sizeof(*r));
+	r->type = rtm->rtm_type;
+	r->cloned = (rtm->rtm_flags & RTM_F_CLONED) != 0;
+	r->table = rtm->rtm_table;
+	r->dst_len = rtm->rtm_dst_len;
+
+	for (; RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+		switch (rta->rta_type) {
+		case RTA_DST:
+			memcpy(&r->dst, RTA_DATA(rta), sizeof(r->dst));
+			break;
+		case RTA_GATEWAY:
+			memcpy(&r->gateway, RTA_DATA(rta), sizeof(r->gateway));
+			break;
+		case RTA_OIF:
+			r->oif = *(int *)RTA_DATA(rta);
+			break;
+		case RTA_PRIORITY:
+			r->metric = *(unsigned int *)RTA_DATA(rta);
+			break;
+		case RTA_TABLE:
+			r->table = *(unsigned int *)RTA_DATA(rta);
+			break;
+		case RTA_MULTIPATH:
+			/* Report the first nexthop */
+			if (r->oif == 0 && RTA_PAYLOAD(rta) >= sizeof(struct rtnexthop)) {
+				struct rtnexthop *nhp = RTA_DATA(rta);
+				struct rtattr	*nrta = RTNH_DATA(nhp);
+				int		nlen = nhp->rtnh_len - sizeof(*nhp);
+
+				r->oif = nhp->rtnh_ifindex;
+				for (; RTA_OK(nrta, nlen); nrta = RTA_NEXT(nrta, nlen)) {
+					if (nrta->rta_type == RTA_GATEWAY) {
+						memcpy(&r->gateway, RTA_DATA(nrta)
+						,	sizeof(r->gateway));
+					}
+				}
+			}
+			break;
+		}
+	}
+}
+
+/*
+ * Ask the kernel which route it would use for in, with the
+ * route_hints applied.  Returns 0, or -1 with errno set.
+ */
+static int
+nl_route_get(int fd, struct in_addr *in, struct nl_route *r)
+{
+	static unsigned int	seq;
+	char			req[NLMSG_SPACE(sizeof(struct rtmsg)) + 128];
+	struct nlmsghdr		*rq = (struct nlmsghdr *)req;
+	struct rtmsg		*rtm = NLMSG_DATA(rq);
+	struct sockaddr_nl	nladdr;
+	socklen_t		addrlen = sizeof(nladdr);
+	char			buf[4096];
+	struct nlmsghdr		*nh;
+	ssize_t			n;
+
+	memset(req, 0, sizeof(req));
+	rq->nlmsg_len = NLMSG_LENGTH(sizeof(*rtm));
+	rq->nlmsg_type = RTM_GETROUTE;
+	rq->nlmsg_flags = NLM_F_REQUEST;
+	rq->nlmsg_seq = ++seq;
+	rtm->rtm_family = AF_INET;
+	rtm->rtm_dst_len = 32;
+#ifdef RTM_F_FIB_MATCH
+	/* Return the matching FIB entry, prefix length and all */
+	rtm->rtm_flags = RTM_F_FIB_MATCH | RTM_F_LOOKUP_TABLE;
+#endif
+	nl_addattr(rq, RTA_DST, &in->s_addr, sizeof(in->s_addr));
+	if (route_hints.src.s_addr != INADDR_ANY) {
+		rtm->rtm_src_len = 32;
+		nl_addattr(rq, RTA_SRC, &route_hints.src.s_addr
+		,	sizeof(route_hints.src.s_addr));
+	}
+	if (route_hints.iif) {
+		nl_addattr(rq, RTA_IIF, &route_hints.iif
+		,	sizeof(route_hints.iif));
+	}
+	if (route_hints.mark) {
+		nl_addattr(rq, RTA_MARK, &route_hints.mark
+		,	sizeof(route_hints.mark));
+	}
+	memset(&nladdr, 0, sizeof(nladdr));
+	nladdr.nl_family = AF_NETLINK;
+	if (sendto(fd, req, rq->nlmsg_len, 0
+	,	(struct sockaddr *)&nladdr, sizeof(nladdr)) < 0) {
+		return -1;
+	}
+	/* The kernel addresses its answer to the port id bound by sendto */
+	if (getsockname(fd, (struct sockaddr *)&nladdr, &addrlen) < 0) {
+		return -1;
+	}
+	for (;;) {
+		do {
+			n = recv(fd, buf, sizeof(buf), 0);
+		} while (n < 0 && errno == EINTR);
+		if (n < 0) {
+			return -1;
+		}
+
+		for (nh = (struct nlmsghdr *)buf; NLMSG_OK(nh, (size_t)n)
+		;	nh = NLMSG_NEXT(nh, n)) {
+			/* Only the kernel's answer to this request counts */
+			if (nh->nlmsg_pid != nladdr.nl_pid
+			||	nh->nlmsg_seq != rq->nlmsg_seq) {
+				continue;
+			}
+			if (nh->nlmsg_type == NLMSG_ERROR) {
+				struct nlmsgerr	*err = NLMSG_DATA(nh);
+
+				errno = err->error ? -err->error : EPROTO;
+				return -1;
+			}
+			if (nh->nlmsg_type == RTM_NEWROUTE) {
+				nl_parse_route(nh, r);
+				return 0;
+			}
+		}
+	}
+}
+
+/* The name of a route type the kernel refuses traffic with, or NULL */
+static const char *
+nl_reject_name(int type)
+{
+	switch (type) {
+	case RTN_UNREACHABLE:	return "unreachable";
+	case RTN_PROHIBIT:	return "prohibit";
+	case RTN_BLACKHOLE:	return "blackhole";
+	}
+	return NULL;
+}
+
+/*
+ * Route dump callback: keep the longest, then cheapest, match.  Routes
+ * that reject the traffic compete too, so that they are reported
+ * rather than passed over for a shorter route.
+ */
+static int
+nl_route_candidate(struct nlmsghdr *nh, void *arg)
+{
+	struct nl_route_match	*m = arg;
+	struct nl_route		r;
+	in_addr_t		mask;
+
+	if (nh->nlmsg_type != RTM_NEWROUTE) {
+		return 0;
+	}
+	if (((struct rtmsg *)NLMSG_DATA(nh))->rtm_family != AF_INET) {
+		return 0;
+	}
+	nl_parse_route(nh, &r);
+	if (r.type == RTN_UNICAST ? r.oif == 0 : nl_reject_name(r.type) == NULL) {
+		return 0;
+	}
+	if (r.table == RT_TABLE_LOCAL
+	||	(m->table && r.table != m->table)
+	||	(m->oif && r.oif != m->oif)) {
+		return 0;
+	}
+	mask = r.dst_len ? htonl(0xffffffffUL << (32 - r.dst_len)) : 0;
+	if ((m->addr.s_addr & mask) != (r.dst.s_addr & mask)) {
+		return 0;
+	}
+	if (m->found && (r.dst_len < m->best.dst_len
+	||	(r.dst_len == m->best.dst_len && r.metric >= m->best.metric))) {
+		return 0;
+	}
+	m->found = 1;
+	m->best = r;
+	return 0;
+}
+
+static int
+SearchUsingNetlink (char *address, struct in_addr *in
+,	struct in_addr *addr_out, char *best_if, size_t best_iflen
+,	unsigned long *best_netmask
+,	char *errmsg, int errmsglen)
+{
+	struct nl_route		r;
+	struct nl_route_match	m;
+	struct if_info		*ifp = NULL;
+	char			ifname[IF_NAMESIZE];
+	int			lookup_errno = 0;
+	int			j;
+	int			fd;
+
+	if ((fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE)) < 0) {
+		return -1;
+	}
+
+	memset(&m, 0, sizeof(m));
+	m.addr = *in;
+	m.table = route_hints.table;
+
+	/* The kernel cannot be asked to look in one given table */
+	if (!route_hints.all_tables && !route_hints.table) {
+		if (nl_route_get(fd, in, &r) < 0) {
+			/*
+			 * errno does not tell a reject route from a refused
+			 * lookup (no forwarding, martian source).  Only a
+			 * reject route the dump of the main table below
+			 * returns is final.
+			 */
+			lookup_errno = errno;
+			m.table = RT_TABLE_MAIN;
+		}else if (nl_reject_name(r.type)) {
+			m.found = 1;
+			m.best = r;
+		}else if (r.type == RTN_UNICAST && !r.cloned) {
+			m.found = 1;
+			m.best = r;
+		}else{
+			/*
+			 * Either the kernel predates RTM_F_FIB_MATCH, so the
+			 * prefix length is not reported, or the address is
+			 * already local and we want the route it was
+			 * configured from.  Look that up in the table the
+			 * kernel chose.
+			 */
+			if (r.type == RTN_UNICAST) {
+				m.table = r.table;
+				m.oif = r.oif;
+			}
+		}
+	}
+	if (!m.found
+	&&	nl_dump(fd, RTM_GETROUTE, AF_INET, nl_route_candidate, &m) < 0) {
+		close(fd);
+		return -1;
+	}
+	close(fd);
+
+	if (lookup_errno && !nl_reject_name(m.best.type)) {
+		snprintf(errmsg, errmsglen, "No route to %s: %s\n"
+		,	address, strerror(lookup_errno));
+		return(OCF_ERR_GENERIC);
+	}
+	if (!m.found) {
+		/* Leave loopback and friends to the next mechanism */
+		return -1;
+	}
+	if (nl_reject_name(m.best.type)) {
+		snprintf(errmsg, errmsglen, "No route to %s: %s route %s/%d"
+		" in table %u\n", address, nl_reject_name(m.best.type)
+		,	inet_ntoa(m.best.dst), m.best.dst_len, m.best.table);
+		search_final = 1;
+		return(OCF_ERR_GENERIC);
+	}
+
+	if (load_if_table() == 0) {
+		for (j = 0; j < if_count; ++j) {
+			if (if_table[j].index == m.best.oif) {
+				ifp = &if_table[j];
+				break;
+			}
+		}
+	}
+	if (ifp == NULL && if_indextoname(m.best.oif, ifname) == NULL) {
+		snprintf(errmsg, errmsglen, "No interface found.");
+		return(OCF_ERR_GENERIC);
+	}
+	strncpy(best_if, ifp ? ifp->name : ifname, best_iflen - 1);
+	best_if[best_iflen - 1] = EOS;
+	*best_netmask = m.best.dst_len
+	?	htonl(0xffffffffUL << (32 - m.best.dst_len)) : 0;
+
+	best_route.valid = 1;
+	best_route.dest.s_addr = m.best.dst.s_addr & *best_netmask;
+	best_route.mask.s_addr = *best_netmask;
+	best_route.gateway = m.best.gateway;
+	best_route.metric = m.best.metric;
+	best_route.table = m.best.table;
+	return(OCF_SUCCESS);
+}
+#endif /* HAVE_LINUX_RTNETLINK_H */
+
 int
 ValidateIFName(const char *ifname, struct ifreq *ifr) 
 {
  	int skfd = -1;
 	char *colonptr;
+	struct if_info *ifp;
 
- 	if ( (skfd = socket(PF_INET, SOCK_DGRAM, 0)) == -1 ) {
- 		fprintf(stderr, "%s\n", strerror(errno));
- 		return -2;
- 	}
- 
 	strncpy(ifr->ifr_name, ifname, IFNAMSIZ);
 
 	/* Contain a ":"?  Probably an error, but treat as warning at present */
@@ -422,6 +1146,21 @@ ValidateIFName(const char *ifname, struct ifreq *ifr)
 		fprintf(stderr, "%s: warning: name may be invalid\n",
 		  ifr->ifr_name);
 	}
+
+	if (load_if_table() == 0) {
+		if ((ifp = if_table_lookup(ifname)) == NULL) {
+			fprintf(stderr, "%s: unknown interface: %s\n"
+			,	ifr->ifr_name, strerror(ENODEV));
+			return -1;
+		}
+		ifr->ifr_flags = ifp->flags;
+		return 0;
+	}
+
+ 	if ( (skfd = socket(PF_INET, SOCK_DGRAM, 0)) == -1 ) {
+ 		fprintf(stderr, "%s\n", strerror(errno));
+ 		return -2;
+ 	}
  
  	if (ioctl(skfd, SIOCGIFFLAGS, ifr) < 0) {
  		fprintf(stderr, "%s: unknown interface: %s\n"
@@ -462,6 +1201,19 @@ get_first_loopback_netdev(char * output)
 		goto out;
 	}
 
+	if (load_if_table() == 0) {
+		int	j;
+
+		for (j = 0; j < if_count; ++j) {
+			if (if_table[j].flags & IFF_LOOPBACK) {
+				strncpy(output, if_table[j].name, IFNAMSIZ);
+				rc = output;
+				break;
+			}
+		}
+		goto out;
+	}
+
 	fd = fopen(PATH_PROC_NET_DEV, "r");
 	if (!fd) {
 		fprintf(stderr, "Warning: cannot open %s (%s).\n",
@@ -556,6 +1308,151 @@ int ConvertQuadToInt(char *dest)
         return (bits);
 }
 
+/* RFC 2863 operational states, in IF_OPER_* order */
+static const char *operstate_names[] = {
+	"unknown", "notpresent", "down", "lowerlayerdown",
+	"testing", "dormant", "up"
+};
+
+static void
+print_json_string(const char *key, const char *val)
+{
+	printf("\"%s\":\"", key);
+	for (; *val; ++val) {
+		if (*val == '"' || *val == '\\') {
+			putchar('\\');
+		}
+		if ((unsigned char)*val < 0x20) {
+			printf("\\u%04x", *val);
+		}else{
+			putchar(*val);
+		}
+	}
+	putchar('"');
+}
+
+/*
+ * -J output: everything the agents want to know about the chosen
+ * interface as one JSON object on one line.
+ * netmask is in host byte order, as printed by the text formats.
+ */
+static void
+print_json(const char *ifname, unsigned long netmask, const char *bcast)
+{
+	struct if_info	*ifp = if_table_lookup(ifname);
+	char		buf[INET_ADDRSTRLEN];
+	struct in_addr	a;
+	int		ifindex;
+
+	putchar('{');
+	print_json_string("interface", ifname);
+	a.s_addr = htonl(netmask);
+	printf(",\"netmask\":\"%s\",\"cidr_netmask\":%d,"
+	,	inet_ntop(AF_INET, &a, buf, sizeof(buf))
+	,	netmask_bits(netmask));
+	print_json_string("broadcast", bcast);
+
+	if (best_route.valid) {
+		printf(",\"prefix\":\"%s/%d\""
+		,	inet_ntop(AF_INET, &best_route.dest, buf, sizeof(buf))
+		,	best_route.mask.s_addr == 0 ? 0
+		:	netmask_bits(ntohl(best_route.mask.s_addr)));
+		printf(",\"gateway\":\"%s\",\"metric\":%ld,\"table\":%u"
+		,	inet_ntop(AF_INET, &best_route.gateway, buf, sizeof(buf))
+		,	best_route.metric, best_route.table);
+	}else{
+		printf(",\"prefix\":null,\"gateway\":null,\"metric\":null"
+		",\"table\":null");
+	}
+
+	ifindex = ifp ? ifp->index : (int)if_nametoindex(ifname);
+	if (ifindex > 0) {
+		printf(",\"ifindex\":%d", ifindex);
+	}else{
+		printf(",\"ifindex\":null");
+	}
+	if (ifp && ifp->mtu >= 0) {
+		printf(",\"mtu\":%d", ifp->mtu);
+	}else{
+		printf(",\"mtu\":null");
+	}
+	if (ifp && ifp->operstate >= 0) {
+		printf(",\"link\":\"%s\""
+		,	ifp->operstate < (int)(sizeof(operstate_names)
+				/ sizeof(operstate_names[0]))
+		?	operstate_names[ifp->operstate] : "unknown");
+	}else{
+		printf(",\"link\":null");
+	}
+	printf("}\n");
+}
+
+/* All of s as an unsigned number, 0x.. in hex; -1 if it is not one */
+static int
+parse_number(const char *s, unsigned int *v)
+{
+	unsigned long	n;
+	char *		end;
+
+	if (!isdigit((unsigned char)*s)) {
+		return -1;
+	}
+	errno = 0;
+	n = strtoul(s, &end, 0);
+	if (*end != EOS || errno || n > UINT_MAX) {
+		return -1;
+	}
+	*v = n;
+	return 0;
+}
+
+/*
+ * -t: a routing table by number, or by the name iproute2 gives it in
+ * rt_tables.  Returns -1 if it is neither, or if it is 0 or the local
+ * table, which hold no routes to pick from.
+ */
+static int
+parse_table(const char *s, unsigned int *table)
+{
+	static const char *	files[] = {
+		"/etc/iproute2/rt_tables",
+		"/usr/share/iproute2/rt_tables",
+		NULL
+	};
+	char		line[256];
+	char		name[64];
+	unsigned int	id;
+	FILE *		fp;
+	int		j;
+
+	if (parse_number(s, table) == 0) {
+		return *table && *table != 255 ? 0 : -1;
+	}
+	if (strcmp(s, "main") == 0) {
+		*table = 254;		/* RT_TABLE_MAIN */
+		return 0;
+	}
+	if (strcmp(s, "default") == 0) {
+		*table = 253;		/* RT_TABLE_DEFAULT */
+		return 0;
+	}
+	for (j = 0; files[j]; ++j) {
+		if ((fp = fopen(files[j], "r")) == NULL) {
+			continue;
+		}
+		while (fgets(line, sizeof(line), fp) != NULL) {
+			if (sscanf(line, "%u %63s", &id, name) == 2
+			&&	strcmp(name, s) == 0) {
+				fclose(fp);
+				*table = id;
+				return id && id != 255 ? 0 : -1;
+			}
+		}
+		fclose(fp);
+	}
+	return -1;
+}
+
 int
 main(int argc, char ** argv) {
 
@@ -569,7 +1466,13 @@ main(int argc, char ** argv) {
 	char *	if_specified = NULL;
 	struct ifreq	ifr;
 	unsigned long	best_netmask = INT_MAX;
+#ifdef FINDIF_BENCH
+	SearchRoute *	search_only = NULL;
+	unsigned int	repeat = 1;
+	int		j;
+#endif
 	int		argerrs	= 0;
+	int		ch;
 
 	cmdname=argv[0];
 
@@ -578,18 +1481,78 @@ main(int argc, char ** argv) {
 	memset(&in, 0, sizeof(in));
 	memset(&ifr, 0, sizeof(ifr));
 
-	switch (argc) {
-	case 1:	/* No -C argument */
-		break;
-	case 2: /* Hopefully a -C argument */
-		if (strncmp(argv[1], "-C", sizeof("-C")) != 0) {
+	while ((ch = getopt(argc, argv, FINDIF_OPTS)) != EOF) {
+		switch (ch) {
+		case 'C':
+			OutputInCIDR=1;
+			break;
+		case 'J':
+			OutputJSON=1;
+			break;
+		case 's':
+			if (inet_pton(AF_INET, optarg, &route_hints.src) <= 0) {
+				fprintf(stderr, "Invalid source address [%s]\n"
+				,	optarg);
+				argerrs=1;
+			}
+			break;
+		case 'i':
+			if ((route_hints.iif = if_nametoindex(optarg)) == 0) {
+				fprintf(stderr, "%s: unknown interface\n"
+				,	optarg);
+				argerrs=1;
+			}
+			break;
+		case 'm':
+			if (parse_number(optarg, &route_hints.mark) < 0) {
+				fprintf(stderr, "Invalid firewall mark [%s]\n"
+				,	optarg);
+				argerrs=1;
+			}
+			break;
+		case 't':
+			if (parse_table(optarg, &route_hints.table) < 0) {
+				fprintf(stderr, "Unknown routing table [%s]\n"
+				,	optarg);
+				argerrs=1;
+			}
+			break;
+		case 'a':
+			route_hints.all_tables=1;
+			break;
+#ifdef FINDIF_BENCH
+		case 'M':
+			for (j = 0; search_mech_names[j]; ++j) {
+				if (strcmp(optarg, search_mech_names[j]) == 0) {
+					search_only = search_mechs[j];
+					break;
+				}
+			}
+			if (search_only == NULL) {
+				fprintf(stderr, "Unknown mechanism [%s]\n"
+				,	optarg);
+				argerrs=1;
+			}
+			break;
+		case 'n':
+			if (parse_number(optarg, &repeat) < 0 || repeat == 0) {
+				fprintf(stderr, "Invalid count [%s]\n", optarg);
+				argerrs=1;
+			}
+			break;
+#endif
+		default:
 			argerrs=1;
+			break;
 		}
-		OutputInCIDR=1;
-		break;
-	default:
+	}
+	if (optind != argc) {
+		argerrs=1;
+	}
+	/* The kernel takes a lookup with an input interface as forwarded */
+	if (route_hints.iif && route_hints.src.s_addr == INADDR_ANY) {
+		fprintf(stderr, "-i needs a source address (-s)\n");
 		argerrs=1;
-		break;
 	}
 	if (argerrs) {
 		usage(OCF_ERR_ARGS);
@@ -631,21 +1594,38 @@ main(int argc, char ** argv) {
 		strncpy(best_if, if_specified, sizeof(best_if));
 		*(best_if + sizeof(best_if) - 1) = '\0';
 	}else{
-		SearchRoute **sr = search_mechs;
+#ifdef FINDIF_BENCH
+		SearchRoute *only[2];
+		unsigned int k;
+#endif
+		SearchRoute **sr;
 		char errmsg[MAXSTR] = "No valid mecahnisms";
 		int rc = OCF_ERR_GENERIC;
 
 		strcpy(best_if, "UNKNOWN");
+#ifdef FINDIF_BENCH
+		only[0] = search_only;
+		only[1] = NULL;
 
-		while (*sr) {
-			errmsg[0] = '\0';
-			rc = (*sr) (address, &in, &addr_out, best_if
-			,	sizeof(best_if)
-			,	&best_netmask, errmsg, sizeof(errmsg));
-			if (!rc) {		/* Mechanism worked */
-				break;
+		/* -n: the same search again and again, to time it */
+		for (k = 0; k < repeat && (k == 0 || rc == 0); ++k)
+#endif
+		{
+#ifdef FINDIF_BENCH
+			sr = search_only ? only : search_mechs;
+#else
+			sr = search_mechs;
+#endif
+			while (*sr) {
+				errmsg[0] = '\0';
+				rc = (*sr) (address, &in, &addr_out, best_if
+				,	sizeof(best_if)
+				,	&best_netmask, errmsg, sizeof(errmsg));
+				if (!rc || search_final) {	/* Mechanism answered */
+					break;
+				}
+				sr++;
 			}
-			sr++;
 		}
 		if (rc != 0) {	/* No route, or all mechanisms failed */
 			if (*errmsg) {
@@ -666,6 +1646,7 @@ main(int argc, char ** argv) {
 		if (0 == strncmp(address, "127", 3)) {
 			if (NULL != get_first_loopback_netdev(best_if)) {
 				best_netmask = 0x000000ff;
+				best_route.valid = 0;
 			} else {
 				fprintf(stderr, "No loopback interface found.\n");
 				return(OCF_ERR_GENERIC);
@@ -692,7 +1673,9 @@ main(int argc, char ** argv) {
  		}
 
 		best_netmask = htonl(best_netmask);
-		if (!OutputInCIDR) {
+		if (OutputJSON) {
+			print_json(best_if, best_netmask, bcast_arg);
+		}else if (!OutputInCIDR) {
 			printf("%s\tnetmask %d.%d.%d.%d\tbroadcast %s\n"
 			,	best_if
                 	,       (int)((best_netmask>>24) & 0xff)
@@ -710,8 +1693,12 @@ main(int argc, char ** argv) {
 		/* No, we use a common broadcast address convention */
 		unsigned long	def_bcast;
 
+		/* The interface's own, if it is already on this subnet */
+		if (if_table_broadcast(best_if, &in, best_netmask
+		,	&def_bcast) < 0) {
 			/* Common broadcast address */
-		def_bcast = (in.s_addr | (~best_netmask));
+			def_bcast = (in.s_addr | (~best_netmask));
+		}
 #if DEBUG
 		fprintf(stderr, "best_netmask = %08lx, def_bcast = %08lx\n"
 		,	best_netmask,  def_bcast);
@@ -720,7 +1707,16 @@ main(int argc, char ** argv) {
 		/* Make things a bit more machine-independent */
 		best_netmask = htonl(best_netmask);
 		def_bcast = htonl(def_bcast);
-		if (!OutputInCIDR) {
+		if (OutputJSON) {
+			char	bcast[INET_ADDRSTRLEN];
+
+			snprintf(bcast, sizeof(bcast), "%d.%d.%d.%d"
+			,       (int)((def_bcast>>24) & 0xff)
+			,       (int)((def_bcast>>16) & 0xff)
+			,       (int)((def_bcast>>8) & 0xff)
+			,       (int)(def_bcast & 0xff));
+			print_json(best_if, best_netmask, bcast);
+		}else if (!OutputInCIDR) {
 			printf("%s\tnetmask %d.%d.%d.%d\tbroadcast %d.%d.%d.%d\n"
 			,       best_if
 			,       (int)((best_netmask>>24) & 0xff)
@@ -750,10 +1746,25 @@ usage(int ec)
 	fprintf(stderr, "\n"
 		"%s version 2.99.1 Copyright Alan Robertson\n"
 		"\n"
-		"Usage: %s [-C]\n"
+		"Usage: %s [-C|-J] [-s src] [-i iif] [-m mark] [-t table] [-a]\n"
+		BENCH_USAGE
 		"Options:\n"
 		"    -C: Output netmask as the number of bits rather "
 			"than as 4 octets.\n"
+		"    -J: Output a JSON object which also carries the "
+			"matched route,\n"
+		"        ifindex, MTU and link state.\n"
+		"    -s, -i, -m: Look the route up as the kernel would "
+			"for traffic from\n"
+		"        this source address, arriving on this interface, "
+			"or carrying\n"
+		"        this firewall mark (Linux only).  -i needs -s.\n"
+		"    -t table, -a: Pick the best match from this or all "
+			"routing tables\n"
+		"        in one dump, rather than asking the kernel for "
+			"its decision.\n"
+		"        table is a number or a name from rt_tables.\n"
+		BENCH_HELP
 		"Environment variables:\n"
 		"OCF_RESKEY_ip		 ip address (mandatory!)\n"
 		"OCF_RESKEY_cidr_netmask netmask of interface\n"
@@ -0,0 +1,94 @@
+/*
+   Internet checksum (RFC 1071) for the tools that build their own
+   packets.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+   02110-1301, USA.
+*/
+
+#include <config.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include "inet_csum.h"
+
+/*
+ * 32 bit words go into a 64 bit accumulator, so the loop never has to
+ * deal with carries; a 32 bit word adds the same to a ones' complement
+ * sum as its two halves.  memcpy() keeps unaligned buffers safe and
+ * compiles to plain loads.
+ */
+uint32_t inet_csum_partial(const void *buf, size_t len, uint32_t sum)
+{
+	const unsigned char *p = buf;
+	uint64_t acc = sum;
+	uint32_t w0, w1, w2, w3;
+	uint16_t w;
+
+	while (len >= 16) {
+		memcpy(&w0, p, 4);
+		memcpy(&w1, p + 4, 4);
+		memcpy(&w2, p + 8, 4);
+		memcpy(&w3, p + 12, 4);
+		acc += (uint64_t)w0 + w1 + w2 + w3;
+		p += 16;
+		len -= 16;
+	}
+	while (len >= 4) {
+		memcpy(&w0, p, 4);
+		acc += w0;
+		p += 4;
+		len -= 4;
+	}
+	if (len >= 2) {
+		memcpy(&w, p, 2);
+		acc += w;
+		p += 2;
+		len -= 2;
+	}
+	if (len) {
+		/* pad the odd byte with a zero byte after it */
+		w = 0;
+		memcpy(&w, p, 1);
+		acc += w;
+	}
+
+	acc = (acc & 0xFFFFFFFF) + (acc >> 32);
+	acc = (acc & 0xFFFFFFFF) + (acc >> 32);
+	return inet_csum_fold(acc);
+}
+
+uint16_t inet_csum(const void *buf, size_t len)
+{
+	return ~inet_csum_fold(inet_csum_partial(buf, len, 0));
+}
+
+uint16_t inet_csum_pseudo(int family, const void *src, const void *dst,
+			  uint8_t proto, const void *data, size_t len)
+{
+	size_t alen = family == AF_INET ? 4 : 16;
+	uint32_t sum;
+	uint16_t check;
+
+	sum = inet_csum_partial(src, alen, 0);
+	sum = inet_csum_partial(dst, alen, sum);
+	/* IPv4 has a 16 bit length, IPv6 a 32 bit one */
+	sum = inet_csum_add32(sum, htonl(len));
+	sum = inet_csum_add32(sum, htonl(proto));
+	sum = inet_csum_partial(data, len, sum);
+
+	check = ~inet_csum_fold(sum);
+	return check ? check : 0xFFFF;
+}
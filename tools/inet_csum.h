@@ -0,0 +1,67 @@
+/*
+   Internet checksum (RFC 1071) for the tools that build their own
+   packets.
+
+   Sums are kept the way the bytes lie in memory: a checksum computed
+   here is stored into a header as is, and 16 or 32 bit fields in
+   network byte order are added without swapping them.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+   02110-1301, USA.
+*/
+
+#ifndef INET_CSUM_H
+#define INET_CSUM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Add len bytes at buf to sum and fold the result to 16 bits.  Only the
+ * last piece of a checksummed area may have an odd length.
+ */
+uint32_t inet_csum_partial(const void *buf, size_t len, uint32_t sum);
+
+/* The checksum of buf, e.g. for an IPv4 header with its check zeroed */
+uint16_t inet_csum(const void *buf, size_t len);
+
+/*
+ * The TCP or UDP checksum of data, including the pseudo-header for the
+ * 4 (AF_INET) or 16 byte addresses src and dst.  0 comes back as
+ * 0xFFFF, as UDP needs and TCP does not mind.
+ */
+uint16_t inet_csum_pseudo(int family, const void *src, const void *dst,
+			  uint8_t proto, const void *data, size_t len);
+
+/* Add 32 bits in network byte order to an unfolded sum */
+static __inline__ uint32_t inet_csum_add32(uint32_t sum, uint32_t v)
+{
+	return sum + (v >> 16) + (v & 0xFFFF);
+}
+
+static __inline__ uint16_t inet_csum_fold(uint32_t sum)
+{
+	sum = (sum & 0xFFFF) + (sum >> 16);
+	sum = (sum & 0xFFFF) + (sum >> 16);
+	return sum;
+}
+
+/* Update a checksum for data whose sum grew by 'sum' (RFC 1624) */
+static __inline__ uint16_t inet_csum_update(uint16_t check, uint32_t sum)
+{
+	return ~inet_csum_fold(sum + (uint16_t)~check);
+}
+
+#endif /* INET_CSUM_H */
@@ -0,0 +1,193 @@
+/*
+   Checks inet_csum.c against a plain 16 bit reference sum, and with -b
+   times both on header and full frame sizes.
+
+   Buffers of random length and contents start at random alignments;
+   each is summed whole and split at a random even offset, as the
+   pseudo-header and data pieces are in tickle_tcp.  Incremental updates
+   (RFC 1624) are checked against a fresh sum of the changed buffer.
+
+	inet_csum_check [-b] [-n count] [-s seed]
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+   02110-1301, USA.
+*/
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "inet_csum.h"
+
+#define MAXLEN		2048
+#define ALIGN_SLACK	16
+
+static unsigned char	buf[MAXLEN + ALIGN_SLACK];
+
+/* One 16 bit word at a time, in memory order like inet_csum_partial() */
+static uint32_t
+ref_partial(const unsigned char *p, size_t len, uint32_t sum)
+{
+	uint16_t	w;
+
+	while (len >= 2) {
+		memcpy(&w, p, 2);
+		sum += w;
+		sum = (sum & 0xFFFF) + (sum >> 16);
+		p += 2;
+		len -= 2;
+	}
+	if (len) {
+		w = 0;
+		memcpy(&w, p, 1);
+		sum += w;
+		sum = (sum & 0xFFFF) + (sum >> 16);
+	}
+	return sum;
+}
+
+static uint16_t
+ref_csum(const unsigned char *p, size_t len)
+{
+	return ~ref_partial(p, len, 0) & 0xFFFF;
+}
+
+static int
+check_one(unsigned long n)
+{
+	unsigned char	*p = buf + random() % ALIGN_SLACK;
+	size_t		len = random() % MAXLEN;
+	size_t		split, i, off;
+	uint16_t	want, got, w0, w1;
+	uint32_t	sum;
+
+	for (i = 0; i < len; ++i) {
+		p[i] = random();
+	}
+	want = ref_csum(p, len);
+
+	got = inet_csum(p, len);
+	if (got != want) {
+		fprintf(stderr, "#%lu: %u bytes at +%u: %04x, want %04x\n"
+		,	n, (unsigned)len, (unsigned)(p - buf), got, want);
+		return 1;
+	}
+
+	split = len ? (random() % len) & ~(size_t)1 : 0;
+	sum = inet_csum_partial(p, split, 0);
+	got = ~inet_csum_fold(inet_csum_partial(p + split, len - split, sum));
+	if (got != want) {
+		fprintf(stderr, "#%lu: %u bytes split at %u: %04x, want %04x\n"
+		,	n, (unsigned)len, (unsigned)split, got, want);
+		return 1;
+	}
+
+	if (len < 4) {
+		return 0;
+	}
+	/* Change one aligned 16 bit word and update the checksum */
+	off = (random() % (len - 1)) & ~(size_t)1;
+	memcpy(&w0, p + off, 2);
+	w1 = random();
+	memcpy(p + off, &w1, 2);
+	got = inet_csum_update(want, (uint16_t)~w0 + (uint32_t)w1);
+	want = ref_csum(p, len);
+	/* 0x0000 and 0xFFFF are the same number in ones' complement */
+	if (got != want && !((got == 0 || got == 0xFFFF)
+	&&	(want == 0 || want == 0xFFFF))) {
+		fprintf(stderr, "#%lu: update at %u of %u bytes: %04x, want %04x\n"
+		,	n, (unsigned)off, (unsigned)len, got, want);
+		return 1;
+	}
+	return 0;
+}
+
+static double
+now_ns(void)
+{
+	struct timespec	t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+static void
+bench(size_t len)
+{
+	static const unsigned long	iters = 2000000;
+	volatile uint16_t		sink;
+	unsigned long			i;
+	double				t0, t1, t2;
+
+	t0 = now_ns();
+	for (i = 0; i < iters; ++i) {
+		buf[1] = i;
+		sink = inet_csum(buf + 1, len);
+	}
+	t1 = now_ns();
+	for (i = 0; i < iters; ++i) {
+		buf[1] = i;
+		sink = ref_csum(buf + 1, len);
+	}
+	t2 = now_ns();
+	(void)sink;
+	printf("%5u bytes: %7.1f ns, reference %7.1f ns\n", (unsigned)len
+	,	(t1 - t0) / iters, (t2 - t1) / iters);
+}
+
+int
+main(int argc, char **argv)
+{
+	unsigned long	count = 200000;
+	unsigned long	n;
+	unsigned	seed = time(NULL);
+	int		do_bench = 0;
+	int		flag;
+
+	while ((flag = getopt(argc, argv, "bn:s:")) != EOF) {
+		switch (flag) {
+		case 'b':	do_bench = 1;
+				break;
+		case 'n':	count = strtoul(optarg, NULL, 0);
+				break;
+		case 's':	seed = strtoul(optarg, NULL, 0);
+				break;
+		default:	fprintf(stderr
+				,	"usage: %s [-b] [-n count] [-s seed]\n"
+				,	argv[0]);
+				return 2;
+		}
+	}
+
+	srandom(seed);
+	for (n = 0; n < count; ++n) {
+		if (check_one(n)) {
+			fprintf(stderr, "%s: failed with -s %u\n"
+			,	argv[0], seed);
+			return 1;
+		}
+	}
+	printf("%lu buffers matched (-s %u)\n", count, seed);
+
+	if (do_bench) {
+		bench(20);
+		bench(60);
+		bench(1500);
+	}
+	return 0;
+}
@@ -0,0 +1,95 @@
+/*
+   Netlink route dumps for findif and tickle_tcp.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+   02110-1301, USA.
+*/
+
+#include <config.h>
+
+#ifdef HAVE_LINUX_RTNETLINK_H
+#include <errno.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include "nl_dump.h"
+
+int
+nl_dump(int fd, int type, int family
+,	int (*cb)(struct nlmsghdr *nh, void *arg), void *arg)
+{
+	static unsigned	seq = 0;
+	struct {
+		struct nlmsghdr	nh;
+		struct rtgenmsg	g;
+	} req;
+	struct sockaddr_nl	nladdr;
+	char			buf[32768];
+	int			rc = 0;
+
+	memset(&req, 0, sizeof(req));
+	req.nh.nlmsg_len = sizeof(req);
+	req.nh.nlmsg_type = type;
+	req.nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	req.nh.nlmsg_seq = ++seq;
+	req.g.rtgen_family = family;
+
+	memset(&nladdr, 0, sizeof(nladdr));
+	nladdr.nl_family = AF_NETLINK;
+	if (sendto(fd, &req, sizeof(req), 0
+	,	(struct sockaddr *)&nladdr, sizeof(nladdr)) < 0) {
+		return -1;
+	}
+
+	for (;;) {
+		struct nlmsghdr	*nh;
+		ssize_t		n;
+
+		n = recv(fd, buf, sizeof(buf), 0);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		if (n == 0) {
+			return -1;
+		}
+		for (nh = (struct nlmsghdr *)buf; NLMSG_OK(nh, (size_t)n)
+		;	nh = NLMSG_NEXT(nh, n)) {
+			if (nh->nlmsg_seq != seq) {
+				continue;
+			}
+			if (nh->nlmsg_type == NLMSG_DONE) {
+				return rc;
+			}
+			if (nh->nlmsg_type == NLMSG_ERROR) {
+				/* the kernel ends the dump with the error */
+				return -1;
+			}
+			/*
+			 * After a callback failure read on to NLMSG_DONE, so
+			 * the rest of the dump does not end up in the reply
+			 * to the next request on fd.
+			 */
+			if (rc == 0 && cb(nh, arg) < 0) {
+				rc = -1;
+			}
+		}
+	}
+}
+#endif /* HAVE_LINUX_RTNETLINK_H */
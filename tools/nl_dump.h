@@ -0,0 +1,34 @@
+/*
+   Netlink route dumps for findif and tickle_tcp.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+   02110-1301, USA.
+*/
+
+#ifndef NL_DUMP_H
+#define NL_DUMP_H
+
+#include <linux/netlink.h>
+
+/*
+ * Send one dump request (RTM_GETLINK, RTM_GETROUTE, ...) for family on
+ * a NETLINK_ROUTE socket and hand every reply message to cb; after a
+ * negative return from cb the rest of the dump is read and dropped.
+ * Returns 0 once NLMSG_DONE is seen, -1 on error.
+ */
+int nl_dump(int fd, int type, int family,
+	    int (*cb)(struct nlmsghdr *nh, void *arg), void *arg);
+
+#endif /* NL_DUMP_H */
@@ -40,12 +40,11 @@
 #	define inline	/* nothing */
 #endif
 
-#include <limits.h>
+#include <sys/time.h>
 #include <libnet.h>
-#include <libgen.h>
-#include <clplumbing/timers.h>
 #include <clplumbing/cl_signal.h>
 #include <clplumbing/cl_log.h>
+#include "announce.h"
 
 #ifdef HAVE_LIBNET_1_0_API
 #	define	LTYPE	struct libnet_link_int
@@ -57,13 +56,50 @@
 #define PIDDIR       HA_VARRUNDIR "/" PACKAGE
 #define PIDFILE_BASE PIDDIR "/send_arp-"
 
-static int send_arp(LTYPE* l, u_long ip, u_char *device, u_char mac[6]
-,	u_char *broadcast, u_char *netmask, u_short arptype);
+#ifdef LIBNET_ARP_ETH_IP_H
+#	define ARP_FRAME_LEN	(LIBNET_ETH_H + LIBNET_ARP_ETH_IP_H)
+#else
+#	define ARP_FRAME_LEN	(LIBNET_ETH_H + LIBNET_ARP_H)
+#endif
+
+/*
+ * One libnet handle per interface, opened once and shared by every
+ * address announced on it. libnet 1.0 names the device on each write,
+ * so there all interfaces share the first handle.
+ */
+struct arp_link {
+	struct arp_link	*next;
+	char		*device;
+	LTYPE		*l;
+	u_char		mac[6];		/* the device's, for the Ethernet header */
+};
+
+/* The request and reply for one address, built once and resent as is */
+struct arp_target {
+	struct arp_link	*link;
+	u_char		frame[2][ARP_FRAME_LEN];	/* request, reply */
+};
+
+static struct arp_link *links;
+static long rate;
+
+static struct arp_link *get_link(const char *device);
+static void close_links(void);
+static int add_target(struct arp_target **targets, int *ntargets
+,	const char *device, const char *ipaddr, const char *macaddr);
+static int read_targets(const char *file, struct arp_target **targets
+,	int *ntargets);
+static int build_arp(struct arp_link *link, u_long ip, u_char mac[6]
+,	u_short arptype, u_char *frame);
+static int send_frames(struct arp_target *targets, int ntargets
+,	int which, struct ann_pace *pace);
 
 static char print_usage[]={
 "send_arp: sends out custom ARP packet.\n"
 "  usage: send_arp [-i repeatinterval-ms] [-r repeatcount] [-p pidfile] \\\n"
 "              device src_ip_addr src_hw_addr broadcast_ip_addr netmask\n"
+"         send_arp [-i repeatinterval-ms] [-r repeatcount] [-p pidfile] \\\n"
+"              [-R rate] -F file\n"
 "\n"
 "  where:\n"
 "    repeatinterval-ms: timing, in milliseconds of sending arp packets\n"
@@ -90,14 +126,16 @@ static char print_usage[]={
 "    broadcast_ip_addr: ignored\n"
 "\n"
 "    netmask: ignored\n"
+"\n"
+"    file: announce every \"device ip [mac|auto]\" line of file\n"
+"          (- for stdin) from this one process\n"
+"\n"
+"    rate: send at most rate packets per second in total\n"
 };
 
 static const char * SENDARPNAME = "send_arp";
 
-static void convert_macaddr (u_char *macaddr, u_char enet_src[6]);
-static int get_hw_addr(char *device, u_char mac[6]);
-int write_pid_file(const char *pidfilename);
-int create_pid_directory(const char *piddirectory);
+static void convert_macaddr (const u_char *macaddr, u_char enet_src[6]);
 
 #define AUTO_MAC_ADDR "auto"
 
@@ -127,21 +165,21 @@ int
 main(int argc, char *argv[])
 {
 	int	c = -1;
-	char	errbuf[LIBNET_ERRBUF_SIZE];
 	char*	device;
 	char*	ipaddr;
 	char*	macaddr;
-	char*	broadcast;
-	char*	netmask;
-	u_long	ip;
-	u_char  src_mac[6];
-	LTYPE*	l;
+	char*	listfile = NULL;
+	struct arp_target *targets = NULL;
+	int	ntargets = 0;
+	int	bad = 0;
 	int	repeatcount = 1;
 	int	j;
 	long	msinterval = 1000;
 	int	flag;
 	char    pidfilenamebuf[64];
 	char    *pidfilename = NULL;
+	struct ann_pace pace;
+	struct timespec due;
 
 	CL_SIGNAL(SIGTERM, byebye);
 	CL_SIGINTERRUPT(SIGTERM, 1);
@@ -150,8 +188,9 @@ main(int argc, char *argv[])
         cl_log_enable_stderr(TRUE);
         cl_log_set_facility(LOG_USER);
 	cl_inherit_logging_environment(0);
+	ann_log_init(SENDARPNAME, cl_log);
 
-	while ((flag = getopt(argc, argv, "i:r:p:")) != EOF) {
+	while ((flag = getopt(argc, argv, "i:r:p:F:R:")) != EOF) {
 		switch(flag) {
 
 		case 'i':	msinterval= atol(optarg);
@@ -163,87 +202,66 @@ main(int argc, char *argv[])
 		case 'p':	pidfilename= optarg;
 				break;
 
+		case 'F':	listfile= optarg;
+				break;
+
+		case 'R':	rate= atol(optarg);
+				break;
+
 		default:	fprintf(stderr, "%s\n\n", print_usage);
 				return 1;
 				break;
 		}
 	}
-	if (argc-optind != 5) {
+	if (argc-optind != (listfile ? 0 : 5)) {
 		fprintf(stderr, "%s\n\n", print_usage);
 		return 1;
 	}
 
-	/*
-	 *	argv[optind+1] DEVICE		dc0,eth0:0,hme0:0,
-	 *	argv[optind+2] IP		192.168.195.186
-	 *	argv[optind+3] MAC ADDR		00a0cc34a878
-	 *	argv[optind+4] BROADCAST	192.168.195.186
-	 *	argv[optind+5] NETMASK		ffffffffffff
-	 */
-
-	device    = argv[optind];
-	ipaddr    = argv[optind+1];
-	macaddr   = argv[optind+2];
-	broadcast = argv[optind+3];
-	netmask   = argv[optind+4];
-
-	if (!pidfilename) {
-		if (snprintf(pidfilenamebuf, sizeof(pidfilenamebuf), "%s%s", 
-					PIDFILE_BASE, ipaddr) >= 
-				(int)sizeof(pidfilenamebuf)) {
-			cl_log(LOG_INFO, "Pid file truncated");
+	if (listfile) {
+		/* A list has no address to name the pid file after */
+		if (pidfilename && ann_write_pid_file(pidfilename) < 0) {
 			return EXIT_FAILURE;
 		}
-		pidfilename = pidfilenamebuf;
-	}
-
-	if(write_pid_file(pidfilename) < 0) {
-		return EXIT_FAILURE;
+		/* announce what could be read, but still report the rest */
+		bad = read_targets(listfile, &targets, &ntargets) < 0;
+		c = 0;
 	}
+	else {
+		/*
+		 *	argv[optind+1] DEVICE		dc0,eth0:0,hme0:0,
+		 *	argv[optind+2] IP		192.168.195.186
+		 *	argv[optind+3] MAC ADDR		00a0cc34a878
+		 *	argv[optind+4] BROADCAST	192.168.195.186
+		 *	argv[optind+5] NETMASK		ffffffffffff
+		 */
+
+		device    = argv[optind];
+		ipaddr    = argv[optind+1];
+		macaddr   = argv[optind+2];
+
+		if (!pidfilename) {
+			if (snprintf(pidfilenamebuf, sizeof(pidfilenamebuf), "%s%s", 
+						PIDFILE_BASE, ipaddr) >= 
+					(int)sizeof(pidfilenamebuf)) {
+				cl_log(LOG_INFO, "Pid file truncated");
+				return EXIT_FAILURE;
+			}
+			pidfilename = pidfilenamebuf;
+		}
 
-#if defined(HAVE_LIBNET_1_0_API)
-#ifdef ON_DARWIN
-	if ((ip = libnet_name_resolve((unsigned char*)ipaddr, 1)) == -1UL) {
-#else
-	if ((ip = libnet_name_resolve(ipaddr, 1)) == -1UL) {
-#endif
-		cl_log(LOG_ERR, "Cannot resolve IP address [%s]", ipaddr);
-		unlink(pidfilename);
-		return EXIT_FAILURE;
-	}
+		if(ann_write_pid_file(pidfilename) < 0) {
+			return EXIT_FAILURE;
+		}
 
-	l = libnet_open_link_interface(device, errbuf);
-	if (!l) {
-		cl_log(LOG_ERR, "libnet_open_link_interface on %s: %s"
-		,	device, errbuf);
-		unlink(pidfilename);
-		return EXIT_FAILURE;
+		c = add_target(&targets, &ntargets, device, ipaddr, macaddr);
 	}
-#elif defined(HAVE_LIBNET_1_1_API)
-	if ((l=libnet_init(LIBNET_LINK, device, errbuf)) == NULL) {
-		cl_log(LOG_ERR, "libnet_init failure on %s: %s", device, errbuf);
-		unlink(pidfilename);
-		return EXIT_FAILURE;
-	}
-	if ((signed)(ip = libnet_name2addr4(l, ipaddr, 1)) == -1) {
-		cl_log(LOG_ERR, "Cannot resolve IP address [%s]", ipaddr);
-		unlink(pidfilename);
-		return EXIT_FAILURE;
-	}
-#else
-#	error "Must have LIBNET API version defined."
-#endif
-
-	if (!strcasecmp(macaddr, AUTO_MAC_ADDR)) {
-		if (get_hw_addr(device, src_mac) < 0) {
-			 cl_log(LOG_ERR, "Cannot find mac address for %s", 
-					 device);
-			 unlink(pidfilename);
-			 return EXIT_FAILURE;
+	if (c < 0 || ntargets == 0) {
+		close_links();
+		if (pidfilename) {
+			unlink(pidfilename);
 		}
-	}
-	else {
-		convert_macaddr((unsigned char *)macaddr, src_mac);
+		return EXIT_FAILURE;
 	}
 
 /*
@@ -251,32 +269,37 @@ main(int argc, char *argv[])
  * were already sending.  All the interesting research work for this fix was
  * done by Masaki Hasegawa <masaki-h@pp.iij4u.or.jp> and his colleagues.
  */
+	ann_pace_init(&pace, rate);
+	ann_now(&due);
 	for (j=0; j < repeatcount; ++j) {
-		c = send_arp(l, ip, (unsigned char*)device, src_mac
-			, (unsigned char*)broadcast, (unsigned char*)netmask
-			, ARPOP_REQUEST);
-		if (c < 0) {
+		c = send_frames(targets, ntargets, 0, &pace);
+		if (c == ntargets) {
 			break;
 		}
-		mssleep(msinterval / 2);
-		c = send_arp(l, ip, (unsigned char*)device, src_mac
-			, (unsigned char *)broadcast
-			, (unsigned char *)netmask, ARPOP_REPLY);
-		if (c < 0) {
+		/* half intervals count from when a round starts, not ends */
+		ann_add_us(&due, msinterval * 500L);
+		ann_sleep_until(&due);
+		c = send_frames(targets, ntargets, 1, &pace);
+		if (c == ntargets) {
 			break;
 		}
+		ann_add_us(&due, msinterval * 500L);
 		if (j != repeatcount-1) {
-			mssleep(msinterval / 2);
+			ann_sleep_until(&due);
 		}
 	}
 
-	unlink(pidfilename);
-	return c < 0  ? EXIT_FAILURE : EXIT_SUCCESS;
+	free(targets);
+	close_links();
+	if (pidfilename) {
+		unlink(pidfilename);
+	}
+	return c > 0 || bad ? EXIT_FAILURE : EXIT_SUCCESS;
 }
 
 
 void
-convert_macaddr (u_char *macaddr, u_char enet_src[6])
+convert_macaddr (const u_char *macaddr, u_char enet_src[6])
 {
 	int i, pos;
 	u_char bits[3];
@@ -296,61 +319,194 @@ convert_macaddr (u_char *macaddr, u_char enet_src[6])
 
 }
 
-#ifdef HAVE_LIBNET_1_0_API
-int
-get_hw_addr(char *device, u_char mac[6])
+/*
+ * The handle for device, opened on first use together with a lookup of
+ * the device's MAC address.
+ */
+static struct arp_link *
+get_link(const char *device)
 {
+	struct arp_link	*link;
+	char		errbuf[LIBNET_ERRBUF_SIZE];
+#ifdef HAVE_LIBNET_1_0_API
 	struct ether_addr	*mac_address;
-	struct libnet_link_int  *network;
-	char                    err_buf[LIBNET_ERRBUF_SIZE];
+#else
+	struct libnet_ether_addr	*mac_address;
+#endif
 
-	network = libnet_open_link_interface(device, err_buf);
-	if (!network) {
-		fprintf(stderr, "libnet_open_link_interface: %s\n", err_buf);
-		return -1;
+	for (link = links; link; link = link->next) {
+		if (!strcmp(link->device, device)) {
+			return link;
+		}
 	}
 
-	mac_address = libnet_get_hwaddr(network, device, err_buf);
+	if ((link = calloc(1, sizeof(*link))) == NULL
+	||	(link->device = strdup(device)) == NULL) {
+		cl_log(LOG_ERR, "Memory allocation failure: %s", strerror(errno));
+		free(link);
+		return NULL;
+	}
+
+#ifdef HAVE_LIBNET_1_0_API
+	link->l = links ? links->l
+	:	libnet_open_link_interface(link->device, errbuf);
+	if (!link->l) {
+		cl_log(LOG_ERR, "libnet_open_link_interface on %s: %s"
+		,	device, errbuf);
+		goto fail;
+	}
+	mac_address = libnet_get_hwaddr(link->l, link->device, errbuf);
 	if (!mac_address) {
-		fprintf(stderr, "libnet_get_hwaddr: %s\n", err_buf);
-		return -1;
+		cl_log(LOG_ERR, "libnet_get_hwaddr on %s: %s", device, errbuf);
+		goto fail;
 	}
+#else
+	/* LINK_ADV, so the frames can be culled and written as they are */
+	if ((link->l = libnet_init(LIBNET_LINK_ADV, link->device, errbuf)) == NULL) {
+		cl_log(LOG_ERR, "libnet_init failure on %s: %s", device, errbuf);
+		goto fail;
+	}
+	mac_address = libnet_get_hwaddr(link->l);
+	if (!mac_address) {
+		cl_log(LOG_ERR, "libnet_get_hwaddr on %s: %s", device
+		,	libnet_geterror(link->l));
+		libnet_destroy(link->l);
+		goto fail;
+	}
+#endif
+	memcpy(link->mac, mac_address->ether_addr_octet, 6);
 
-	memcpy(mac, mac_address->ether_addr_octet, 6);
+	link->next = links;
+	links = link;
+	return link;
 
-	return 0;
+fail:
+	free(link->device);
+	free(link);
+	return NULL;
 }
+
+static void
+close_links(void)
+{
+	struct arp_link	*link;
+
+	while ((link = links) != NULL) {
+		links = link->next;
+#ifdef HAVE_LIBNET_1_0_API
+		if (!links) {
+			/* the first one opened, shared by all */
+			libnet_close_link_interface(link->l);
+		}
+#else
+		libnet_destroy(link->l);
 #endif
+		free(link->device);
+		free(link);
+	}
+}
 
-#ifdef HAVE_LIBNET_1_1_API
-int
-get_hw_addr(char *device, u_char mac[6])
+/*
+ * Build the request and reply announcing ipaddr on device, and append
+ * them to targets.
+ */
+static int
+add_target(struct arp_target **targets, int *ntargets
+,	const char *device, const char *ipaddr, const char *macaddr)
 {
-	struct libnet_ether_addr	*mac_address;
-	libnet_t		*ln;
-	char			err_buf[LIBNET_ERRBUF_SIZE];
+	struct arp_link		*link;
+	struct arp_target	*t;
+	u_long			ip;
+	u_char			src_mac[6];
+	char			name[64];	/* libnet wants it writable */
 
-	ln = libnet_init(LIBNET_LINK, device, err_buf);
-	if (!ln) {
-		fprintf(stderr, "libnet_open_link_interface: %s\n", err_buf);
+	if ((link = get_link(device)) == NULL) {
 		return -1;
 	}
+	strncpy(name, ipaddr, sizeof(name) - 1);
+	name[sizeof(name) - 1] = '\0';
 
-	mac_address = libnet_get_hwaddr(ln);
-	if (!mac_address) {
-		fprintf(stderr,  "libnet_get_hwaddr: %s\n", err_buf);
+#if defined(HAVE_LIBNET_1_0_API)
+#ifdef ON_DARWIN
+	if ((ip = libnet_name_resolve((unsigned char*)name, 1)) == -1UL) {
+#else
+	if ((ip = libnet_name_resolve(name, 1)) == -1UL) {
+#endif
+		cl_log(LOG_ERR, "Cannot resolve IP address [%s]", ipaddr);
 		return -1;
 	}
+#elif defined(HAVE_LIBNET_1_1_API)
+	if ((signed)(ip = libnet_name2addr4(link->l, name, 1)) == -1) {
+		cl_log(LOG_ERR, "Cannot resolve IP address [%s]", ipaddr);
+		return -1;
+	}
+#else
+#	error "Must have LIBNET API version defined."
+#endif
 
-	memcpy(mac, mac_address->ether_addr_octet, 6);
+	if (!strcasecmp(macaddr, AUTO_MAC_ADDR)) {
+		memcpy(src_mac, link->mac, 6);
+	}
+	else {
+		convert_macaddr((const unsigned char *)macaddr, src_mac);
+	}
 
+	/* grow in chunks, so a long list is not copied once per line */
+	if (*ntargets % 64 == 0) {
+		t = realloc(*targets, (*ntargets + 64) * sizeof(*t));
+		if (!t) {
+			cl_log(LOG_ERR, "Memory allocation failure: %s"
+			,	strerror(errno));
+			return -1;
+		}
+		*targets = t;
+	}
+	t = &(*targets)[*ntargets];
+	t->link = link;
+	if (build_arp(link, ip, src_mac, ARPOP_REQUEST, t->frame[0]) < 0
+	||	build_arp(link, ip, src_mac, ARPOP_REPLY, t->frame[1]) < 0) {
+		return -1;
+	}
+	++*ntargets;
 	return 0;
 }
-#endif
+
+/*
+ * Read "device ip [mac|auto]" lines. Lines that cannot be announced are
+ * logged and skipped; the return value is -1 if there were any.
+ */
+static int
+read_targets(const char *file, struct arp_target **targets, int *ntargets)
+{
+	FILE	*fp = stdin;
+	char	line[256], dev[64], addr[64], mac[64];
+	int	n, lineno = 0, rc = 0;
+
+	if (strcmp(file, "-") && (fp = fopen(file, "r")) == NULL) {
+		cl_log(LOG_ERR, "Cannot open %s: %s", file, strerror(errno));
+		return -1;
+	}
+	while (fgets(line, sizeof(line), fp)) {
+		lineno++;
+		n = sscanf(line, "%63s %63s %63s", dev, addr, mac);
+		if (n <= 0 || dev[0] == '#') {
+			continue;
+		}
+		if (n < 2 || add_target(targets, ntargets, dev, addr
+		,	n < 3 ? AUTO_MAC_ADDR : mac) < 0) {
+			cl_log(LOG_ERR, "%s: skipping line %d", file, lineno);
+			rc = -1;
+		}
+	}
+	if (fp != stdin) {
+		fclose(fp);
+	}
+	return rc;
+}
 
 
 /*
- * Notes on send_arp() behaviour. Horms, 15th June 2004
+ * Notes on build_arp() behaviour. Horms, 15th June 2004
  *
  * 1. Target Hardware Address
  *    (In the ARP portion of the packet)
@@ -388,34 +544,16 @@ get_hw_addr(char *device, u_char mac[6])
 
 #ifdef HAVE_LIBNET_1_0_API
 int
-send_arp(struct libnet_link_int *l, u_long ip, u_char *device, u_char *macaddr, u_char *broadcast, u_char *netmask, u_short arptype)
+build_arp(struct arp_link *link, u_long ip, u_char macaddr[6], u_short arptype, u_char *buf)
 {
-	int n;
-	u_char *buf;
 	u_char *target_mac;
-	u_char device_mac[6];
 	u_char bcast_mac[6] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
 	u_char zero_mac[6] = {0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
 
-
-	if (libnet_init_packet(LIBNET_ARP_H + LIBNET_ETH_H, &buf) == -1) {
-	cl_log(LOG_ERR, "libnet_init_packet memory:");
-		return -1;
-	}
-
-	/* Convert ASCII Mac Address to 6 Hex Digits. */
-
 	/* Ethernet header */
-	if (get_hw_addr((char*)device, device_mac) < 0) {
-		cl_log(LOG_ERR, "Cannot find mac address for %s",
-				device);
-		return -1;
-	}
-
-	if (libnet_build_ethernet(bcast_mac, device_mac, ETHERTYPE_ARP, NULL, 0
+	if (libnet_build_ethernet(bcast_mac, link->mac, ETHERTYPE_ARP, NULL, 0
 	,	buf) == -1) {
 		cl_log(LOG_ERR, "libnet_build_ethernet failed:");
-		libnet_destroy_packet(&buf);
 		return -1;
 	}
 
@@ -446,17 +584,9 @@ send_arp(struct libnet_link_int *l, u_long ip, u_char *device, u_char *macaddr,
 		0,				/* Payload length */
 		buf + LIBNET_ETH_H) == -1) {
 	        cl_log(LOG_ERR, "libnet_build_arp failed:");
-		libnet_destroy_packet(&buf);
 		return -1;
 	}
-
-	n = libnet_write_link_layer(l, (char*)device, buf, LIBNET_ARP_H + LIBNET_ETH_H);
-	if (n == -1) {
-		cl_log(LOG_ERR, "libnet_build_ethernet failed:");
-	}
-
-	libnet_destroy_packet(&buf);
-	return (n);
+	return 0;
 }
 #endif /* HAVE_LIBNET_1_0_API */
 
@@ -465,13 +595,14 @@ send_arp(struct libnet_link_int *l, u_long ip, u_char *device, u_char *macaddr,
 
 #ifdef HAVE_LIBNET_1_1_API
 int
-send_arp(libnet_t* lntag, u_long ip, u_char *device, u_char macaddr[6], u_char *broadcast, u_char *netmask, u_short arptype)
+build_arp(struct arp_link *link, u_long ip, u_char macaddr[6], u_short arptype, u_char *frame)
 {
-	int n;
+	libnet_t *lntag = link->l;
 	u_char *target_mac;
-	u_char device_mac[6];
 	u_char bcast_mac[6] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
 	u_char zero_mac[6] = {0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
+	u_int8_t *packet;
+	u_int32_t len;
 
 	if (arptype == ARPOP_REQUEST) {
 		target_mac = zero_mac;
@@ -502,201 +633,67 @@ send_arp(libnet_t* lntag, u_long ip, u_char *device, u_char macaddr[6], u_char *
 		0		/* packet id */
 	) == -1 ) {
 		cl_log(LOG_ERR, "libnet_build_arp failed:");
+		libnet_clear_packet(lntag);
 		return -1;
 	}
 
 	/* Ethernet header */
-	if (get_hw_addr((char *)device, device_mac) < 0) {
-		cl_log(LOG_ERR, "Cannot find mac address for %s",
-				device);
-		return -1;
-	}
-
-	if (libnet_build_ethernet(bcast_mac, device_mac, ETHERTYPE_ARP, NULL, 0
+	if (libnet_build_ethernet(bcast_mac, link->mac, ETHERTYPE_ARP, NULL, 0
 	,	lntag, 0) == -1 ) {
 		cl_log(LOG_ERR, "libnet_build_ethernet failed:");
+		libnet_clear_packet(lntag);
 		return -1;
 	}
 
-	n = libnet_write(lntag);
-	if (n == -1) {
-		cl_log(LOG_ERR, "libnet_build_ethernet failed:");
-	}
-	libnet_clear_packet(lntag);
-
-	return (n);
-}
-#endif /* HAVE_LIBNET_1_1_API */
-
-
-int
-create_pid_directory(const char *pidfilename)  
-{
-	int	status;
-	struct stat stat_buf;
-	char    *pidfilename_cpy;
-	char    *dir;
-
-	pidfilename_cpy = strdup(pidfilename);
-	if (!pidfilename_cpy) {
-		cl_log(LOG_INFO, "Memory allocation failure: %s\n",
-				strerror(errno));
+	/* keep a copy of the wire image, send_frames() writes it as is */
+	if (libnet_adv_cull_packet(lntag, &packet, &len) == -1) {
+		cl_log(LOG_ERR, "libnet_adv_cull_packet failed: %s"
+		,	libnet_geterror(lntag));
+		libnet_clear_packet(lntag);
 		return -1;
 	}
-	
-	dir = dirname(pidfilename_cpy);
-
-	status = stat(dir, &stat_buf); 
-
-	if (status < 0 && errno != ENOENT && errno != ENOTDIR) {
-		cl_log(LOG_INFO, "Could not stat pid-file directory "
-				"[%s]: %s", dir, strerror(errno));
-		free(pidfilename_cpy);
-		return -1;
+	if (len == ARP_FRAME_LEN) {
+		memcpy(frame, packet, len);
 	}
-	
-	if (status >= 0) {
-		if (S_ISDIR(stat_buf.st_mode)) {
-			return 0;
-		}
-		cl_log(LOG_INFO, "Pid-File directory exists but is "
-				"not a directory [%s]", dir);
-		free(pidfilename_cpy);
-		return -1;
-        }
+	libnet_adv_free_packet(lntag, packet);
+	libnet_clear_packet(lntag);
 
-	if (mkdir(dir, S_IRUSR|S_IWUSR|S_IXUSR | S_IRGRP|S_IXGRP) < 0) {
-		/* Did someone else make it while we were trying ? */
-		if (errno == EEXIST && stat(dir, &stat_buf) >= 0
-		&&	S_ISDIR(stat_buf.st_mode)) {
-			return 0;
-		}
-		cl_log(LOG_INFO, "Could not create pid-file directory "
-				"[%s]: %s", dir, strerror(errno));
-		free(pidfilename_cpy);
+	if (len != ARP_FRAME_LEN) {
+		cl_log(LOG_ERR, "ARP frame has unexpected length %u", len);
 		return -1;
 	}
-
-	free(pidfilename_cpy);
 	return 0;
 }
+#endif /* HAVE_LIBNET_1_1_API */
 
-
-int
-write_pid_file(const char *pidfilename)  
+/*
+ * Send frame which (0 the request, 1 the reply) of every target, at
+ * most rate per second if a rate is set. Returns the number of frames
+ * that could not be sent.
+ */
+static int
+send_frames(struct arp_target *targets, int ntargets, int which
+,	struct ann_pace *pace)
 {
+	struct arp_target	*t;
+	int			i, n, failed = 0;
 
-	int     	pidfilefd;
-	char    	pidbuf[11];
-	unsigned long   pid;
-	ssize_t 	bytes;
-
-	if (*pidfilename != '/') {
-		cl_log(LOG_INFO, "Invalid pid-file name, must begin with a "
-				"'/' [%s]\n", pidfilename);
-		return -1;
-	}
-
-	if (create_pid_directory(pidfilename) < 0) {
-		return -1;
-	}
-
-	while (1) {
-		pidfilefd = open(pidfilename, O_CREAT|O_EXCL|O_RDWR, 
-				S_IRUSR|S_IWUSR);
-		if (pidfilefd < 0) {
-			if (errno != EEXIST) { /* Old PID file */
-				cl_log(LOG_INFO, "Could not open pid-file "
-						"[%s]: %s", pidfilename, 
-						strerror(errno));
-				return -1;
-			}
-		}
-		else {
-			break;
-		}
-
-		pidfilefd = open(pidfilename, O_RDONLY, S_IRUSR|S_IWUSR);
-		if (pidfilefd < 0) {
-			cl_log(LOG_INFO, "Could not open pid-file " 
-					"[%s]: %s", pidfilename, 
-					strerror(errno));
-			return -1;
-		}
-
-		while (1) {
-			bytes = read(pidfilefd, pidbuf, sizeof(pidbuf)-1);
-			if (bytes < 0) {
-				if (errno == EINTR) {
-					continue;
-				}
-				cl_log(LOG_INFO, "Could not read pid-file " 
-						"[%s]: %s", pidfilename, 
-						strerror(errno));
-				return -1;
-			}
-			pidbuf[bytes] = '\0';
-			break;
-		}
-
-		if(unlink(pidfilename) < 0) {
-			cl_log(LOG_INFO, "Could not delete pid-file "
-	 				"[%s]: %s", pidfilename, 
-					strerror(errno));
-			return -1;
-		}
-
-		if (!bytes) {
-			cl_log(LOG_INFO, "Invalid pid in pid-file "
-	 				"[%s]: %s", pidfilename, 
-					strerror(errno));
-			return -1;
-		}
-
-		close(pidfilefd);
-
-		pid = strtoul(pidbuf, NULL, 10);
-		if (pid == ULONG_MAX && errno == ERANGE) {
-			cl_log(LOG_INFO, "Invalid pid in pid-file "
-	 				"[%s]: %s", pidfilename, 
-					strerror(errno));
-			return -1;
-		}
-
-		if (kill(pid, SIGKILL) < 0 && errno != ESRCH) {
-			cl_log(LOG_INFO, "Error killing old proccess [%lu] "
-	 				"from pid-file [%s]: %s", pid,
-					pidfilename, strerror(errno));
-			return -1;
-		}
-
-		cl_log(LOG_INFO, "Killed old send_arp process [%lu]\n",
-				pid);
-	}
-
-	if (snprintf(pidbuf, sizeof(pidbuf), "%u"
-	,	getpid()) >= (int)sizeof(pidbuf)) {
-		cl_log(LOG_INFO, "Pid too long for buffer [%u]", getpid());
-		return -1;
-	}
-
-	while (1) {
-		bytes = write(pidfilefd, pidbuf, strlen(pidbuf));
-		if (bytes != (ssize_t)strlen(pidbuf)) {
-			if (bytes < 0 && errno == EINTR) {
-				continue;
-			}
-			cl_log(LOG_INFO, "Could not write pid-file "
-					"[%s]: %s", pidfilename,
-					strerror(errno));
-			return -1;
+	for (i = 0; i < ntargets; i++) {
+		t = &targets[i];
+		ann_pace(pace, 1);
+#ifdef HAVE_LIBNET_1_0_API
+		n = libnet_write_link_layer(t->link->l, t->link->device
+		,	t->frame[which], ARP_FRAME_LEN);
+#else
+		n = libnet_adv_write_link(t->link->l, t->frame[which]
+		,	ARP_FRAME_LEN);
+#endif
+		if (n == -1) {
+			cl_log(LOG_ERR, "Cannot send ARP %s on %s"
+			,	which ? "reply" : "request", t->link->device);
+			failed++;
 		}
-		break;
 	}
-
-	close(pidfilefd);
-
-	return 0;
+	return failed;
 }
 
-
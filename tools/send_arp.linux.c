@@ -9,6 +9,7 @@
  * Authors:	Alexey Kuznetsov, <kuznet@ms2.inr.ac.ru>
  */
 
+#include <config.h>
 #include <stdlib.h>
 #include <sys/param.h>
 #include <sys/socket.h>
@@ -22,6 +23,15 @@
 #include <linux/if_ether.h>
 #include <net/if_arp.h>
 #include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#ifdef HAVE_LINUX_FILTER_H
+#include <linux/filter.h>
+#endif
 
 #include <netdb.h>
 #include <unistd.h>
@@ -29,9 +39,13 @@
 #include <ctype.h>
 #include <errno.h>
 #include <string.h>
+#include <stdarg.h>
+#include <time.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
+#include "announce.h"
+
 static void usage(void) __attribute__((noreturn));
 
 static int quit_on_reply;
@@ -47,12 +61,57 @@ static int timeout = 0;
 static int unicasting = 0;
 static int s = 0;
 static int broadcast_only = 0;
+static int interval_ms = 1000;
+static char *list_file;
+static char *svc_path, *svc_server;
 
 static struct sockaddr_ll me;
 static struct sockaddr_ll he;
 
 static struct timeval start, last;
 
+/*
+ * DAD for several addresses at once: every tick probes each of them,
+ * and replies find their target through an open addressing hash on the
+ * sender IP.
+ */
+struct dad_target {
+	struct in_addr	ip;
+	int		replies;
+	unsigned char	mac[8];		/* of the first station to answer */
+};
+
+/*
+ * Reply latency of each target, for -j: the time from each probe to
+ * the first reply after it. Probes that got none before the next one
+ * was sent, or before the end, are timeouts.
+ */
+struct rtt_stats {
+	int		probes;
+	int		pending;	/* the last probe is still unanswered */
+	struct timeval	sent_at;
+	int		n, size;
+	long		*usecs;
+};
+
+static char *json_file;
+static struct rtt_stats rtt_one, *rtts = &rtt_one;
+
+static struct dad_target *dad_targets;
+static int ndad, dad_conflicts;
+static int *dad_hash;			/* index into dad_targets or -1 */
+static unsigned int dad_mask;
+
+/* The other interfaces of a fan-out announcement, see fan_init() */
+struct fan_link {
+	int			s;
+	struct sockaddr_ll	me, he;
+};
+
+static char *device_list;
+static struct fan_link *fan;
+static int nfan;
+
 static int sent, brd_sent;
 static int received, brd_recv, req_recv;
 
@@ -60,78 +119,76 @@ static int received, brd_recv, req_recv;
 			   ((tv1).tv_usec-(tv2).tv_usec)/1000 )
 
 static void print_hex(unsigned char *p, int len);
-static int recv_pack(unsigned char *buf, int len, struct sockaddr_ll *FROM);
-static void set_signal(int signo, void (*handler)(void));
+static int recv_pack(unsigned char *buf, int len, struct sockaddr_ll *FROM,
+		     struct timeval *tv);
 static int send_pack(int s, struct in_addr src, struct in_addr dst,
 	      struct sockaddr_ll *ME, struct sockaddr_ll *HE);
 static void finish(void);
-static void catcher(void);
+static void tick(void);
+static void write_json(void);
+static void filter_arp(int s);
+static int resolve_target(const char *name, struct in_addr *addr);
+static struct dad_target *dad_lookup(struct in_addr ip);
 
 void usage(void)
 {
 	fprintf(stderr,
-		"Usage: arping [-fqbDUAV] [-c count] [-w timeout] [-I device] [-s source] destination\n"
+		"Usage: arping [-fqbDUAV] [-c count] [-i interval-ms] [-w timeout] [-I device] [-s source] [-j file] destination\n"
+		"       arping -D [-q] [-c count] [-i interval-ms] [-w timeout] [-I device] [-s source] [-j file] destination...\n"
 		"  -f : quit on first reply\n"
 		"  -q : be quiet\n"
 		"  -b : keep broadcasting, don't go unicast\n"
-		"  -D : duplicate address detection mode\n"
+		"  -D : duplicate address detection mode; with several\n"
+		"       destinations, probe all of them at once and report\n"
+		"       which ones are in use\n"
 		"  -U : Unsolicited ARP mode, update your neighbours\n"
 		"  -A : ARP answer mode, update your neighbours\n"
 		"  -V : print version and exit\n"
 		"  -c count : how many packets to send\n"
+		"  -i interval-ms : time between packets (1000)\n"
 		"  -w timeout : how long to wait for a reply\n"
-		"  -I device : which ethernet device to use (eth0)\n"
+		"  -I device : which ethernet device to use (eth0); with -U or -A\n"
+		"              a comma separated list, where dev.* is dev and\n"
+		"              all VLANs on it, to announce on all of them\n"
 		"  -s source : source ip address\n"
+		"  -j file : write the reply latencies of each destination as JSON\n"
+		"            to file (- for stdout)\n"
 		"  destination : ask for what ip address\n"
+		"\n"
+		"Usage: send_arp [-q] [-i interval-ms] [-r count] [-R rate] -F file\n"
+		"  -F file : announce every \"device ip [mac|auto]\" line of file\n"
+		"            (- for stdin) from this one process: count rounds of\n"
+		"            an ARP request and, interval-ms/2 later, an ARP reply\n"
+		"  -R rate : send at most rate packets per second in total\n"
+		"\n"
+		"Usage: send_arp [-c count] [-i interval-ms] -S socket\n"
+		"  -S socket : stay resident and take \"announce device ip [mac|auto]\n"
+		"              [count [interval-ms]]\", \"dad device ip [count\n"
+		"              [interval-ms]]\" and \"cancel ip\" requests, one per\n"
+		"              line, on the UNIX socket\n"
+		"Usage: send_arp -C socket request...\n"
+		"  -C socket : pass one request to send_arp -S and print its answer\n"
 		);
 	exit(2);
 }
 
-void set_signal(int signo, void (*handler)(void))
-{
-	struct sigaction sa;
-
-	memset(&sa, 0, sizeof(sa));
-	sa.sa_handler = (void (*)(int))handler;
-	sa.sa_flags = SA_RESTART;
-	sigaction(signo, &sa, NULL);
-}
-
 int send_pack(int s, struct in_addr src, struct in_addr dst,
 	      struct sockaddr_ll *ME, struct sockaddr_ll *HE)
 {
-	int err;
+	int err, len;
 	struct timeval now;
 	unsigned char buf[256];
-	struct arphdr *ah = (struct arphdr*)buf;
-	unsigned char *p = (unsigned char *)(ah+1);
-
-	ah->ar_hrd = htons(ME->sll_hatype);
-	if (ah->ar_hrd == htons(ARPHRD_FDDI))
-		ah->ar_hrd = htons(ARPHRD_ETHER);
-	ah->ar_pro = htons(ETH_P_IP);
-	ah->ar_hln = ME->sll_halen;
-	ah->ar_pln = 4;
-	ah->ar_op  = advert ? htons(ARPOP_REPLY) : htons(ARPOP_REQUEST);
-
-	memcpy(p, &ME->sll_addr, ah->ar_hln);
-	p+=ME->sll_halen;
-
-	memcpy(p, &src, 4);
-	p+=4;
-
-	if (advert)
-		memcpy(p, &ME->sll_addr, ah->ar_hln);
-	else
-		memcpy(p, &HE->sll_addr, ah->ar_hln);
-	p+=ah->ar_hln;
+	int hrd = ME->sll_hatype;
 
-	memcpy(p, &dst, 4);
-	p+=4;
+	if (hrd == ARPHRD_FDDI)
+		hrd = ARPHRD_ETHER;
+	len = ann_arp_frame(buf, hrd, advert ? ARPOP_REPLY : ARPOP_REQUEST,
+			    ME->sll_halen, ME->sll_addr, src,
+			    advert ? ME->sll_addr : HE->sll_addr, dst);
 
 	gettimeofday(&now, NULL);
-	err = sendto(s, buf, p-buf, 0, (struct sockaddr*)HE, sizeof(*HE));
-	if (err == p-buf) {
+	err = sendto(s, buf, len, 0, (struct sockaddr*)HE, sizeof(*HE));
+	if (err == len) {
 		last = now;
 		sent++;
 		if (!unicasting)
@@ -142,6 +199,20 @@ int send_pack(int s, struct in_addr src, struct in_addr dst,
 
 void finish(void)
 {
+	int i;
+
+	/* the report is the result of a multi-address DAD, so -q keeps it */
+	for (i = 0; i < ndad; i++) {
+		printf("%s ", inet_ntoa(dad_targets[i].ip));
+		if (dad_targets[i].replies) {
+			printf("in use [");
+			print_hex(dad_targets[i].mac, me.sll_halen);
+			printf("]\n");
+		} else {
+			printf("free\n");
+		}
+	}
+
 	if (!quiet) {
 		printf("Sent %d probes (%d broadcast(s))\n", sent, brd_sent);
 		printf("Received %d response(s)", received);
@@ -159,6 +230,9 @@ void finish(void)
 		fflush(stdout);
 	}
 
+	if (json_file)
+		write_json();
+
 	if (dad) {
 	    fflush(stdout);
 	    exit(!!received);
@@ -171,7 +245,83 @@ void finish(void)
 	exit(!received);
 }
 
-void catcher(void)
+static int cmp_long(const void *a, const void *b)
+{
+	long x = *(const long *)a, y = *(const long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void json_ms(FILE *fp, const char *name, long usecs)
+{
+	fprintf(fp, "\"%s\": %ld.%03ld", name, usecs / 1000, usecs % 1000);
+}
+
+static void write_json(void)
+{
+	struct rtt_stats *st;
+	FILE *fp = stdout;
+	int i, n = ndad ? ndad : 1;
+
+	if (strcmp(json_file, "-") && !(fp = fopen(json_file, "w"))) {
+		fprintf(stderr, "arping: cannot write %s: %s\n", json_file,
+			strerror(errno));
+		return;
+	}
+	fprintf(fp, "{\"device\": \"%s\", \"mode\": \"%s\", ", device,
+		dad ? "dad" : unsolicited ? "unsolicited" : "arping");
+	fprintf(fp, "\"source\": \"%s\", ", inet_ntoa(src));
+	fprintf(fp, "\"sent\": %d, \"received\": %d, \"targets\": [", sent, received);
+	for (i = 0; i < n; i++) {
+		st = &rtts[i];
+		fprintf(fp, "%s\n  {\"address\": \"%s\", ", i ? "," : "",
+			inet_ntoa(ndad ? dad_targets[i].ip : dst));
+		if (dad)
+			fprintf(fp, "\"in_use\": %s, ", (ndad ? dad_targets[i].replies
+							     : received) ? "true" : "false");
+		fprintf(fp, "\"probes\": %d, \"replies\": %d, \"timeouts\": %d, ",
+			st->probes, st->n, st->probes - st->n);
+		if (!st->n) {
+			fprintf(fp, "\"rtt_ms\": null}");
+			continue;
+		}
+		qsort(st->usecs, st->n, sizeof(*st->usecs), cmp_long);
+		fprintf(fp, "\"rtt_ms\": {");
+		json_ms(fp, "min", st->usecs[0]);
+		fprintf(fp, ", ");
+		json_ms(fp, "p50", st->usecs[st->n / 2]);
+		fprintf(fp, ", ");
+		json_ms(fp, "p99", st->usecs[st->n * 99 / 100]);
+		fprintf(fp, ", ");
+		json_ms(fp, "max", st->usecs[st->n - 1]);
+		fprintf(fp, "}}");
+	}
+	fprintf(fp, "\n]}\n");
+	if (fp != stdout)
+		fclose(fp);
+	else
+		fflush(fp);
+}
+
+static void probe(struct rtt_stats *st, struct in_addr ip)
+{
+	struct timeval at;
+	int i, ok;
+
+	ok = send_pack(s, src, ip, &me, &he) > 0;
+	at = last;
+	/* the same announcement on every other interface of a fan-out */
+	for (i = 0; i < nfan; i++)
+		send_pack(fan[i].s, src, ip, &fan[i].me, &fan[i].he);
+	if (!ok)
+		return;
+	st->probes++;
+	st->pending = 1;
+	st->sent_at = at;
+}
+
+/* Called every interval_ms by the timer of the main loop */
+void tick(void)
 {
 	struct timeval tv;
 
@@ -183,32 +333,88 @@ void catcher(void)
 	if (count-- == 0 || (timeout && MS_TDIFF(tv,start) > timeout*1000 + 500))
 		finish();
 
-	if (last.tv_sec==0 || MS_TDIFF(tv,last) > 500) {
-		send_pack(s, src, dst, &me, &he);
-		if (count == 0 && unsolicited)
-			finish();
-	}
-	alarm(1);
+	if (ndad) {
+		int i;
+
+		for (i = 0; i < ndad; i++)
+			if (!dad_targets[i].replies)
+				probe(&rtts[i], dad_targets[i].ip);
+	} else
+		probe(rtts, dst);
+	if (count == 0 && unsolicited)
+		finish();
 }
 
-void print_hex(unsigned char *p, int len)
+/*
+ * Replies are formatted by hand into stdout's buffer, which the main
+ * loop flushes once per batch of frames instead of once per line.
+ */
+static char *fmt_str(char *o, const char *s)
+{
+	while (*s)
+		*o++ = *s++;
+	return o;
+}
+
+static char *fmt_num(char *o, unsigned long n, int width)
+{
+	char d[24];
+	int i = 0;
+
+	do {
+		d[i++] = '0' + n % 10;
+		n /= 10;
+	} while (n || i < width);
+	while (i)
+		*o++ = d[--i];
+	return o;
+}
+
+static char *fmt_ip(char *o, struct in_addr a)
+{
+	unsigned char *b = (unsigned char *)&a;
+
+	o = fmt_num(o, b[0], 1);
+	*o++ = '.';
+	o = fmt_num(o, b[1], 1);
+	*o++ = '.';
+	o = fmt_num(o, b[2], 1);
+	*o++ = '.';
+	return fmt_num(o, b[3], 1);
+}
+
+static char *fmt_hex(char *o, const unsigned char *p, int len)
 {
+	static const char hex[] = "0123456789ABCDEF";
 	int i;
+
 	for (i=0; i<len; i++) {
-		printf("%02X", p[i]);
+		*o++ = hex[p[i] >> 4];
+		*o++ = hex[p[i] & 15];
 		if (i != len-1)
-			printf(":");
+			*o++ = ':';
 	}
+	return o;
+}
+
+void print_hex(unsigned char *p, int len)
+{
+	char buf[3 * 256];
+
+	*fmt_hex(buf, p, len) = 0;
+	fputs(buf, stdout);
 }
 
-int recv_pack(unsigned char *buf, int len, struct sockaddr_ll *FROM)
+/* tv is when the frame arrived */
+int recv_pack(unsigned char *buf, int len, struct sockaddr_ll *FROM,
+	      struct timeval *tv)
 {
-	struct timeval tv;
 	struct arphdr *ah = (struct arphdr*)buf;
 	unsigned char *p = (unsigned char *)(ah+1);
 	struct in_addr src_ip, dst_ip;
-
-	gettimeofday(&tv, NULL);
+	struct dad_target *t = NULL;
+	struct rtt_stats *st;
+	struct timeval *sent;
 
 	/* Filter out wild packets */
 	if (FROM->sll_pkttype != PACKET_HOST &&
@@ -258,56 +464,1153 @@ int recv_pack(unsigned char *buf, int len, struct sockaddr_ll *FROM)
 		   also that it matches to dst_ip, otherwise
 		   dst_ip/dst_hw do not matter.
 		 */
-		if (src_ip.s_addr != dst.s_addr)
+		if (ndad) {
+			if (!(t = dad_lookup(src_ip)))
+				return 0;
+		} else if (src_ip.s_addr != dst.s_addr)
 			return 0;
 		if (memcmp(p, &me.sll_addr, me.sll_halen) == 0)
 			return 0;
 		if (src.s_addr && src.s_addr != dst_ip.s_addr)
 			return 0;
 	}
+	/*
+	 * Probes for many targets go out one after the other: time a
+	 * reply from the last probe for its own target.
+	 */
+	st = t ? &rtts[t - dad_targets] : rtts;
+	sent = ndad ? &st->sent_at : &last;
 	if (!quiet) {
+		char line[128], *o = line;
 		int s_printed = 0;
-		printf("%s ", FROM->sll_pkttype==PACKET_HOST ? "Unicast" : "Broadcast");
-		printf("%s from ", ah->ar_op == htons(ARPOP_REPLY) ? "reply" : "request");
-		printf("%s [", inet_ntoa(src_ip));
-		print_hex(p, ah->ar_hln);
-		printf("] ");
+
+		o = fmt_str(o, FROM->sll_pkttype==PACKET_HOST ? "Unicast " : "Broadcast ");
+		o = fmt_str(o, ah->ar_op == htons(ARPOP_REPLY) ? "reply from " : "request from ");
+		o = fmt_ip(o, src_ip);
+		o = fmt_str(o, " [");
+		o = fmt_hex(o, p, ah->ar_hln);
+		o = fmt_str(o, "] ");
 		if (dst_ip.s_addr != src.s_addr) {
-			printf("for %s ", inet_ntoa(dst_ip));
+			o = fmt_str(o, "for ");
+			o = fmt_ip(o, dst_ip);
+			*o++ = ' ';
 			s_printed = 1;
 		}
 		if (memcmp(p+ah->ar_hln+4, me.sll_addr, ah->ar_hln)) {
 			if (!s_printed)
-				printf("for ");
-			printf("[");
-			print_hex(p+ah->ar_hln+4, ah->ar_hln);
-			printf("]");
-		}
-		if (last.tv_sec) {
-			long usecs = (tv.tv_sec-last.tv_sec) * 1000000 +
-				tv.tv_usec-last.tv_usec;
+				o = fmt_str(o, "for ");
+			*o++ = '[';
+			o = fmt_hex(o, p+ah->ar_hln+4, ah->ar_hln);
+			*o++ = ']';
+		}
+		if (sent->tv_sec) {
+			long usecs = (tv->tv_sec-sent->tv_sec) * 1000000 +
+				tv->tv_usec-sent->tv_usec;
 			long msecs = (usecs+500)/1000;
 			usecs -= msecs*1000 - 500;
-			printf(" %ld.%03ldms\n", msecs, usecs);
+			*o++ = ' ';
+			if (msecs < 0) {
+				*o++ = '-';
+				msecs = -msecs;
+			}
+			o = fmt_num(o, msecs, 1);
+			*o++ = '.';
+			o = fmt_num(o, usecs, 3);
+			o = fmt_str(o, "ms\n");
 		} else {
-			printf(" UNSOLICITED?\n");
+			o = fmt_str(o, " UNSOLICITED?\n");
 		}
-		fflush(stdout);
+		fwrite(line, 1, o - line, stdout);
 	}
 	received++;
+	if (st->pending) {
+		if (st->n == st->size) {
+			long *u;
+
+			st->size = st->size ? 2 * st->size : 16;
+			if (!(u = realloc(st->usecs, st->size * sizeof(*u)))) {
+				perror("arping: realloc");
+				exit(2);
+			}
+			st->usecs = u;
+		}
+		st->usecs[st->n++] = (tv->tv_sec - st->sent_at.tv_sec) * 1000000 +
+				     tv->tv_usec - st->sent_at.tv_usec;
+		st->pending = 0;
+	}
 	if (FROM->sll_pkttype != PACKET_HOST)
 		brd_recv++;
 	if (ah->ar_op == htons(ARPOP_REQUEST))
 		req_recv++;
-	if (quit_on_reply)
+	if (t && t->replies++ == 0) {
+		memcpy(t->mac, p, me.sll_halen);
+		dad_conflicts++;
+	}
+	if (quit_on_reply && dad_conflicts == ndad)
 		finish();
-	if(!broadcast_only) {
+	/* the other addresses are still probed by broadcast */
+	if(!broadcast_only && !ndad) {
 		memcpy(he.sll_addr, p, me.sll_halen);
 		unicasting=1;
 	}
 	return 1;
 }
 
+#ifdef HAVE_LINUX_FILTER_H
+#define ARPF_DROP	0xff	/* jump offset, patched to reach the drop */
+
+/*
+ * Compare len bytes at off in the ARP packet with p, a word, half word
+ * or byte at a time. The packet is dropped if any of them differs, or
+ * with negate only if all of them match.
+ */
+static int filter_bytes(struct sock_filter *code, int n, int off,
+			const unsigned char *p, int len, int negate)
+{
+	int i, j, sz, first = n;
+	__u32 k;
+
+	for (i = 0; i < len; i += sz) {
+		sz = len - i >= 4 ? 4 : len - i >= 2 ? 2 : 1;
+		for (k = 0, j = 0; j < sz; j++)
+			k = k << 8 | p[i + j];
+		code[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_ABS |
+			(sz == 4 ? BPF_W : sz == 2 ? BPF_H : BPF_B), off + i);
+		if (!negate)
+			code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+								 k, 0, ARPF_DROP);
+		else if (i + sz < len)
+			code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+								 k, 0, 0);
+		else
+			code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+								 k, ARPF_DROP, 0);
+	}
+	/* with negate the first difference skips the rest */
+	if (negate)
+		for (i = first + 1; i < n - 2; i += 2)
+			code[i].jf = n - i - 1;
+	return n;
+}
+
+/*
+ * Have the kernel apply the checks of recv_pack() that do not change
+ * while we run, so an ARP storm on the segment does not wake us up for
+ * every frame. recv_pack() keeps its own checks: frames queued before
+ * the filter is attached still go through them, and so does the
+ * hardware type, which the filter does not look at.
+ */
+void filter_arp(int s)
+{
+	struct sock_filter code[40];
+	struct sock_fprog prog;
+	int n = 0, i, hln = me.sll_halen;
+
+	if (hln > sizeof(me.sll_addr))
+		return;
+
+	code[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+						 SKF_AD_OFF + SKF_AD_PKTTYPE);
+	code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JGT | BPF_K,
+						 PACKET_MULTICAST, ARPF_DROP, 0);
+	code[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 2);
+	code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+						 ETH_P_IP, 0, ARPF_DROP);
+	code[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 4);
+	code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+						 hln, 0, ARPF_DROP);
+	code[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 5);
+	code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+						 4, 0, ARPF_DROP);
+	code[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 6);
+	code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+						 ARPOP_REQUEST, 1, 0);
+	code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+						 ARPOP_REPLY, 0, ARPF_DROP);
+
+	/* the sender must be the address we ask about */
+	if (!ndad)
+		n = filter_bytes(code, n, 8 + hln, (unsigned char *)&dst, 4, 0);
+	if (!dad) {
+		/* ... and answer us */
+		n = filter_bytes(code, n, 8 + hln + 4 + hln,
+				 (unsigned char *)&src, 4, 0);
+		n = filter_bytes(code, n, 8 + hln + 4, me.sll_addr, hln, 0);
+	} else {
+		/* ... from another station */
+		n = filter_bytes(code, n, 8, me.sll_addr, hln, 1);
+		if (src.s_addr)
+			n = filter_bytes(code, n, 8 + hln + 4 + hln,
+					 (unsigned char *)&src, 4, 0);
+	}
+	code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0xffff);
+	code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0);
+
+	for (i = 0; i < n; i++) {
+		if (BPF_CLASS(code[i].code) != BPF_JMP)
+			continue;
+		if (code[i].jt == ARPF_DROP)
+			code[i].jt = n - 1 - (i + 1);
+		if (code[i].jf == ARPF_DROP)
+			code[i].jf = n - 1 - (i + 1);
+	}
+
+	prog.len = n;
+	prog.filter = code;
+	if (setsockopt(s, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) == -1)
+		perror("WARNING: setsockopt(SO_ATTACH_FILTER)");
+}
+#else
+void filter_arp(int s)
+{
+}
+#endif
+
+#ifdef TPACKET3_HDRLEN
+/*
+ * Frames are read from a TPACKET_V3 ring: the kernel wakes us once per
+ * filled block, or RING_TOV ms after the first frame of a block, and
+ * stamps every frame on arrival, so the wait costs no RTT accuracy.
+ */
+#define RING_BLOCK_SIZE	(1 << 16)
+#define RING_BLOCKS	8
+#define RING_FRAME_SIZE	2048
+#define RING_TOV	10
+
+static unsigned char *ring;
+static int ring_block;
+
+static void setup_ring(int s)
+{
+	struct tpacket_req3 req;
+	int v = TPACKET_V3;
+
+	if (setsockopt(s, SOL_PACKET, PACKET_VERSION, &v, sizeof(v)) == -1)
+		return;
+	memset(&req, 0, sizeof(req));
+	req.tp_block_size = RING_BLOCK_SIZE;
+	req.tp_block_nr = RING_BLOCKS;
+	req.tp_frame_size = RING_FRAME_SIZE;
+	req.tp_frame_nr = RING_BLOCKS * (RING_BLOCK_SIZE / RING_FRAME_SIZE);
+	req.tp_retire_blk_tov = RING_TOV;
+	if (setsockopt(s, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) == -1)
+		return;
+	ring = mmap(NULL, RING_BLOCKS * RING_BLOCK_SIZE, PROT_READ|PROT_WRITE,
+		    MAP_SHARED, s, 0);
+	if (ring == MAP_FAILED) {
+		/* back to recvfrom() */
+		ring = NULL;
+		memset(&req, 0, sizeof(req));
+		setsockopt(s, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req));
+	}
+}
+
+static void read_ring(void)
+{
+	struct tpacket_block_desc *bd;
+	struct tpacket3_hdr *h;
+	struct timeval tv;
+	int i;
+
+	while (1) {
+		bd = (struct tpacket_block_desc *)(ring + ring_block * RING_BLOCK_SIZE);
+		if (!(bd->hdr.bh1.block_status & TP_STATUS_USER))
+			break;
+		__sync_synchronize();
+		h = (struct tpacket3_hdr *)((unsigned char *)bd +
+					    bd->hdr.bh1.offset_to_first_pkt);
+		for (i = 0; i < bd->hdr.bh1.num_pkts; i++) {
+			tv.tv_sec = h->tp_sec;
+			tv.tv_usec = h->tp_nsec / 1000;
+			recv_pack((unsigned char *)h + h->tp_net, h->tp_snaplen,
+				  (struct sockaddr_ll *)((unsigned char *)h +
+					TPACKET_ALIGN(sizeof(*h))), &tv);
+			h = (struct tpacket3_hdr *)((unsigned char *)h + h->tp_next_offset);
+		}
+		__sync_synchronize();
+		bd->hdr.bh1.block_status = TP_STATUS_KERNEL;
+		ring_block = (ring_block + 1) % RING_BLOCKS;
+	}
+}
+#else
+static unsigned char *ring;
+
+static void setup_ring(int s)
+{
+}
+
+static void read_ring(void)
+{
+}
+#endif
+
+int resolve_target(const char *name, struct in_addr *addr)
+{
+	struct hostent *hp;
+
+	if (inet_aton(name, addr) == 1)
+		return 0;
+	hp = gethostbyname2(name, AF_INET);
+	if (!hp) {
+		fprintf(stderr, "arping: unknown host %s\n", name);
+		return -1;
+	}
+	memcpy(addr, hp->h_addr, 4);
+	return 0;
+}
+
+static unsigned int dad_slot(struct in_addr ip)
+{
+	unsigned int h = ntohl(ip.s_addr) * 2654435761U;
+
+	h = (h ^ (h >> 16)) & dad_mask;
+	while (dad_hash[h] >= 0 && dad_targets[dad_hash[h]].ip.s_addr != ip.s_addr)
+		h = (h + 1) & dad_mask;
+	return h;
+}
+
+struct dad_target *dad_lookup(struct in_addr ip)
+{
+	int i = dad_hash[dad_slot(ip)];
+
+	return i < 0 ? NULL : &dad_targets[i];
+}
+
+/* Set up DAD for all of names, each address once */
+static void dad_init(char **names, int n)
+{
+	struct in_addr ip;
+	unsigned int size, h;
+	int i;
+
+	for (size = 4; size < 2 * n; size <<= 1)
+		;
+	dad_mask = size - 1;
+	dad_hash = malloc(size * sizeof(*dad_hash));
+	dad_targets = calloc(n, sizeof(*dad_targets));
+	rtts = calloc(n, sizeof(*rtts));
+	if (!dad_hash || !dad_targets || !rtts) {
+		perror("arping: malloc");
+		exit(2);
+	}
+	memset(dad_hash, -1, size * sizeof(*dad_hash));
+
+	for (i = 0; i < n; i++) {
+		if (resolve_target(names[i], &ip))
+			exit(2);
+		h = dad_slot(ip);
+		if (dad_hash[h] >= 0)
+			continue;
+		dad_hash[h] = ndad;
+		dad_targets[ndad++].ip = ip;
+	}
+}
+
+/*
+ * Fan-out for bonded and VLAN trunked setups: with -U or -A the device
+ * may be a comma separated list, and "dev.*" stands for dev and every
+ * VLAN configured on top of it.  The first usable interface is the one
+ * arping always used; each further one gets a packet socket of its own,
+ * bound to protocol 0 so that it receives nothing, and every tick sends
+ * the announcement out of all of them back to back.  Unusable members
+ * are skipped, so one VLAN that is down does not hold up the others.
+ */
+#define VLAN_CONFIG	"/proc/net/vlan/config"
+
+static void fan_add(char ***names, int *n, const char *name)
+{
+	char **p;
+	int i;
+
+	for (i = 0; i < *n; i++)
+		if (!strcmp((*names)[i], name))
+			return;
+	p = realloc(*names, (*n + 1) * sizeof(*p));
+	if (!p || !(p[*n] = strdup(name))) {
+		perror("arping: malloc");
+		exit(2);
+	}
+	*names = p;
+	(*n)++;
+}
+
+/* "eth0.100 | 100 | eth0" lines; without 8021q there are no VLANs */
+static void fan_add_vlans(char ***names, int *n, const char *parent)
+{
+	char line[256], name[IFNAMSIZ], real[IFNAMSIZ];
+	FILE *fp;
+	int vid;
+
+	fan_add(names, n, parent);
+	if (!(fp = fopen(VLAN_CONFIG, "r")))
+		return;
+	while (fgets(line, sizeof(line), fp)) {
+		if (sscanf(line, "%15s | %d | %15s", name, &vid, real) == 3 &&
+		    !strcmp(real, parent))
+			fan_add(names, n, name);
+	}
+	fclose(fp);
+}
+
+static int is_vlan_spec(const char *name)
+{
+	int len = strlen(name);
+
+	return len > 2 && !strcmp(name + len - 2, ".*");
+}
+
+/* Open the fan-out links; returns the device the main socket is for */
+static char *fan_init(char *spec)
+{
+	char **names = NULL, *copy, *tok, *save, *primary = NULL;
+	int nnames = 0, primary_ifindex = 0, i, j;
+	struct fan_link *f;
+	struct ann_link *l;
+	socklen_t alen;
+
+	if (!strchr(spec, ',') && !is_vlan_spec(spec))
+		return spec;
+	if (!unsolicited || dad) {
+		fprintf(stderr, "arping: several devices only with -U or -A\n");
+		exit(2);
+	}
+
+	if (!(copy = strdup(spec))) {
+		perror("arping: malloc");
+		exit(2);
+	}
+	for (tok = strtok_r(copy, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+		if (is_vlan_spec(tok)) {
+			tok[strlen(tok) - 2] = 0;
+			fan_add_vlans(&names, &nnames, tok);
+		} else
+			fan_add(&names, &nnames, tok);
+	}
+	free(copy);
+
+	fan = calloc(nnames, sizeof(*fan));
+	if (!fan) {
+		perror("arping: malloc");
+		exit(2);
+	}
+	for (i = 0; i < nnames; i++) {
+		if (!(l = ann_link_get(names[i])))
+			continue;
+		if (!(l->flags&IFF_UP) || (l->flags&(IFF_NOARP|IFF_LOOPBACK))) {
+			fprintf(stderr, "arping: interface \"%s\" is down or not ARPable, skipped\n",
+				names[i]);
+			continue;
+		}
+		if (l->ifindex == primary_ifindex)
+			continue;
+		for (j = 0; j < nfan; j++)
+			if (fan[j].me.sll_ifindex == l->ifindex)
+				break;
+		if (j < nfan)
+			continue;
+		if (!primary) {
+			primary = names[i];
+			primary_ifindex = l->ifindex;
+			continue;
+		}
+
+		f = &fan[nfan];
+		if ((f->s = socket(PF_PACKET, SOCK_DGRAM, 0)) < 0) {
+			perror("arping: socket");
+			exit(2);
+		}
+		f->me.sll_family = AF_PACKET;
+		f->me.sll_ifindex = l->ifindex;
+		f->me.sll_protocol = 0;
+		alen = sizeof(f->me);
+		if (bind(f->s, (struct sockaddr *)&f->me, sizeof(f->me)) == -1 ||
+		    getsockname(f->s, (struct sockaddr *)&f->me, &alen) == -1) {
+			fprintf(stderr, "arping: %s: %s\n", names[i], strerror(errno));
+			exit(2);
+		}
+		if (f->me.sll_halen == 0) {
+			fprintf(stderr, "arping: interface \"%s\" has no ll address, skipped\n",
+				names[i]);
+			close(f->s);
+			continue;
+		}
+		f->he = f->me;
+		f->he.sll_protocol = htons(ETH_P_ARP);
+		memset(f->he.sll_addr, -1, f->he.sll_halen);
+		nfan++;
+	}
+	if (!primary) {
+		fprintf(stderr, "arping: no usable interface in %s\n", spec);
+		exit(2);
+	}
+	return primary;
+}
+
+/*
+ * -F announces a whole list of addresses, as at the takeover of a node
+ * with many VIPs, instead of one send_arp process per address.  Like
+ * the libnet send_arp, every round sends an ARP request and, half an
+ * interval later, an ARP reply for each address.  The frames are built
+ * once; a single packet socket sends them to all interfaces, batched
+ * with sendmmsg() and paced to the -R budget.
+ */
+#define LIST_BATCH	ANN_BATCH
+#define ARP_LEN		ANN_ARP_LEN(ETH_ALEN)
+
+struct list_entry {
+	int		ifindex;
+	unsigned char	frame[2][ARP_LEN];	/* request, reply */
+};
+
+static int list_rate;
+
+/* "auto" or twelve hex digits, with or without colons */
+static int parse_mac(const char *s, unsigned char mac[ETH_ALEN])
+{
+	int i;
+	unsigned int b;
+
+	for (i = 0; i < ETH_ALEN; i++) {
+		if (*s == ':')
+			s++;
+		if (!isxdigit((unsigned char)s[0]) || !isxdigit((unsigned char)s[1])
+		    || sscanf(s, "%2x", &b) != 1)
+			return -1;
+		mac[i] = b;
+		s += 2;
+	}
+	return *s ? -1 : 0;
+}
+
+/* A cached interface that is up, can do ARP and has an Ethernet address */
+static struct ann_link *list_iface(const char *name)
+{
+	struct ann_link *l;
+
+	if (!(l = ann_link_get(name)))
+		return NULL;
+	if (!(l->flags&IFF_UP) || (l->flags&(IFF_NOARP|IFF_LOOPBACK))) {
+		fprintf(stderr, "send_arp: interface \"%s\" is down or not ARPable\n", name);
+		ann_link_forget(l->ifindex);
+		return NULL;
+	}
+	if (l->hatype != ARPHRD_ETHER) {
+		fprintf(stderr, "send_arp: interface \"%s\" is not Ethernet\n", name);
+		ann_link_forget(l->ifindex);
+		return NULL;
+	}
+	return l;
+}
+
+/* As the libnet send_arp: target hw address 0 in requests, ours in replies */
+static void build_list_frame(unsigned char *buf, int op, const unsigned char *mac,
+			     struct in_addr ip)
+{
+	ann_arp_frame(buf, ARPHRD_ETHER, op, ETH_ALEN, mac, ip,
+		      op == ARPOP_REPLY ? mac : NULL, ip);
+}
+
+/* Read "device ip [mac]" lines; returns the number of bad lines */
+static int read_list(FILE *fp, struct list_entry **entries, int *nentries)
+{
+	struct ann_link *ifc;
+	struct list_entry *e;
+	struct in_addr ip;
+	unsigned char mac[ETH_ALEN];
+	char line[256], dev[64], addr[64], macstr[64];
+	int size = 0, lineno = 0, bad = 0, n;
+
+	*entries = NULL;
+	*nentries = 0;
+	while (fgets(line, sizeof(line), fp)) {
+		lineno++;
+		n = sscanf(line, "%63s %63s %63s", dev, addr, macstr);
+		if (n <= 0 || dev[0] == '#')
+			continue;
+		if (n < 2 || inet_aton(addr, &ip) != 1
+		    || !(ifc = list_iface(dev))) {
+			fprintf(stderr, "send_arp: skipping line %d: %s", lineno, line);
+			bad++;
+			continue;
+		}
+		if (n < 3 || !strcasecmp(macstr, "auto"))
+			memcpy(mac, ifc->hwaddr, ETH_ALEN);
+		else if (parse_mac(macstr, mac)) {
+			fprintf(stderr, "send_arp: bad MAC address on line %d: %s",
+				lineno, macstr);
+			bad++;
+			continue;
+		}
+
+		if (*nentries == size) {
+			size = size ? 2*size : 64;
+			e = realloc(*entries, size * sizeof(*e));
+			if (!e) {
+				perror("send_arp: realloc");
+				exit(2);
+			}
+			*entries = e;
+		}
+		e = &(*entries)[(*nentries)++];
+		e->ifindex = ifc->ifindex;
+		build_list_frame(e->frame[0], ARPOP_REQUEST, mac, ip);
+		build_list_frame(e->frame[1], ARPOP_REPLY, mac, ip);
+	}
+	return bad;
+}
+
+/*
+ * Send frame 'which' of every entry; returns the number of frames that
+ * could not be sent.
+ */
+static int send_list(int s, struct list_entry *entries, int n, int which,
+		     struct ann_pace *pace)
+{
+	static const unsigned char bcast[ETH_ALEN] = {
+		0xff, 0xff, 0xff, 0xff, 0xff, 0xff
+	};
+	struct ann_frame f[LIST_BATCH];
+	int i, j, batch, lost, failed = 0;
+
+	/* no more than 10ms worth of packets back to back */
+	batch = list_rate ? list_rate / 100 : LIST_BATCH;
+	if (batch < 1)
+		batch = 1;
+	if (batch > LIST_BATCH)
+		batch = LIST_BATCH;
+
+	for (i = 0; i < n; i += batch) {
+		for (j = 0; j < batch && i + j < n; j++) {
+			f[j].ifindex = entries[i+j].ifindex;
+			f[j].data    = entries[i+j].frame[which];
+			f[j].len     = ARP_LEN;
+		}
+		ann_pace(pace, j);
+		lost = ann_send_frames(s, f, j, ETH_P_ARP, bcast, ETH_ALEN);
+		sent += j - lost;
+		failed += lost;
+	}
+	return failed;
+}
+
+static int announce_list(int s, const char *file)
+{
+	struct list_entry *entries;
+	struct ann_pace pace;
+	struct timespec due;
+	FILE *fp = stdin;
+	int n, bad, failed = 0, round;
+
+	if (strcmp(file, "-") && !(fp = fopen(file, "r"))) {
+		fprintf(stderr, "send_arp: cannot open %s: %s\n", file, strerror(errno));
+		return 2;
+	}
+	bad = read_list(fp, &entries, &n);
+	if (fp != stdin)
+		fclose(fp);
+
+	if (count <= 0)
+		count = 1;
+	/* half intervals count from when a round starts, not ends */
+	ann_pace_init(&pace, list_rate);
+	ann_now(&due);
+	for (round = 0; round < count && n; round++) {
+		failed += send_list(s, entries, n, 0, &pace);
+		ann_add_us(&due, interval_ms * 500L);
+		ann_sleep_until(&due);
+		failed += send_list(s, entries, n, 1, &pace);
+		ann_add_us(&due, interval_ms * 500L);
+		if (round != count-1)
+			ann_sleep_until(&due);
+	}
+	if (!quiet)
+		printf("Sent %d ARP packets for %d addresses (%d failed, %d bad lines)\n",
+		       sent, n, failed, bad);
+	free(entries);
+	return failed || bad ? 1 : 0;
+}
+
+/*
+ * Announce service (-S socket): a resident send_arp that keeps its
+ * packet socket, and the index and MAC address of every interface it
+ * has used, and takes one request per line on a UNIX stream socket:
+ *
+ *	announce device ip [mac|auto] [count [interval-ms]]
+ *	dad device ip [count [interval-ms]]
+ *	cancel ip
+ *
+ * announce and cancel are answered "ok" at once, dad when it is done
+ * with "free ip" or "inuse ip mac". Bad requests get "error text".
+ * An announce for an address that is being announced already replaces
+ * it, as starting a new send_arp used to kill the old one.
+ */
+#define SVC_ANNOUNCE	0
+#define SVC_DAD		1
+#define SVC_CLIENTS	64
+
+struct svc_job {
+	struct svc_job	*next;
+	int		kind;
+	int		ifindex;
+	struct in_addr	ip;
+	unsigned char	mac[ETH_ALEN];		/* announced, or probing from */
+	unsigned char	frame[2][ARP_LEN];	/* request, reply; or the probe */
+	int		left;			/* frames still to send */
+	int		interval_ms;
+	struct timespec	due;
+	int		client;			/* waiting for the DAD result */
+};
+
+struct svc_client {
+	int		fd;
+	size_t		len;
+	char		buf[256];
+};
+
+static struct svc_job *svc_jobs;
+static struct svc_client svc_clients[SVC_CLIENTS];
+static int svc_ndad;
+
+static void svc_reply(int fd, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+static void svc_reply(int fd, const char *fmt, ...)
+{
+	char line[128];
+	va_list ap;
+	int n;
+
+	if (fd < 0)
+		return;
+	va_start(ap, fmt);
+	n = vsnprintf(line, sizeof(line) - 1, fmt, ap);
+	va_end(ap);
+	if (n < 0)
+		return;
+	if (n > sizeof(line) - 2)
+		n = sizeof(line) - 2;
+	line[n++] = '\n';
+	send(fd, line, n, MSG_NOSIGNAL | MSG_DONTWAIT);
+}
+
+/*
+ * The socket is bound to ETH_P_ARP only while a DAD runs; bound to
+ * protocol 0 it receives nothing, so announcing alone never wakes the
+ * service up for the ARP traffic on the segment.
+ */
+static void svc_listen(int s, int on)
+{
+	struct sockaddr_ll sll;
+
+	memset(&sll, 0, sizeof(sll));
+	sll.sll_family = AF_PACKET;
+	sll.sll_protocol = on ? htons(ETH_P_ARP) : 0;
+	if (bind(s, (struct sockaddr *)&sll, sizeof(sll)) == -1)
+		perror("send_arp: bind");
+}
+
+static void svc_remove(int s, struct svc_job **jp)
+{
+	struct svc_job *j = *jp;
+
+	*jp = j->next;
+	if (j->kind == SVC_DAD && --svc_ndad == 0)
+		svc_listen(s, 0);
+	free(j);
+}
+
+static char *svc_mac(const unsigned char *mac)
+{
+	static char buf[3 * ETH_ALEN];
+
+	snprintf(buf, sizeof(buf), "%02x:%02x:%02x:%02x:%02x:%02x",
+		 mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+	return buf;
+}
+
+static void svc_request(int s, int fd, char *line)
+{
+	struct ann_link *ifc;
+	struct svc_job *j, **jp;
+	struct in_addr ip;
+	unsigned char mac[ETH_ALEN];
+	char *argv[6], *tok, *save;
+	int argc = 0, kind, i, n, ms;
+
+	for (tok = strtok_r(line, " \t\r", &save); tok && argc < 6;
+	     tok = strtok_r(NULL, " \t\r", &save))
+		argv[argc++] = tok;
+	if (!argc)
+		return;
+
+	if (!strcmp(argv[0], "cancel")) {
+		if (argc != 2 || inet_aton(argv[1], &ip) != 1) {
+			svc_reply(fd, "error usage: cancel ip");
+			return;
+		}
+		for (jp = &svc_jobs; (j = *jp); ) {
+			if (j->ip.s_addr != ip.s_addr) {
+				jp = &j->next;
+				continue;
+			}
+			svc_reply(j->client, "cancelled %s", inet_ntoa(ip));
+			svc_remove(s, jp);
+		}
+		svc_reply(fd, "ok");
+		return;
+	}
+
+	if (!strcmp(argv[0], "announce"))
+		kind = SVC_ANNOUNCE;
+	else if (!strcmp(argv[0], "dad"))
+		kind = SVC_DAD;
+	else {
+		svc_reply(fd, "error unknown request %s", argv[0]);
+		return;
+	}
+	if (argc < 3 || inet_aton(argv[2], &ip) != 1) {
+		svc_reply(fd, "error usage: %s device ip%s [count [interval-ms]]",
+			  argv[0], kind == SVC_ANNOUNCE ? " [mac|auto]" : "");
+		return;
+	}
+	/* Look the link up again: its address may have changed since */
+	ann_link_flush();
+	if (!(ifc = list_iface(argv[1]))) {
+		svc_reply(fd, "error cannot use interface %s", argv[1]);
+		return;
+	}
+	memcpy(mac, ifc->hwaddr, ETH_ALEN);
+	i = 3;
+	if (kind == SVC_ANNOUNCE && argc > i &&
+	    (!strcasecmp(argv[i], "auto") || !parse_mac(argv[i], mac)))
+		i++;
+	n = argc > i ? atoi(argv[i]) : count > 0 ? count : 3;
+	ms = argc > i + 1 ? atoi(argv[i + 1]) : interval_ms;
+	if (n <= 0 || ms <= 0 || argc > i + 2) {
+		svc_reply(fd, "error bad count or interval");
+		return;
+	}
+
+	if (kind == SVC_ANNOUNCE) {
+		for (jp = &svc_jobs; (j = *jp); ) {
+			if (j->kind == SVC_ANNOUNCE && j->ip.s_addr == ip.s_addr)
+				svc_remove(s, jp);
+			else
+				jp = &j->next;
+		}
+	}
+
+	if (!(j = calloc(1, sizeof(*j)))) {
+		svc_reply(fd, "error out of memory");
+		return;
+	}
+	j->kind = kind;
+	j->ifindex = ifc->ifindex;
+	j->ip = ip;
+	memcpy(j->mac, mac, ETH_ALEN);
+	j->interval_ms = ms;
+	j->client = -1;
+	ann_now(&j->due);
+	if (kind == SVC_ANNOUNCE) {
+		build_list_frame(j->frame[0], ARPOP_REQUEST, mac, ip);
+		build_list_frame(j->frame[1], ARPOP_REPLY, mac, ip);
+		j->left = 2 * n;
+		svc_reply(fd, "ok");
+	} else {
+		/* probes carry no sender address */
+		build_list_frame(j->frame[0], ARPOP_REQUEST, mac, ip);
+		memset(j->frame[0] + sizeof(struct arphdr) + ETH_ALEN, 0, 4);
+		j->left = n;
+		j->client = fd;
+		if (svc_ndad++ == 0)
+			svc_listen(s, 1);
+	}
+	j->next = svc_jobs;
+	svc_jobs = j;
+}
+
+/* Send whatever is due, and return when the next frame will be */
+static int svc_run(int s, struct timespec *next)
+{
+	struct sockaddr_ll to;
+	struct svc_job *j, **jp;
+	struct timespec now;
+	unsigned char *frame;
+	int pending = 0;
+
+	ann_now(&now);
+	memset(&to, 0, sizeof(to));
+	to.sll_family = AF_PACKET;
+	to.sll_protocol = htons(ETH_P_ARP);
+	to.sll_halen = ETH_ALEN;
+	memset(to.sll_addr, 0xff, ETH_ALEN);
+
+	for (jp = &svc_jobs; (j = *jp); ) {
+		if (ann_before(&now, &j->due))
+			goto keep;
+		if (j->left == 0) {
+			/* the last probe went unanswered too */
+			svc_reply(j->client, "free %s", inet_ntoa(j->ip));
+			svc_remove(s, jp);
+			continue;
+		}
+		frame = j->kind == SVC_DAD ? j->frame[0] : j->frame[j->left & 1];
+		to.sll_ifindex = j->ifindex;
+		if (sendto(s, frame, ARP_LEN, 0, (struct sockaddr *)&to, sizeof(to)) < 0) {
+			/* the interface went away; look it up again next time */
+			if (errno == ENXIO || errno == ENODEV)
+				ann_link_forget(j->ifindex);
+			fprintf(stderr, "send_arp: %s: %s\n", inet_ntoa(j->ip),
+				strerror(errno));
+			svc_reply(j->client, "error %s: %s", inet_ntoa(j->ip),
+				  strerror(errno));
+			svc_remove(s, jp);
+			continue;
+		}
+		sent++;
+		if (--j->left == 0 && j->kind == SVC_ANNOUNCE) {
+			svc_remove(s, jp);
+			continue;
+		}
+		j->due = now;
+		ann_add_ms(&j->due, j->kind == SVC_ANNOUNCE ? j->interval_ms / 2
+							: j->interval_ms);
+	keep:
+		if (!pending++ || ann_before(&j->due, next))
+			*next = j->due;
+		jp = &j->next;
+	}
+	return pending;
+}
+
+/* A DAD fails on any ARP from another station that claims its address */
+static void svc_recv(int s)
+{
+	unsigned char buf[256];
+	struct arphdr *ah = (struct arphdr *)buf;
+	unsigned char *p = (unsigned char *)(ah+1);
+	struct sockaddr_ll from;
+	socklen_t alen = sizeof(from);
+	struct svc_job *j, **jp;
+	struct in_addr ip;
+	int cc;
+
+	while ((cc = recvfrom(s, buf, sizeof(buf), MSG_DONTWAIT,
+			      (struct sockaddr *)&from, &alen)) >= 0) {
+		alen = sizeof(from);
+		if (cc < ARP_LEN || from.sll_pkttype == PACKET_OUTGOING ||
+		    ah->ar_pro != htons(ETH_P_IP) || ah->ar_hln != ETH_ALEN ||
+		    ah->ar_pln != 4 || (ah->ar_op != htons(ARPOP_REQUEST) &&
+					ah->ar_op != htons(ARPOP_REPLY)))
+			continue;
+		memcpy(&ip, p + ETH_ALEN, 4);
+		for (jp = &svc_jobs; (j = *jp); ) {
+			if (j->kind != SVC_DAD || j->ifindex != from.sll_ifindex ||
+			    j->ip.s_addr != ip.s_addr || !memcmp(p, j->mac, ETH_ALEN)) {
+				jp = &j->next;
+				continue;
+			}
+			svc_reply(j->client, "inuse %s %s", inet_ntoa(ip), svc_mac(p));
+			svc_remove(s, jp);
+		}
+	}
+}
+
+static struct svc_client *svc_client(int fd)
+{
+	int i;
+
+	for (i = 0; i < SVC_CLIENTS; i++)
+		if (svc_clients[i].fd == fd)
+			return &svc_clients[i];
+	return NULL;
+}
+
+/* Returns -1 once the client is gone */
+static int svc_read(int s, struct svc_client *c)
+{
+	struct svc_job *j;
+	char *nl;
+	int n;
+
+	while ((n = read(c->fd, c->buf + c->len, sizeof(c->buf) - 1 - c->len)) > 0) {
+		c->len += n;
+		c->buf[c->len] = 0;
+		while ((nl = strchr(c->buf, '\n'))) {
+			*nl = 0;
+			svc_request(s, c->fd, c->buf);
+			c->len -= nl + 1 - c->buf;
+			memmove(c->buf, nl + 1, c->len + 1);
+		}
+		if (c->len == sizeof(c->buf) - 1) {
+			svc_reply(c->fd, "error request too long");
+			n = 0;
+			break;
+		}
+	}
+	if (n < 0 && (errno == EAGAIN || errno == EINTR))
+		return 0;
+
+	for (j = svc_jobs; j; j = j->next)
+		if (j->client == c->fd)
+			j->client = -1;
+	close(c->fd);
+	c->fd = -1;
+	return -1;
+}
+
+static int announce_service(int s, const char *path)
+{
+	struct sockaddr_un sun;
+	struct epoll_event ev, events[16];
+	struct itimerspec its;
+	struct svc_client *c;
+	sigset_t sset;
+	mode_t mask;
+	int lfd, tfd, sfd, ep, fd, i, n;
+
+	if (strlen(path) >= sizeof(sun.sun_path)) {
+		fprintf(stderr, "send_arp: socket path too long: %s\n", path);
+		return 2;
+	}
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, path);
+	lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (lfd < 0) {
+		perror("send_arp: socket");
+		return 2;
+	}
+	unlink(path);
+	mask = umask(077);
+	if (bind(lfd, (struct sockaddr *)&sun, sizeof(sun)) == -1 ||
+	    listen(lfd, SVC_CLIENTS) == -1) {
+		fprintf(stderr, "send_arp: cannot listen on %s: %s\n", path,
+			strerror(errno));
+		return 2;
+	}
+	umask(mask);
+
+	sigemptyset(&sset);
+	sigaddset(&sset, SIGINT);
+	sigaddset(&sset, SIGTERM);
+	sigprocmask(SIG_BLOCK, &sset, NULL);
+	sfd = signalfd(-1, &sset, SFD_NONBLOCK|SFD_CLOEXEC);
+	tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+	ep = epoll_create1(EPOLL_CLOEXEC);
+	if (sfd < 0 || tfd < 0 || ep < 0) {
+		perror("send_arp: event loop");
+		unlink(path);
+		return 2;
+	}
+	for (i = 0; i < SVC_CLIENTS; i++)
+		svc_clients[i].fd = -1;
+	svc_listen(s, 0);
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = s;
+	epoll_ctl(ep, EPOLL_CTL_ADD, s, &ev);
+	ev.data.fd = lfd;
+	epoll_ctl(ep, EPOLL_CTL_ADD, lfd, &ev);
+	ev.data.fd = tfd;
+	epoll_ctl(ep, EPOLL_CTL_ADD, tfd, &ev);
+	ev.data.fd = sfd;
+	epoll_ctl(ep, EPOLL_CTL_ADD, sfd, &ev);
+
+	while (1) {
+		n = epoll_wait(ep, events, 16, -1);
+		if (n < 0) {
+			if (errno != EINTR)
+				perror("send_arp: epoll_wait");
+			continue;
+		}
+		for (i = 0; i < n; i++) {
+			fd = events[i].data.fd;
+			if (fd == sfd) {
+				unlink(path);
+				return 0;
+			} else if (fd == tfd) {
+				uint64_t expired;
+
+				if (read(tfd, &expired, sizeof(expired)) < 0)
+					continue;
+			} else if (fd == s) {
+				svc_recv(s);
+			} else if (fd == lfd) {
+				while ((fd = accept4(lfd, NULL, NULL,
+						     SOCK_NONBLOCK|SOCK_CLOEXEC)) >= 0) {
+					if (!(c = svc_client(-1))) {
+						svc_reply(fd, "error too many clients");
+						close(fd);
+						continue;
+					}
+					c->fd = fd;
+					c->len = 0;
+					ev.data.fd = fd;
+					epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev);
+				}
+			} else if ((c = svc_client(fd))) {
+				svc_read(s, c);
+			}
+		}
+
+		memset(&its, 0, sizeof(its));
+		if (svc_run(s, &its.it_value) &&
+		    its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0)
+			its.it_value.tv_nsec = 1;
+		timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, NULL);
+	}
+}
+
+/* -C: hand one request to a send_arp -S and print the answer */
+static int ask_service(const char *path, int argc, char **argv)
+{
+	struct sockaddr_un sun;
+	char line[256];
+	size_t len = 0;
+	int fd, i, n;
+
+	if (argc < 1 || strlen(path) >= sizeof(sun.sun_path))
+		usage();
+	for (i = 0; i < argc; i++) {
+		n = snprintf(line + len, sizeof(line) - len, "%s%s", argv[i],
+			     i == argc - 1 ? "\n" : " ");
+		if (n >= sizeof(line) - len) {
+			fprintf(stderr, "send_arp: request too long\n");
+			return 2;
+		}
+		len += n;
+	}
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, path);
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr *)&sun, sizeof(sun)) == -1) {
+		fprintf(stderr, "send_arp: cannot connect to %s: %s\n", path,
+			strerror(errno));
+		return 2;
+	}
+	if (write(fd, line, len) != len) {
+		perror("send_arp: write");
+		return 2;
+	}
+	for (len = 0; len < sizeof(line) - 1; len += n) {
+		n = read(fd, line + len, sizeof(line) - 1 - len);
+		if (n <= 0 || memchr(line + len, '\n', n)) {
+			len += n > 0 ? n : 0;
+			break;
+		}
+	}
+	close(fd);
+	line[len] = 0;
+	fputs(line, stdout);
+	if (!strncmp(line, "ok", 2) || !strncmp(line, "free ", 5))
+		return 0;
+	return strncmp(line, "inuse ", 6) ? 2 : 1;
+}
+
 #include <signal.h>
 
 static void byebye(int nsig)
@@ -328,6 +1631,7 @@ main(int argc, char **argv)
 	signal(SIGTERM, byebye);
 	signal(SIGPIPE, byebye);
 	
+	ann_log_init("send_arp", NULL);
 	device = strdup("eth0");
 	
 	s = socket(PF_PACKET, SOCK_DGRAM, 0);
@@ -338,7 +1642,7 @@ main(int argc, char **argv)
 		exit(-1);
 	}
 
-	while ((ch = getopt(argc, argv, "h?bfDUAqc:w:s:I:Vr:i:p:")) != EOF) {
+	while ((ch = getopt(argc, argv, "h?bfDUAqc:w:s:I:Vr:i:p:F:R:S:C:j:")) != EOF) {
 		switch(ch) {
 		case 'b':
 			broadcast_only=1;
@@ -377,11 +1681,28 @@ main(int argc, char **argv)
 		case 'V':
 			printf("send_arp utility\n");
 			exit(0);
-		case 'p':
 		case 'i':
+		    interval_ms = atoi(optarg);
+		    break;
+		case 'p':
 		    hb_mode = 1;
-		    /* send_arp compatability options, ignore */
+		    /* send_arp compatability option, ignore */
 		    break;
+		case 'F':
+			list_file = optarg;
+			break;
+		case 'R':
+			list_rate = atoi(optarg);
+			break;
+		case 'S':
+			svc_path = optarg;
+			break;
+		case 'C':
+			svc_server = optarg;
+			break;
+		case 'j':
+			json_file = optarg;
+			break;
 		case 'h':
 		case '?':
 		default:
@@ -389,6 +1710,40 @@ main(int argc, char **argv)
 		}
 	}
 
+	/* flushed by the main loop after each batch of replies */
+	setvbuf(stdout, NULL, _IOFBF, 1 << 16);
+
+	if (list_file) {
+		if (argc != optind)
+			usage();
+		if (s < 0) {
+			errno = socket_errno;
+			perror("send_arp: socket");
+			exit(2);
+		}
+		exit(announce_list(s, list_file));
+	}
+
+	if (svc_server)
+		exit(ask_service(svc_server, argc - optind, argv + optind));
+	if (svc_path) {
+		if (argc != optind)
+			usage();
+		if (s < 0) {
+			errno = socket_errno;
+			perror("send_arp: socket");
+			exit(2);
+		}
+		exit(announce_service(s, svc_path));
+	}
+
+	/*
+	 * -i is also an arping option now; five operands without -D
+	 * are still the old "device ip mac broadcast netmask" call.
+	 */
+	if (!hb_mode && !dad && argc - optind == 5)
+		hb_mode = 1;
+
 	if(hb_mode) {
 	    /* send_arp compatability mode */
 	    if (argc - optind != 5) {
@@ -410,16 +1765,20 @@ main(int argc, char **argv)
 	} else {
 	    argc -= optind;
 	    argv += optind;
-	    if (argc != 1)
+	    if (argc < 1 || (argc > 1 && !dad))
 		usage();
 
 	    target = *argv;
+	    if (argc > 1)
+		dad_init(argv, argc);
 	}
 	
 	if (device == NULL) {
 		fprintf(stderr, "arping: device (option -I) is required\n");
 		usage();
 	}
+	device_list = device;
+	device = fan_init(device);
 
 	if (s < 0) {
 		errno = socket_errno;
@@ -453,15 +1812,8 @@ main(int argc, char **argv)
 		}
 	}
 
-	if (inet_aton(target, &dst) != 1) {
-		struct hostent *hp;
-		hp = gethostbyname2(target, AF_INET);
-		if (!hp) {
-			fprintf(stderr, "arping: unknown host %s\n", target);
-			exit(2);
-		}
-		memcpy(&dst, hp->h_addr, 4);
-	}
+	if (resolve_target(target, &dst))
+		exit(2);
 
 	if (source && inet_aton(source, &src) != 1) {
 		fprintf(stderr, "arping: invalid source %s\n", source);
@@ -537,9 +1889,18 @@ main(int argc, char **argv)
 	he = me;
 	memset(he.sll_addr, -1, he.sll_halen);
 
-	if (!quiet) {
-		printf("ARPING %s ", inet_ntoa(dst));
+	filter_arp(s);
+	setup_ring(s);
+
+	if (!quiet && ndad) {
+		printf("ARPING %d addresses ", ndad);
 		printf("from %s %s\n",  inet_ntoa(src), device ? : "");
+	} else if (!quiet) {
+		printf("ARPING %s ", inet_ntoa(dst));
+		printf("from %s %s", inet_ntoa(src), device ? : "");
+		if (nfan)
+			printf(" and %d more interface(s) of %s", nfan, device_list);
+		printf("\n");
 	}
 
 	if (!src.s_addr && !dad) {
@@ -547,30 +1908,82 @@ main(int argc, char **argv)
 		exit(2);
 	}
 
-	set_signal(SIGINT, finish);
-	set_signal(SIGALRM, catcher);
-
-	catcher();
-
-	while(1) {
-		sigset_t sset, osset;
-		unsigned char packet[4096];
-		struct sockaddr_ll from;
-		socklen_t alen = sizeof(from);
-		int cc;
+	/*
+	 * One loop waits for replies, the send timer and ^C, so packets
+	 * go out every interval_ms however short, and replies are handled
+	 * without blocking signals around them.
+	 */
+	if (1) {
+		struct epoll_event ev, events[3];
+		struct itimerspec its;
+		sigset_t sset;
+		int ep, tfd, sfd, i, n;
 
-		if ((cc = recvfrom(s, packet, sizeof(packet), 0,
-				   (struct sockaddr *)&from, &alen)) < 0) {
-			perror("arping: recvfrom");
-			continue;
-		}
 		sigemptyset(&sset);
-		sigaddset(&sset, SIGALRM);
 		sigaddset(&sset, SIGINT);
-		sigprocmask(SIG_BLOCK, &sset, &osset);
-		recv_pack(packet, cc, &from);
-		sigprocmask(SIG_SETMASK, &osset, NULL);
+		sigprocmask(SIG_BLOCK, &sset, NULL);
+		sfd = signalfd(-1, &sset, SFD_NONBLOCK|SFD_CLOEXEC);
+		tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+		ep = epoll_create1(EPOLL_CLOEXEC);
+		if (sfd < 0 || tfd < 0 || ep < 0) {
+			perror("arping: event loop");
+			exit(2);
+		}
+
+		if (interval_ms <= 0)
+			interval_ms = 1000;
+		memset(&its, 0, sizeof(its));
+		its.it_value.tv_nsec = 1;	/* the first packet right away */
+		its.it_interval.tv_sec = interval_ms / 1000;
+		its.it_interval.tv_nsec = (interval_ms % 1000) * 1000000L;
+		timerfd_settime(tfd, 0, &its, NULL);
+
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.fd = s;
+		epoll_ctl(ep, EPOLL_CTL_ADD, s, &ev);
+		ev.data.fd = tfd;
+		epoll_ctl(ep, EPOLL_CTL_ADD, tfd, &ev);
+		ev.data.fd = sfd;
+		epoll_ctl(ep, EPOLL_CTL_ADD, sfd, &ev);
+
+		while(1) {
+			n = epoll_wait(ep, events, 3, -1);
+			if (n < 0) {
+				if (errno != EINTR)
+					perror("arping: epoll_wait");
+				continue;
+			}
+			for (i = 0; i < n; i++) {
+				if (events[i].data.fd == tfd) {
+					uint64_t expired;
+
+					/* a late wakeup still sends only once */
+					if (read(tfd, &expired, sizeof(expired)) > 0)
+						tick();
+				} else if (events[i].data.fd == sfd) {
+					finish();
+				} else if (ring) {
+					read_ring();
+					fflush(stdout);
+				} else {
+					unsigned char packet[4096];
+					struct sockaddr_ll from;
+					socklen_t alen = sizeof(from);
+					struct timeval tv;
+					int cc;
+
+					while ((cc = recvfrom(s, packet, sizeof(packet), MSG_DONTWAIT,
+							      (struct sockaddr *)&from, &alen)) >= 0) {
+						gettimeofday(&tv, NULL);
+						recv_pack(packet, cc, &from, &tv);
+						alen = sizeof(from);
+					}
+					if (errno != EAGAIN && errno != EINTR)
+						perror("arping: recvfrom");
+					fflush(stdout);
+				}
+			}
+		}
 	}
 }
-
-
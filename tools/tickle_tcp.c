@@ -19,21 +19,57 @@
    along with this program; if not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <config.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
 #include <netinet/ip.h>
 #include <netinet/ip6.h>
 #include <netinet/tcp.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include <arpa/inet.h>
 #include <net/if.h>
-
-#define discard_const(ptr) ((void *)((intptr_t)(ptr)))
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+#include "inet_csum.h"
+#if defined(HAVE_LINUX_RTNETLINK_H) && defined(HAVE_LINUX_IF_PACKET_H)
+#define TICKLE_TX_RING
+#include <sys/ioctl.h>
+#include <net/ethernet.h>
+#include <net/if_arp.h>
+#include <linux/if_packet.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/neighbour.h>
+#include <linux/fib_rules.h>
+#include "nl_dump.h"
+#endif
+#if defined(HAVE_LINUX_INET_DIAG_H)
+#define TICKLE_CAPTURE
+#include <linux/netlink.h>
+#include <linux/sock_diag.h>
+#include <linux/inet_diag.h>
+#ifdef HAVE_LINUX_NETFILTER_NFNETLINK_CONNTRACK_H
+#define TICKLE_CONNTRACK
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/nfnetlink_conntrack.h>
+#include <linux/netfilter/nf_conntrack_tcp.h>
+#endif
+#endif
+#if defined(HAVE_LINUX_FILTER_H)
+#define TICKLE_VERIFY
+#include <linux/filter.h>
+#endif
 
 typedef union {
 	struct sockaddr     sa;
@@ -41,7 +77,138 @@ typedef union {
 	struct sockaddr_in6 ip6;
 } sock_addr;
 
-uint32_t uint16_checksum(uint16_t *data, size_t n);
+/*
+ * Tickles are built into a ring of preallocated packets, one ring per
+ * address family, and handed to the kernel TICKLE_BATCH at a time
+ * through one long-lived raw socket per family.
+ */
+#define TICKLE_BATCH	1024
+
+enum { TICKLE_V4, TICKLE_V6, TICKLE_NFAMILIES };
+
+struct tickle_pkt {
+	union {
+		struct {
+			struct iphdr ip;
+			struct tcphdr tcp;
+		} ip4;
+		struct {
+			struct ip6_hdr ip6;
+			struct tcphdr tcp;
+		} ip6;
+	} u;
+};
+
+struct tickle_queue {
+	int			fd;
+	int			count;
+	struct tickle_pkt	pkt[TICKLE_BATCH];
+	sock_addr		dst[TICKLE_BATCH];
+	struct iovec		iov[TICKLE_BATCH];
+#ifdef HAVE_SENDMMSG
+	struct mmsghdr		msg[TICKLE_BATCH];
+#endif
+};
+
+/*
+ * Senders keep their queues, templates, ring and counters in thread
+ * local storage, so each sender thread has its own sockets and never
+ * needs a lock on the packet path.
+ */
+struct tickle_stats {
+	unsigned long		sent;
+	unsigned long		failed;
+};
+
+static __thread struct tickle_stats tickle_stats;
+
+static __thread struct tickle_queue tickle_queues[TICKLE_NFAMILIES] = {
+	{ .fd = -1 }, { .fd = -1 }
+};
+
+/*
+ * Every tickle sent on behalf of one local VIP shares all header
+ * fields except the peer address, both ports, seq, ack and the RST
+ * bit.  The template holds a finished packet with those fields zeroed
+ * and its checksum; each tickle copies it and folds the sum of the
+ * real fields into the checksum (RFC 1624, eqn. 3 with m = 0), so no
+ * per-packet pass over the headers and pseudo-header is needed.
+ * Connection lists are grouped by VIP, so one template per family is
+ * enough.
+ */
+struct tickle_template {
+	int			valid;
+	sock_addr		vip;
+	struct tickle_pkt	pkt;
+};
+
+static __thread struct tickle_template tickle_templates[TICKLE_NFAMILIES];
+
+#ifdef TICKLE_TX_RING
+/*
+ * With -i the tickles bypass the IP output path: complete Ethernet
+ * frames are written into a PACKET_TX_RING shared with the kernel and
+ * the ring is kicked once per batch.  Next hops are resolved up front
+ * from one dump of the routes and of the neighbour table.  The route
+ * to a peer is picked as the kernel would: the local, main and default
+ * tables in the order of the stock rules, the longest prefix within a
+ * table and the lowest metric among equal prefixes.  Only a unicast
+ * route out of the -i interface whose next hop has a usable neighbour
+ * entry puts the peer on the ring.  Every other peer, including those
+ * behind blackhole, unreachable or prohibit routes, still goes through
+ * the raw sockets above, which lets the kernel route it.
+ *
+ * A host with any other routing rule (ip rule) gets no next hops at
+ * all, so that every tickle takes the raw socket path and the kernel
+ * applies its rules.
+ */
+#define TICKLE_RING_FRAMES	8192
+#define TICKLE_FRAME_SIZE	128
+#define TICKLE_FRAME_DATA	TPACKET_ALIGN(sizeof(struct tpacket2_hdr))
+
+struct ring_route {
+	int		family;
+	unsigned	table;		/* local, main or default */
+	int		type;		/* RTN_* */
+	int		oif;		/* 0: multipath */
+	unsigned	metric;
+	int		plen;
+	int		has_gw;
+	unsigned char	dst[16];
+	unsigned char	gw[16];
+};
+
+struct ring_neigh {
+	int		family;		/* 0: empty slot */
+	unsigned char	addr[16];
+	unsigned char	mac[ETH_ALEN];
+};
+
+/* Next hops of the -i interface, loaded once and shared by all senders */
+struct tickle_hops {
+	int			ifindex;
+	int			policy;		/* rules beyond the stock three */
+	struct ring_route	*routes;
+	int			nroutes;
+	struct ring_neigh	*neigh;
+	unsigned		neigh_size;	/* power of two */
+	unsigned		neigh_count;
+};
+
+struct tickle_ring {
+	int			fd;
+	unsigned char		mac[ETH_ALEN];
+	char			*map;
+	size_t			map_len;
+	unsigned		head;
+	unsigned		pending;
+	int			failed;
+};
+
+static struct tickle_hops tickle_hops;
+static __thread struct tickle_ring tickle_ring = { .fd = -1 };
+#endif
+
 void set_nonblocking(int fd);
 void set_close_on_exec(int fd);
 static int parse_ipv4(const char *s, unsigned port, struct sockaddr_in *sin);
@@ -51,64 +218,53 @@ int parse_ip_port(const char *addr, sock_addr *saddr);
 int send_tickle_ack(const sock_addr *dst, 
 		    const sock_addr *src, 
 		    uint32_t seq, uint32_t ack, int rst);
+int flush_tickle_acks(void);
+#ifdef TICKLE_TX_RING
+int load_tickle_hops(const char *iface);
+int open_tickle_ring(const char *iface);
+static int flush_tickle_ring(void);
+static void close_tickle_ring(void);
+#endif
 static void usage(void);
 
-uint32_t uint16_checksum(uint16_t *data, size_t n)
+static void build_tickle_template(struct tickle_template *t, int family,
+				  const sock_addr *vip)
 {
-	uint32_t sum=0;
-	while (n >= 2) {
-		sum += (uint32_t)ntohs(*data);
-		data++;        
-		n -= 2;
-	}                      
-	if (n == 1) {
-		sum += (uint32_t)ntohs(*(uint8_t *)data);
-	}
-	return sum;
-}       
-
-static uint16_t tcp_checksum(uint16_t *data, size_t n, struct iphdr *ip)
-{
-	uint32_t sum = uint16_checksum(data, n);
-	uint16_t sum2;
-	sum += uint16_checksum((uint16_t *)(void *)&ip->saddr,
-				sizeof(ip->saddr));
-	sum += uint16_checksum((uint16_t *)(void *)&ip->daddr,
-				sizeof(ip->daddr));
-	sum += ip->protocol + n;
-	sum = (sum & 0xFFFF) + (sum >> 16);
-	sum = (sum & 0xFFFF) + (sum >> 16);
-	sum2 = htons(sum);
-	sum2 = ~sum2;
-	if (sum2 == 0) {
-		return 0xFFFF;
-	}
-	return sum2;
-}
-
-static uint16_t tcp_checksum6(uint16_t *data, size_t n, struct ip6_hdr *ip6)
-{
-	uint32_t phdr[2];
-	uint32_t sum = 0;
-	uint16_t sum2;
-
-	sum += uint16_checksum((uint16_t *)(void *)&ip6->ip6_src, 16);
-	sum += uint16_checksum((uint16_t *)(void *)&ip6->ip6_dst, 16);
+	struct tickle_pkt *pkt = &t->pkt;
 
-	phdr[0] = htonl(n);
-	phdr[1] = htonl(ip6->ip6_nxt);
-	sum += uint16_checksum((uint16_t *)phdr, 8);
+	memset(pkt, 0, sizeof(*pkt));
+	if (family == TICKLE_V4) {
+		pkt->u.ip4.ip.version  = 4;
+		pkt->u.ip4.ip.ihl      = sizeof(pkt->u.ip4.ip)/4;
+		pkt->u.ip4.ip.tot_len  = htons(sizeof(pkt->u.ip4));
+		pkt->u.ip4.ip.ttl      = 255;
+		pkt->u.ip4.ip.protocol = IPPROTO_TCP;
+		pkt->u.ip4.ip.saddr    = vip->ip.sin_addr.s_addr;
+		/* raw sockets redo this, the TX ring sends it as is */
+		pkt->u.ip4.ip.check    = inet_csum(&pkt->u.ip4.ip, sizeof(pkt->u.ip4.ip));
 
-	sum += uint16_checksum(data, n);
+		pkt->u.ip4.tcp.ack     = 1;
+		pkt->u.ip4.tcp.doff    = sizeof(pkt->u.ip4.tcp)/4;
+		pkt->u.ip4.tcp.window  = htons(1234);
+		pkt->u.ip4.tcp.check   = inet_csum_pseudo(AF_INET,
+				&pkt->u.ip4.ip.saddr, &pkt->u.ip4.ip.daddr, IPPROTO_TCP,
+				&pkt->u.ip4.tcp, sizeof(pkt->u.ip4.tcp));
+	} else {
+		pkt->u.ip6.ip6.ip6_vfc  = 0x60;
+		pkt->u.ip6.ip6.ip6_plen = htons(20);
+		pkt->u.ip6.ip6.ip6_nxt  = IPPROTO_TCP;
+		pkt->u.ip6.ip6.ip6_hlim = 64;
+		pkt->u.ip6.ip6.ip6_src  = vip->ip6.sin6_addr;
 
-	sum = (sum & 0xFFFF) + (sum >> 16);
-	sum = (sum & 0xFFFF) + (sum >> 16);
-	sum2 = htons(sum);
-	sum2 = ~sum2;
-	if (sum2 == 0) {
-		return 0xFFFF;
+		pkt->u.ip6.tcp.ack      = 1;
+		pkt->u.ip6.tcp.doff     = sizeof(pkt->u.ip6.tcp)/4;
+		pkt->u.ip6.tcp.window   = htons(1234);
+		pkt->u.ip6.tcp.check    = inet_csum_pseudo(AF_INET6,
+				&pkt->u.ip6.ip6.ip6_src, &pkt->u.ip6.ip6.ip6_dst, IPPROTO_TCP,
+				&pkt->u.ip6.tcp, sizeof(pkt->u.ip6.tcp));
 	}
-	return sum2;
+	t->vip = *vip;
+	t->valid = 1;
 }
 
 void set_nonblocking(int fd)
@@ -173,207 +329,2469 @@ int parse_ip(const char *addr, const char *iface, unsigned port, sock_addr *sadd
 
 int parse_ip_port(const char *addr, sock_addr *saddr)
 {
-	char *s, *p;
+	char s[128], *p;
 	unsigned port;
 	char *endp = NULL;
-	int ret;
 
-	s = strdup(addr);
-	if (!s) {
-		fprintf(stderr, "Failed strdup()\n");
+	if (strlen(addr) >= sizeof(s)) {
+		fprintf(stderr, "This addr: %s is too long\n", addr);
 		return -1;
 	}
+	strcpy(s, addr);
 
 	p = rindex(s, ':');
 	if (!p) {
 		fprintf(stderr, "This addr: %s does not contain a port number\n", s);
-		free(s);
 		return -1;
 	}
 	
 	port = strtoul(p+1, &endp, 10);
 	if (!endp || *endp != 0) {
 		fprintf(stderr, "Trailing garbage after the port in %s\n", s);
-		free(s);
 		return -1;
 	}
 	*p = 0;
 
-	ret = parse_ip(s, NULL, port, saddr);
-	free(s);
-	return ret;
+	return parse_ip(s, NULL, port, saddr);
 }
 
-int send_tickle_ack(const sock_addr *dst, 
-		    const sock_addr *src, 
-		    uint32_t seq, uint32_t ack, int rst)
+static int open_tickle_socket(int family)
 {
-	int s;
-	int ret;
 	uint32_t one = 1;
-	uint16_t tmpport;
-	sock_addr *tmpdest;
-	struct {
-		struct iphdr ip;
-		struct tcphdr tcp;
-	} ip4pkt;
-	struct {
-		struct ip6_hdr ip6;
-		struct tcphdr tcp;
-	} ip6pkt;
+	int s;
 
-	switch (src->ip.sin_family) {
-	case AF_INET:
-		memset(&ip4pkt, 0, sizeof(ip4pkt));
-		ip4pkt.ip.version  = 4;
-		ip4pkt.ip.ihl      = sizeof(ip4pkt.ip)/4;
-		ip4pkt.ip.tot_len  = htons(sizeof(ip4pkt));
-		ip4pkt.ip.ttl      = 255;
-		ip4pkt.ip.protocol = IPPROTO_TCP;
-		ip4pkt.ip.saddr    = src->ip.sin_addr.s_addr;
-		ip4pkt.ip.daddr    = dst->ip.sin_addr.s_addr;
-		ip4pkt.ip.check    = 0;
-
-		ip4pkt.tcp.source  = src->ip.sin_port;
-		ip4pkt.tcp.dest    = dst->ip.sin_port;
-		ip4pkt.tcp.seq     = seq;
-		ip4pkt.tcp.ack_seq = ack;
-		ip4pkt.tcp.ack     = 1;
-		if (rst)
-			ip4pkt.tcp.rst = 1;
-		ip4pkt.tcp.doff    = sizeof(ip4pkt.tcp)/4;
-		ip4pkt.tcp.window   = htons(1234);
-		ip4pkt.tcp.check    = tcp_checksum((uint16_t *)&ip4pkt.tcp, sizeof(ip4pkt.tcp), &ip4pkt.ip);
-
-		s = socket(AF_INET, SOCK_RAW, htons(IPPROTO_RAW));
+	if (family == TICKLE_V4) {
+		s = socket(AF_INET, SOCK_RAW, IPPROTO_RAW);
 		if (s == -1) {
 			fprintf(stderr, "Failed to open raw socket (%s)\n", strerror(errno));
 			return -1;
 		}
-
-		ret = setsockopt(s, SOL_IP, IP_HDRINCL, &one, sizeof(one));
-		if (ret != 0) {
+		if (setsockopt(s, SOL_IP, IP_HDRINCL, &one, sizeof(one)) != 0) {
 			fprintf(stderr, "Failed to setup IP headers (%s)\n", strerror(errno));
 			close(s);
 			return -1;
 		}
-
-		set_nonblocking(s);
-		set_close_on_exec(s);
-
-		ret = sendto(s, &ip4pkt, sizeof(ip4pkt), 0, 
-			     (const struct sockaddr *)&dst->ip, sizeof(dst->ip));
-		close(s);
-		if (ret != sizeof(ip4pkt)) {
-			fprintf(stderr, "Failed sendto (%s)\n", strerror(errno));
-			return -1;
-		}
-		break;
-
-        case AF_INET6:
-		memset(&ip6pkt, 0, sizeof(ip6pkt));
-		ip6pkt.ip6.ip6_vfc  = 0x60;
-		ip6pkt.ip6.ip6_plen = htons(20);
-		ip6pkt.ip6.ip6_nxt  = IPPROTO_TCP;
-		ip6pkt.ip6.ip6_hlim = 64;
-		ip6pkt.ip6.ip6_src  = src->ip6.sin6_addr;
-		ip6pkt.ip6.ip6_dst  = dst->ip6.sin6_addr;
-
-		ip6pkt.tcp.source   = src->ip6.sin6_port;
-		ip6pkt.tcp.dest     = dst->ip6.sin6_port;
-		ip6pkt.tcp.seq      = seq;
-		ip6pkt.tcp.ack_seq  = ack;
-		ip6pkt.tcp.ack      = 1;
-		if (rst)
-			ip6pkt.tcp.rst      = 1;
-		ip6pkt.tcp.doff     = sizeof(ip6pkt.tcp)/4;
-		ip6pkt.tcp.window   = htons(1234);
-		ip6pkt.tcp.check    = tcp_checksum6((uint16_t *)&ip6pkt.tcp, sizeof(ip6pkt.tcp), &ip6pkt.ip6);
-
+	} else {
 		s = socket(PF_INET6, SOCK_RAW, IPPROTO_RAW);
 		if (s == -1) {
 			fprintf(stderr, "Failed to open sending socket\n");
 			return -1;
-                }
+		}
+	}
 
-		tmpdest = discard_const(dst);
-		tmpport = tmpdest->ip6.sin6_port;
+	set_nonblocking(s);
+	set_close_on_exec(s);
+	return s;
+}
 
-		tmpdest->ip6.sin6_port = 0;
-		ret = sendto(s, &ip6pkt, sizeof(ip6pkt), 0, (const struct sockaddr *)&dst->ip6, sizeof(dst->ip6));
-		tmpdest->ip6.sin6_port = tmpport;
-		close(s);
+/* Wait until a nonblocking raw socket can take more packets */
+static void wait_writable(int fd)
+{
+	struct pollfd pfd;
 
-		if (ret != sizeof(ip6pkt)) {
-			fprintf(stderr, "Failed sendto (%s)\n", strerror(errno));
-			return -1;
+	pfd.fd = fd;
+	pfd.events = POLLOUT;
+	poll(&pfd, 1, 100);
+}
+
+/*
+ * Hand every queued packet of one family to the kernel.
+ * Returns the number of packets which could not be sent.
+ */
+static int flush_tickle_queue(struct tickle_queue *q)
+{
+	int done = 0, failed = 0;
+	int ret;
+
+	while (done < q->count) {
+#ifdef HAVE_SENDMMSG
+		ret = sendmmsg(q->fd, &q->msg[done], q->count - done, 0);
+#else
+		ret = sendto(q->fd, q->iov[done].iov_base, q->iov[done].iov_len, 0,
+			     &q->dst[done].sa, q->dst[done].sa.sa_family == AF_INET ?
+			     sizeof(q->dst[done].ip) : sizeof(q->dst[done].ip6));
+		if (ret >= 0)
+			ret = 1;
+#endif
+		if (ret > 0) {
+			done += ret;
+			continue;
 		}
-		break;
+		if (errno == EINTR)
+			continue;
+		if (errno == EAGAIN || errno == ENOBUFS) {
+			wait_writable(q->fd);
+			continue;
+		}
+		/* The packet at 'done' was refused, carry on after it */
+		fprintf(stderr, "Failed sendto (%s)\n", strerror(errno));
+		failed++;
+		done++;
+	}
+	tickle_stats.sent += q->count - failed;
+	tickle_stats.failed += failed;
+	q->count = 0;
+	return failed;
+}
 
-	default:
-		fprintf(stderr, "Not an ipv4/v6 address\n");
-		return -1;
+/*
+ * Point every slot of a queue at its packet and destination once, so
+ * queueing a tickle only has to fill in the packet itself.
+ */
+static void init_tickle_queue(struct tickle_queue *q, int family)
+{
+	size_t len;
+	int n;
+
+	len = family == TICKLE_V4 ? sizeof(q->pkt[0].u.ip4) : sizeof(q->pkt[0].u.ip6);
+	for (n = 0; n < TICKLE_BATCH; n++) {
+		q->iov[n].iov_base = &q->pkt[n];
+		q->iov[n].iov_len  = len;
+#ifdef HAVE_SENDMMSG
+		memset(&q->msg[n], 0, sizeof(q->msg[n]));
+		q->msg[n].msg_hdr.msg_name    = &q->dst[n];
+		q->msg[n].msg_hdr.msg_namelen = family == TICKLE_V4 ?
+			sizeof(q->dst[n].ip) : sizeof(q->dst[n].ip6);
+		q->msg[n].msg_hdr.msg_iov     = &q->iov[n];
+		q->msg[n].msg_hdr.msg_iovlen  = 1;
+#endif
 	}
+}
 
-	return 0;
+int flush_tickle_acks(void)
+{
+	int i, failed = 0;
+
+	for (i = 0; i < TICKLE_NFAMILIES; i++) {
+		if (tickle_queues[i].count)
+			failed += flush_tickle_queue(&tickle_queues[i]);
+	}
+#ifdef TICKLE_TX_RING
+	if (tickle_ring.fd != -1 && flush_tickle_ring())
+		failed++;
+#endif
+	return failed ? -1 : 0;
 }
 
-static void usage(void)
+/* Close the sockets of this thread, the next tickle reopens them */
+static void close_tickle_sockets(void)
 {
-	printf("Usage: /usr/lib/heartbeat/tickle_tcp [ -n num ]\n");
-	printf("Please note that this program need to read the list of\n");
-	printf("{local_ip:port remote_ip:port} from stdin.\n");
-	exit(1);
+	int i;
+
+	for (i = 0; i < TICKLE_NFAMILIES; i++) {
+		if (tickle_queues[i].fd != -1) {
+			close(tickle_queues[i].fd);
+			tickle_queues[i].fd = -1;
+		}
+	}
+#ifdef TICKLE_TX_RING
+	if (tickle_ring.fd != -1)
+		close_tickle_ring();
+#endif
 }
 
-#define OPTION_STRING "n:h"
+/*
+ * Fill in one tickle from the family's template, which must be built
+ * for src.  Only the fields that differ from the template are written.
+ */
+static void fill_tickle(struct tickle_pkt *pkt, int family,
+			const sock_addr *dst, const sock_addr *src,
+			uint32_t seq, uint32_t ack, int rst)
+{
+	struct tcphdr *tcp;
+	uint32_t sum;
+	uint16_t old_flags, flags;
+	int i;
+
+	*pkt = tickle_templates[family].pkt;
 
-int main(int argc, char *argv[])
+	if (family == TICKLE_V4) {
+		pkt->u.ip4.ip.daddr    = dst->ip.sin_addr.s_addr;
+		pkt->u.ip4.tcp.source  = src->ip.sin_port;
+		pkt->u.ip4.tcp.dest    = dst->ip.sin_port;
+		pkt->u.ip4.tcp.seq     = seq;
+		pkt->u.ip4.tcp.ack_seq = ack;
+		tcp = &pkt->u.ip4.tcp;
+
+		sum = inet_csum_add32(0, dst->ip.sin_addr.s_addr);
+		pkt->u.ip4.ip.check = inet_csum_update(pkt->u.ip4.ip.check, sum);
+	} else {
+		pkt->u.ip6.ip6.ip6_dst  = dst->ip6.sin6_addr;
+		pkt->u.ip6.tcp.source   = src->ip6.sin6_port;
+		pkt->u.ip6.tcp.dest     = dst->ip6.sin6_port;
+		pkt->u.ip6.tcp.seq      = seq;
+		pkt->u.ip6.tcp.ack_seq  = ack;
+		tcp = &pkt->u.ip6.tcp;
+
+		sum = 0;
+		for (i = 0; i < 4; i++)
+			sum = inet_csum_add32(sum, dst->ip6.sin6_addr.s6_addr32[i]);
+	}
+
+	sum += tcp->source + tcp->dest;
+	sum = inet_csum_add32(sum, seq);
+	sum = inet_csum_add32(sum, ack);
+	if (rst) {
+		/* RST shares a 16 bit word with doff and ACK; add just its bit */
+		memcpy(&old_flags, (char *)tcp + 12, sizeof(old_flags));
+		tcp->rst = 1;
+		memcpy(&flags, (char *)tcp + 12, sizeof(flags));
+		sum += (uint16_t)(flags - old_flags);
+	}
+	tcp->check = inet_csum_update(tcp->check, sum);
+}
+
+#ifdef TICKLE_TX_RING
+static int addr_len(int family)
 {
-	int optchar, i, num = 1, cont = 1;
-	sock_addr src, dst;
-	char addrline[128], addr1[64], addr2[64];
+	return family == AF_INET ? 4 : 16;
+}
 
-	while(cont) {
-		optchar = getopt(argc, argv, OPTION_STRING);
-		switch(optchar) {
-		case 'n':
-			num = atoi(optarg);
+static int ring_add_route(struct nlmsghdr *nh, void *arg)
+{
+	struct rtmsg *rtm = NLMSG_DATA(nh);
+	struct rtattr *rta = RTM_RTA(rtm);
+	int len = RTM_PAYLOAD(nh);
+	struct ring_route r, *routes;
+	unsigned table = rtm->rtm_table;
+
+	if (nh->nlmsg_type != RTM_NEWROUTE)
+		return 0;
+	switch (rtm->rtm_type) {
+	case RTN_UNICAST:
+	case RTN_LOCAL:
+	case RTN_BLACKHOLE:
+	case RTN_UNREACHABLE:
+	case RTN_PROHIBIT:
+		break;
+	default:
+		return 0;
+	}
+
+	memset(&r, 0, sizeof(r));
+	r.family = rtm->rtm_family;
+	r.type = rtm->rtm_type;
+	r.plen = rtm->rtm_dst_len;
+	for (; RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+		switch (rta->rta_type) {
+		case RTA_TABLE:
+			table = *(unsigned *)RTA_DATA(rta);
 			break;
-		case 'h':
-			usage();
-			exit(EXIT_SUCCESS);
+		case RTA_OIF:
+			r.oif = *(int *)RTA_DATA(rta);
 			break;
-		case EOF:
-			cont = 0;
+		case RTA_PRIORITY:
+			r.metric = *(unsigned *)RTA_DATA(rta);
 			break;
-		default:
-			fprintf(stderr, "unknown option, please use '-h' for usage.\n");
-			exit(EXIT_FAILURE);
+		case RTA_DST:
+			memcpy(r.dst, RTA_DATA(rta), addr_len(r.family));
 			break;
-		};
+		case RTA_GATEWAY:
+			memcpy(r.gw, RTA_DATA(rta), addr_len(r.family));
+			r.has_gw = 1;
+			break;
+		}
 	}
+	if (table != RT_TABLE_LOCAL && table != RT_TABLE_MAIN
+	    && table != RT_TABLE_DEFAULT)
+		return 0;
+	r.table = table;
+
+	routes = realloc(tickle_hops.routes,
+			 (tickle_hops.nroutes + 1) * sizeof(*routes));
+	if (!routes)
+		return -1;
+	routes[tickle_hops.nroutes++] = r;
+	tickle_hops.routes = routes;
+	return 0;
+}
+
+static unsigned neigh_hash(int family, const unsigned char *addr)
+{
+	unsigned h = 2166136261u;
+	int i;
+
+	for (i = 0; i < addr_len(family); i++)
+		h = (h ^ addr[i]) * 16777619u;
+	return h;
+}
+
+static struct ring_neigh *neigh_slot(struct ring_neigh *tab, unsigned size,
+				     int family, const unsigned char *addr)
+{
+	unsigned i = neigh_hash(family, addr) & (size - 1);
+
+	while (tab[i].family && (tab[i].family != family ||
+	       memcmp(tab[i].addr, addr, addr_len(family))))
+		i = (i + 1) & (size - 1);
+	return &tab[i];
+}
+
+static int ring_add_neigh(struct nlmsghdr *nh, void *arg)
+{
+	struct ndmsg *ndm = NLMSG_DATA(nh);
+	struct rtattr *rta = (struct rtattr *)((char *)ndm + NLMSG_ALIGN(sizeof(*ndm)));
+	int len = nh->nlmsg_len - NLMSG_LENGTH(sizeof(*ndm));
+	const unsigned char *dst = NULL, *lladdr = NULL;
+	struct ring_neigh *tab, *slot;
+	unsigned i, size;
 
-	while(fgets(addrline, sizeof(addrline), stdin)) {
-		sscanf(addrline, "%s %s", addr1, addr2);
+	if (nh->nlmsg_type != RTM_NEWNEIGH || ndm->ndm_ifindex != tickle_hops.ifindex
+	    || (ndm->ndm_state & (NUD_INCOMPLETE | NUD_FAILED | NUD_NOARP)))
+		return 0;
+	for (; RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+		if (rta->rta_type == NDA_DST)
+			dst = RTA_DATA(rta);
+		else if (rta->rta_type == NDA_LLADDR && RTA_PAYLOAD(rta) == ETH_ALEN)
+			lladdr = RTA_DATA(rta);
+	}
+	if (!dst || !lladdr)
+		return 0;
 
-		if (parse_ip_port(addr1, &src)) {
-			fprintf(stderr, "Bad IP:port '%s'\n", addr1);
+	/* keep the open addressed table at most half full */
+	if (2 * (tickle_hops.neigh_count + 1) > tickle_hops.neigh_size) {
+		size = tickle_hops.neigh_size ? 2 * tickle_hops.neigh_size : 256;
+		tab = calloc(size, sizeof(*tab));
+		if (!tab)
 			return -1;
+		for (i = 0; i < tickle_hops.neigh_size; i++) {
+			if (tickle_hops.neigh[i].family)
+				*neigh_slot(tab, size, tickle_hops.neigh[i].family,
+					    tickle_hops.neigh[i].addr) = tickle_hops.neigh[i];
+		}
+		free(tickle_hops.neigh);
+		tickle_hops.neigh = tab;
+		tickle_hops.neigh_size = size;
+	}
+	slot = neigh_slot(tickle_hops.neigh, tickle_hops.neigh_size,
+			  ndm->ndm_family, dst);
+	if (!slot->family)
+		tickle_hops.neigh_count++;
+	slot->family = ndm->ndm_family;
+	memcpy(slot->addr, dst, addr_len(ndm->ndm_family));
+	memcpy(slot->mac, lladdr, ETH_ALEN);
+	return 0;
+}
+
+static int prefix_match(const unsigned char *a, const unsigned char *b, int plen)
+{
+	int bytes = plen / 8, bits = plen % 8;
+
+	if (memcmp(a, b, bytes))
+		return 0;
+	return !bits || !((a[bytes] ^ b[bytes]) & (0xFF00 >> bits));
+}
+
+/* Note a rule that sends lookups anywhere but local, main or default */
+static int ring_add_rule(struct nlmsghdr *nh, void *arg)
+{
+	struct fib_rule_hdr *frh = NLMSG_DATA(nh);
+	struct rtattr *rta = (struct rtattr *)((char *)frh + NLMSG_ALIGN(sizeof(*frh)));
+	int len = nh->nlmsg_len - NLMSG_LENGTH(sizeof(*frh));
+	unsigned table = frh->table;
+
+	if (nh->nlmsg_type != RTM_NEWRULE)
+		return 0;
+	for (; RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+		if (rta->rta_type == FRA_TABLE)
+			table = *(unsigned *)RTA_DATA(rta);
+	}
+	if (frh->action != FR_ACT_TO_TBL || (table != RT_TABLE_LOCAL
+	    && table != RT_TABLE_MAIN && table != RT_TABLE_DEFAULT))
+		tickle_hops.policy = 1;
+	return 0;
+}
+
+/*
+ * Find the MAC of the next hop towards addr, NULL if the peer is not
+ * reached through the ring interface or its next hop is not known.
+ */
+static const unsigned char *ring_next_hop(int family, const unsigned char *addr)
+{
+	static const unsigned tables[] = {
+		RT_TABLE_LOCAL, RT_TABLE_MAIN, RT_TABLE_DEFAULT
+	};
+	const struct ring_route *r, *best = NULL;
+	const unsigned char *nh;
+	struct ring_neigh *slot;
+	int i, t;
+
+	for (t = 0; !best && t < (int)(sizeof(tables) / sizeof(tables[0])); t++) {
+		for (i = 0; i < tickle_hops.nroutes; i++) {
+			r = &tickle_hops.routes[i];
+			if (r->table != tables[t] || r->family != family
+			    || !prefix_match(r->dst, addr, r->plen))
+				continue;
+			if (!best || r->plen > best->plen
+			    || (r->plen == best->plen && r->metric < best->metric))
+				best = r;
 		}
-		if (parse_ip_port(addr2, &dst)) {
-			fprintf(stderr, "Bad IP:port '%s'\n", addr2);
+	}
+	/* multipath routes carry no RTA_OIF and are left to the kernel too */
+	if (!best || best->type != RTN_UNICAST || best->oif != tickle_hops.ifindex
+	    || !tickle_hops.neigh_size)
+		return NULL;
+	nh = best->has_gw ? best->gw : addr;
+	slot = neigh_slot(tickle_hops.neigh, tickle_hops.neigh_size, family, nh);
+	return slot->family ? slot->mac : NULL;
+}
+
+/*
+ * Load the routes, and the neighbours of iface, for the TX ring senders.
+ */
+int load_tickle_hops(const char *iface)
+{
+	int nl;
+
+	tickle_hops.ifindex = if_nametoindex(iface);
+	if (!tickle_hops.ifindex) {
+		fprintf(stderr, "Unknown interface %s\n", iface);
+		return -1;
+	}
+
+	nl = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+	if (nl == -1) {
+		fprintf(stderr, "Failed to open netlink socket (%s)\n", strerror(errno));
+		return -1;
+	}
+	if (nl_dump(nl, RTM_GETRULE, AF_INET, ring_add_rule, NULL)
+	    || nl_dump(nl, RTM_GETRULE, AF_INET6, ring_add_rule, NULL)) {
+		fprintf(stderr, "Failed to read routing rules\n");
+		close(nl);
+		return -1;
+	}
+	if (tickle_hops.policy) {
+		fprintf(stderr, "Routing rules in use: tickles go out through "
+			"the kernel, not the ring on %s\n", iface);
+		close(nl);
+		return 0;
+	}
+	if (nl_dump(nl, RTM_GETROUTE, AF_INET, ring_add_route, NULL)
+	    || nl_dump(nl, RTM_GETROUTE, AF_INET6, ring_add_route, NULL)
+	    || nl_dump(nl, RTM_GETNEIGH, AF_UNSPEC, ring_add_neigh, NULL)) {
+		fprintf(stderr, "Failed to read routes and neighbours of %s\n", iface);
+		close(nl);
+		return -1;
+	}
+	close(nl);
+	return 0;
+}
+
+/*
+ * Set up a TX ring on iface for the calling sender thread.
+ * load_tickle_hops() must have been called for the same iface.
+ */
+int open_tickle_ring(const char *iface)
+{
+	struct tpacket_req req;
+	struct sockaddr_ll sll;
+	struct ifreq ifr;
+	int version = TPACKET_V2;
+	int fd;
+
+	/* protocol 0: this socket only sends */
+	fd = socket(AF_PACKET, SOCK_RAW, 0);
+	if (fd == -1) {
+		fprintf(stderr, "Failed to open packet socket (%s)\n", strerror(errno));
+		return -1;
+	}
+	set_close_on_exec(fd);
+
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, iface, sizeof(ifr.ifr_name) - 1);
+	if (ioctl(fd, SIOCGIFHWADDR, &ifr) == -1
+	    || ifr.ifr_hwaddr.sa_family != ARPHRD_ETHER) {
+		fprintf(stderr, "%s is not an Ethernet interface\n", iface);
+		goto fail;
+	}
+	memcpy(tickle_ring.mac, ifr.ifr_hwaddr.sa_data, ETH_ALEN);
+
+	memset(&req, 0, sizeof(req));
+	req.tp_block_size = getpagesize();
+	req.tp_frame_size = TICKLE_FRAME_SIZE;
+	req.tp_frame_nr   = TICKLE_RING_FRAMES;
+	req.tp_block_nr   = TICKLE_RING_FRAMES / (req.tp_block_size / TICKLE_FRAME_SIZE);
+	if (setsockopt(fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version))
+	    || setsockopt(fd, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req))) {
+		fprintf(stderr, "Failed to set up TX ring (%s)\n", strerror(errno));
+		goto fail;
+	}
+	tickle_ring.map_len = (size_t)req.tp_block_nr * req.tp_block_size;
+	tickle_ring.map = mmap(NULL, tickle_ring.map_len, PROT_READ | PROT_WRITE,
+			       MAP_SHARED, fd, 0);
+	if (tickle_ring.map == MAP_FAILED) {
+		fprintf(stderr, "Failed to map TX ring (%s)\n", strerror(errno));
+		goto fail;
+	}
+
+	memset(&sll, 0, sizeof(sll));
+	sll.sll_family  = AF_PACKET;
+	sll.sll_ifindex = tickle_hops.ifindex;
+	if (bind(fd, (struct sockaddr *)&sll, sizeof(sll)) == -1) {
+		fprintf(stderr, "Failed to bind to %s (%s)\n", iface, strerror(errno));
+		munmap(tickle_ring.map, tickle_ring.map_len);
+		goto fail;
+	}
+
+	tickle_ring.fd = fd;
+	return 0;
+fail:
+	close(fd);
+	return -1;
+}
+
+/* Where the Ethernet frame of slot i goes, after its tpacket2_hdr */
+static char *ring_frame_data(unsigned i)
+{
+	return tickle_ring.map + (size_t)i * TICKLE_FRAME_SIZE + TICKLE_FRAME_DATA;
+}
+
+static struct tpacket2_hdr *ring_frame(unsigned i)
+{
+	return (struct tpacket2_hdr *)(tickle_ring.map + (size_t)i * TICKLE_FRAME_SIZE);
+}
+
+/* Ask the kernel to send every frame marked for sending so far */
+static int kick_tickle_ring(int flags)
+{
+	while (send(tickle_ring.fd, NULL, 0, flags) == -1) {
+		if (errno == EINTR)
+			continue;
+		if (errno == EAGAIN || errno == ENOBUFS)
+			return 0;
+		fprintf(stderr, "Failed to send TX ring (%s)\n", strerror(errno));
+		return -1;
+	}
+	tickle_ring.pending = 0;
+	return 0;
+}
+
+static void reclaim_frame(volatile struct tpacket2_hdr *hdr)
+{
+	if (hdr->tp_status == TP_STATUS_WRONG_FORMAT) {
+		tickle_ring.failed++;
+		tickle_stats.sent--;
+		tickle_stats.failed++;
+		hdr->tp_status = TP_STATUS_AVAILABLE;
+	}
+}
+
+/*
+ * Put one tickle into the TX ring.  Returns 1 if the next hop is not
+ * known and the caller has to send the tickle some other way.
+ */
+static int ring_tickle(int family, const sock_addr *dst, const sock_addr *src,
+		       uint32_t seq, uint32_t ack, int rst)
+{
+	volatile struct tpacket2_hdr *hdr;
+	const unsigned char *mac;
+	struct ether_header eth;
+	struct tickle_pkt pkt;
+	size_t len;
+	char *data;
+
+	if (family == TICKLE_V4)
+		mac = ring_next_hop(AF_INET, (const unsigned char *)&dst->ip.sin_addr);
+	else
+		mac = ring_next_hop(AF_INET6, dst->ip6.sin6_addr.s6_addr);
+	if (!mac)
+		return 1;
+
+	hdr = ring_frame(tickle_ring.head);
+	reclaim_frame(hdr);
+	while (hdr->tp_status != TP_STATUS_AVAILABLE) {
+		/* ring full: make sure the kernel is draining it */
+		if (kick_tickle_ring(MSG_DONTWAIT))
 			return -1;
+		wait_writable(tickle_ring.fd);
+		reclaim_frame(hdr);
+	}
+
+	memcpy(eth.ether_dhost, mac, ETH_ALEN);
+	memcpy(eth.ether_shost, tickle_ring.mac, ETH_ALEN);
+	eth.ether_type = htons(family == TICKLE_V4 ? ETHERTYPE_IP : ETHERTYPE_IPV6);
+	fill_tickle(&pkt, family, dst, src, seq, ack, rst);
+	len = family == TICKLE_V4 ? sizeof(pkt.u.ip4) : sizeof(pkt.u.ip6);
+
+	data = ring_frame_data(tickle_ring.head);
+	memcpy(data, &eth, sizeof(eth));
+	memcpy(data + sizeof(eth), &pkt, len);
+	hdr->tp_len = sizeof(eth) + len;
+	__sync_synchronize();
+	hdr->tp_status = TP_STATUS_SEND_REQUEST;
+	tickle_stats.sent++;
+
+	tickle_ring.head = (tickle_ring.head + 1) % TICKLE_RING_FRAMES;
+	/* a failed kick leaves the frames queued for flush_tickle_ring() */
+	if (++tickle_ring.pending >= TICKLE_BATCH)
+		kick_tickle_ring(MSG_DONTWAIT);
+	return 0;
+}
+
+/*
+ * Send what is left in the ring and wait for the kernel to finish.
+ * Returns -1 if any frame could not be sent.
+ */
+static int flush_tickle_ring(void)
+{
+	volatile struct tpacket2_hdr *hdr;
+	unsigned i;
+	int broken;
+
+	broken = kick_tickle_ring(0);
+	for (i = 0; i < TICKLE_RING_FRAMES; i++) {
+		hdr = ring_frame(i);
+		while (!broken && (hdr->tp_status &
+				   (TP_STATUS_SEND_REQUEST | TP_STATUS_SENDING))) {
+			wait_writable(tickle_ring.fd);
+			broken = kick_tickle_ring(0);
 		}
-	
-		for (i = 1; i <= num; i++) {
-			if (send_tickle_ack(&dst, &src, 0, 0, 0)) {
-				fprintf(stderr, "Error while sending tickle ack from '%s' to '%s'\n",
-					addr1, addr2);
-				return -1;
-			}
+		reclaim_frame(hdr);
+		if (hdr->tp_status != TP_STATUS_AVAILABLE) {
+			/* the kick failed, this one never went out */
+			hdr->tp_status = TP_STATUS_WRONG_FORMAT;
+			reclaim_frame(hdr);
 		}
+	}
+	if (tickle_ring.failed) {
+		fprintf(stderr, "TX ring refused %d frames\n", tickle_ring.failed);
+		tickle_ring.failed = 0;
+		return -1;
+	}
+	return 0;
+}
+
+static void close_tickle_ring(void)
+{
+	munmap(tickle_ring.map, tickle_ring.map_len);
+	close(tickle_ring.fd);
+	tickle_ring.fd = -1;
+}
+#endif
+
+/*
+ * Queue one tickle ACK (or RST) from src to dst.  The packet goes out
+ * when its queue fills up or on flush_tickle_acks().  Returns -1 if
+ * the tickle could not be queued; packets that fail later on are
+ * counted in tickle_stats.
+ */
+int send_tickle_ack(const sock_addr *dst, 
+		    const sock_addr *src, 
+		    uint32_t seq, uint32_t ack, int rst)
+{
+	struct tickle_template *t;
+	struct tickle_queue *q;
+	int family, n;
+
+	switch (src->ip.sin_family) {
+	case AF_INET:
+		family = TICKLE_V4;
+		break;
+	case AF_INET6:
+		family = TICKLE_V6;
+		break;
+	default:
+		fprintf(stderr, "Not an ipv4/v6 address\n");
+		return -1;
+	}
+
+	t = &tickle_templates[family];
+	if (!t->valid || (family == TICKLE_V4 ?
+	    t->vip.ip.sin_addr.s_addr != src->ip.sin_addr.s_addr :
+	    !IN6_ARE_ADDR_EQUAL(&t->vip.ip6.sin6_addr, &src->ip6.sin6_addr)))
+		build_tickle_template(t, family, src);
+
+#ifdef TICKLE_TX_RING
+	if (tickle_ring.fd != -1) {
+		n = ring_tickle(family, dst, src, seq, ack, rst);
+		if (n <= 0)
+			return n;
+		/* no next hop MAC known, let the kernel route this one */
+	}
+#endif
 
+	q = &tickle_queues[family];
+	if (q->fd == -1) {
+		if ((q->fd = open_tickle_socket(family)) == -1)
+			return -1;
+		init_tickle_queue(q, family);
+	}
+	/* failures within the batch are counted in tickle_stats */
+	if (q->count == TICKLE_BATCH)
+		flush_tickle_queue(q);
+
+	n = q->count;
+	fill_tickle(&q->pkt[n], family, dst, src, seq, ack, rst);
+	if (family == TICKLE_V4) {
+		q->dst[n].ip = dst->ip;
+	} else {
+		/* raw IPv6 sockets want the port zeroed */
+		q->dst[n].ip6 = dst->ip6;
+		q->dst[n].ip6.sin6_port = 0;
 	}
+	q->count++;
+
 	return 0;
 }
+
+/*
+ * The connection list is read up front and cut into one contiguous
+ * shard per sender thread, so each shard still sees the connections of
+ * one VIP in a row and keeps reusing its template.  Every sender paces
+ * itself with a token bucket holding its share of the total rate.
+ */
+struct tickle_conn {
+	sock_addr	src;
+	sock_addr	dst;
+};
+
+struct tickle_bucket {
+	double		rate;		/* tokens per second, 0: unlimited */
+	double		burst;
+	double		tokens;
+	struct timespec	last;
+};
+
+struct tickle_worker {
+	pthread_t			thread;
+	int				started;
+	int				cpu;		/* -1: not pinned */
+	const char			*iface;
+	const struct tickle_conn	*conns;
+	size_t				count;
+	int				num;
+	double				rate;
+	struct tickle_stats		stats;		/* summed over runs */
+	double				*sent;		/* --verify: send times */
+	const struct timespec		*epoch;
+	int				done;
+};
+
+static double elapsed_since(const struct timespec *t)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - t->tv_sec) + (now.tv_nsec - t->tv_nsec) / 1e9;
+}
+
+static void init_bucket(struct tickle_bucket *b, double rate)
+{
+	b->rate = rate;
+	/* never let more than 10ms worth of tickles out back to back */
+	b->burst = rate / 100 < 1 ? 1 : rate / 100;
+	b->tokens = b->burst;
+	clock_gettime(CLOCK_MONOTONIC, &b->last);
+}
+
+/* Take one token, sleeping until the bucket refills if it is empty */
+static void pace_tickle(struct tickle_bucket *b)
+{
+	struct timespec ts;
+	double wait;
+
+	if (b->rate <= 0)
+		return;
+	for (;;) {
+		b->tokens += elapsed_since(&b->last) * b->rate;
+		clock_gettime(CLOCK_MONOTONIC, &b->last);
+		if (b->tokens > b->burst)
+			b->tokens = b->burst;
+		if (b->tokens >= 1)
+			break;
+		/* what is queued now belongs to the previous burst */
+		flush_tickle_acks();
+		wait = (1 - b->tokens) / b->rate;
+		ts.tv_sec = wait;
+		ts.tv_nsec = (wait - ts.tv_sec) * 1e9;
+		nanosleep(&ts, NULL);
+	}
+	b->tokens -= 1;
+}
+
+static const char *format_addr(const sock_addr *addr, char *buf, size_t len)
+{
+	char ip[INET6_ADDRSTRLEN];
+
+	if (addr->sa.sa_family == AF_INET) {
+		inet_ntop(AF_INET, &addr->ip.sin_addr, ip, sizeof(ip));
+		snprintf(buf, len, "%s:%u", ip, ntohs(addr->ip.sin_port));
+	} else {
+		inet_ntop(AF_INET6, &addr->ip6.sin6_addr, ip, sizeof(ip));
+		snprintf(buf, len, "%s:%u", ip, ntohs(addr->ip6.sin6_port));
+	}
+	return buf;
+}
+
+static void *tickle_worker(void *arg)
+{
+	struct tickle_worker *w = arg;
+	struct tickle_bucket bucket;
+	char s1[64], s2[64];
+	cpu_set_t cpus;
+	size_t i;
+	int j;
+
+	if (w->cpu >= 0) {
+		CPU_ZERO(&cpus);
+		CPU_SET(w->cpu, &cpus);
+		pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+	}
+#ifdef TICKLE_TX_RING
+	if (w->iface && tickle_ring.fd == -1 && open_tickle_ring(w->iface))
+		fprintf(stderr, "Sending through the IP stack instead\n");
+#endif
+	init_bucket(&bucket, w->rate);
+	memset(&tickle_stats, 0, sizeof(tickle_stats));
+
+	for (i = 0; i < w->count; i++) {
+		if (w->sent)
+			w->sent[i] = elapsed_since(w->epoch);
+		for (j = 0; j < w->num; j++) {
+			pace_tickle(&bucket);
+			if (send_tickle_ack(&w->conns[i].dst, &w->conns[i].src, 0, 0, 0)) {
+				fprintf(stderr, "Error while sending tickle ack from '%s' to '%s'\n",
+					format_addr(&w->conns[i].src, s1, sizeof(s1)),
+					format_addr(&w->conns[i].dst, s2, sizeof(s2)));
+				tickle_stats.failed++;
+			}
+		}
+	}
+	if (flush_tickle_acks())
+		fprintf(stderr, "Error while sending tickle acks\n");
+	close_tickle_sockets();
+
+	w->stats.sent   += tickle_stats.sent;
+	w->stats.failed += tickle_stats.failed;
+	__atomic_store_n(&w->done, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+/* Cut conns into one contiguous shard per worker */
+static void shard_conns(struct tickle_worker *workers, int threads,
+			const struct tickle_conn *conns, size_t count, double *sent)
+{
+	size_t shard = (count + threads - 1) / threads, first;
+	int i;
+
+	for (i = 0, first = 0; i < threads; i++, first += shard) {
+		workers[i].conns = conns + (first < count ? first : count);
+		workers[i].count = first >= count ? 0 :
+				   count - first < shard ? count - first : shard;
+		workers[i].sent  = sent ? sent + (first < count ? first : count) : NULL;
+		workers[i].done  = 0;
+	}
+}
+
+/*
+ * Start the workers; a single one runs right here unless the caller
+ * has to keep going meanwhile.
+ */
+static void start_workers(struct tickle_worker *workers, int threads, int wait)
+{
+	int i;
+
+	if (threads == 1 && wait) {
+		tickle_worker(&workers[0]);
+		return;
+	}
+	for (i = 0; i < threads; i++) {
+		workers[i].started = !pthread_create(&workers[i].thread, NULL,
+						     tickle_worker, &workers[i]);
+		if (!workers[i].started) {
+			/* run this shard here instead */
+			workers[i].cpu = -1;
+			tickle_worker(&workers[i]);
+		}
+	}
+}
+
+static void join_workers(struct tickle_worker *workers, int threads)
+{
+	int i;
+
+	for (i = 0; i < threads; i++) {
+		if (workers[i].started)
+			pthread_join(workers[i].thread, NULL);
+		workers[i].started = 0;
+	}
+}
+
+/*
+ * A set of connections.  It applies journal lines to a state file on
+ * input and holds the live connections in --daemon mode.  Entries live
+ * in an array in insertion order, so output keeps the input order; an
+ * open addressed hash of array indices finds them.
+ */
+struct conn_set {
+	struct tickle_conn	*conns;
+	unsigned char		*live;
+	size_t			nconns;		/* used array entries */
+	size_t			conns_size;
+	size_t			*slot;		/* array index + 1, 0: empty */
+	size_t			size;		/* power of two */
+	size_t			count;		/* live connections */
+};
+
+static int addr_equal(const sock_addr *a, const sock_addr *b)
+{
+	if (a->sa.sa_family != b->sa.sa_family)
+		return 0;
+	if (a->sa.sa_family == AF_INET)
+		return a->ip.sin_addr.s_addr == b->ip.sin_addr.s_addr;
+	return IN6_ARE_ADDR_EQUAL(&a->ip6.sin6_addr, &b->ip6.sin6_addr);
+}
+
+static uint16_t addr_port(const sock_addr *a)
+{
+	return a->sa.sa_family == AF_INET ? a->ip.sin_port : a->ip6.sin6_port;
+}
+
+static int conn_equal(const struct tickle_conn *a, const struct tickle_conn *b)
+{
+	return addr_port(&a->src) == addr_port(&b->src)
+	    && addr_port(&a->dst) == addr_port(&b->dst)
+	    && addr_equal(&a->src, &b->src) && addr_equal(&a->dst, &b->dst);
+}
+
+static unsigned hash_addr(unsigned h, const sock_addr *a)
+{
+	const unsigned char *p;
+	int i, len;
+
+	if (a->sa.sa_family == AF_INET) {
+		p = (const unsigned char *)&a->ip.sin_addr;
+		len = 4;
+	} else {
+		p = a->ip6.sin6_addr.s6_addr;
+		len = 16;
+	}
+	for (i = 0; i < len; i++)
+		h = (h ^ p[i]) * 16777619u;
+	return (h ^ addr_port(a)) * 16777619u;
+}
+
+static size_t *conn_set_slot(const struct conn_set *set, const struct tickle_conn *c)
+{
+	size_t i = hash_addr(hash_addr(2166136261u, &c->src), &c->dst) & (set->size - 1);
+
+	while (set->slot[i] && !conn_equal(&set->conns[set->slot[i] - 1], c))
+		i = (i + 1) & (set->size - 1);
+	return &set->slot[i];
+}
+
+static int conn_set_grow(struct conn_set *set)
+{
+	size_t i, size = set->size ? 2 * set->size : 1024;
+	size_t *slot, *old = set->slot;
+
+	slot = calloc(size, sizeof(*slot));
+	if (!slot)
+		return -1;
+	set->slot = slot;
+	set->size = size;
+	for (i = 0; i < set->nconns; i++) {
+		if (set->live[i])
+			*conn_set_slot(set, &set->conns[i]) = i + 1;
+	}
+	free(old);
+	return 0;
+}
+
+static int conn_set_has(const struct conn_set *set, const struct tickle_conn *c)
+{
+	return set->count && *conn_set_slot(set, c);
+}
+
+/* Returns 1 if c was added, 0 if it was there already, -1 on ENOMEM */
+static int conn_set_add(struct conn_set *set, const struct tickle_conn *c)
+{
+	struct tickle_conn *conns;
+	unsigned char *live;
+	size_t *slot, size;
+
+	if (2 * (set->count + 1) > set->size && conn_set_grow(set))
+		return -1;
+	slot = conn_set_slot(set, c);
+	if (*slot)
+		return 0;
+	if (set->nconns == set->conns_size) {
+		size = set->conns_size ? 2 * set->conns_size : 1024;
+		conns = realloc(set->conns, size * sizeof(*conns));
+		if (!conns)
+			return -1;
+		set->conns = conns;
+		live = realloc(set->live, size);
+		if (!live)
+			return -1;
+		set->live = live;
+		set->conns_size = size;
+	}
+	set->conns[set->nconns] = *c;
+	set->live[set->nconns] = 1;
+	*slot = ++set->nconns;
+	set->count++;
+	return 1;
+}
+
+/* Returns 1 if c was removed, 0 if it was not in the set */
+static int conn_set_del(struct conn_set *set, const struct tickle_conn *c)
+{
+	size_t i, j, k, mask = set->size - 1;
+
+	if (!conn_set_has(set, c))
+		return 0;
+	i = conn_set_slot(set, c) - set->slot;
+	set->live[set->slot[i] - 1] = 0;
+	set->count--;
+
+	/* close the gap so later entries of the same probe chain stay
+	 * reachable (backward shift deletion) */
+	for (j = i;;) {
+		set->slot[i] = 0;
+		for (;;) {
+			j = (j + 1) & mask;
+			if (!set->slot[j])
+				return 1;
+			c = &set->conns[set->slot[j] - 1];
+			k = hash_addr(hash_addr(2166136261u, &c->src), &c->dst) & mask;
+			if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+				continue;
+			break;
+		}
+		set->slot[i] = set->slot[j];
+		i = j;
+	}
+}
+
+/* Drop the holes left by deletions, keeping the order */
+static void conn_set_pack(struct conn_set *set)
+{
+	size_t i, n = 0;
+
+	for (i = 0; i < set->nconns; i++) {
+		if (set->live[i]) {
+			set->conns[n] = set->conns[i];
+			set->live[n] = 1;
+			*conn_set_slot(set, &set->conns[n]) = n + 1;
+			n++;
+		}
+	}
+	set->nconns = n;
+}
+
+static void conn_set_free(struct conn_set *set)
+{
+	free(set->conns);
+	free(set->live);
+	free(set->slot);
+	memset(set, 0, sizeof(*set));
+}
+
+/*
+ * Packed state files hold one or more blocks, each a tickle_bin_hdr
+ * followed by count records of that family.  A record is the local
+ * address, the remote address, the local port and the remote port,
+ * all in network byte order: 12 bytes for IPv4, 36 for IPv6.  Text
+ * lines may follow the last block, as when the journal of a --daemon
+ * is appended to a packed state file.
+ */
+#define TICKLE_BIN_MAGIC	"\211TKL"
+#define TICKLE_BIN_VERSION	1
+
+struct tickle_bin_hdr {
+	char		magic[4];
+	uint8_t		version;
+	uint8_t		family;		/* 4 or 6 */
+	uint16_t	reserved;
+	uint32_t	count;
+};
+
+static void unpack_conn(struct tickle_conn *c, int alen, const unsigned char *r)
+{
+	memset(c, 0, sizeof(*c));
+	if (alen == 4) {
+		c->src.ip.sin_family = c->dst.ip.sin_family = AF_INET;
+		memcpy(&c->src.ip.sin_addr, r, 4);
+		memcpy(&c->dst.ip.sin_addr, r + 4, 4);
+		memcpy(&c->src.ip.sin_port, r + 8, 2);
+		memcpy(&c->dst.ip.sin_port, r + 10, 2);
+	} else {
+		c->src.ip6.sin6_family = c->dst.ip6.sin6_family = AF_INET6;
+		memcpy(&c->src.ip6.sin6_addr, r, 16);
+		memcpy(&c->dst.ip6.sin6_addr, r + 16, 16);
+		memcpy(&c->src.ip6.sin6_port, r + 32, 2);
+		memcpy(&c->dst.ip6.sin6_port, r + 34, 2);
+	}
+}
+
+/*
+ * Unpack the packed blocks at the start of p into a new array, *used is
+ * their size.  They were written from a set, so unlike text lines they
+ * are not checked for duplicates.
+ */
+static int read_packed_conns(const unsigned char *p, size_t len, size_t *used,
+			     struct tickle_conn **connsp, size_t *count,
+			     unsigned *bad)
+{
+	struct tickle_bin_hdr h;
+	struct tickle_conn *conns;
+	size_t off, n, have, rlen, total = 0;
+	int alen;
+
+	*connsp = NULL;
+	*count = 0;
+	/* size the array from the headers first */
+	for (off = 0; len - off >= sizeof(h) && !memcmp(p + off, TICKLE_BIN_MAGIC, 4);
+	     off += n * rlen) {
+		memcpy(&h, p + off, sizeof(h));
+		off += sizeof(h);
+		rlen = h.family == 4 ? 12 : 36;
+		n = ntohl(h.count);
+		have = (len - off) / rlen;
+		total += n < have ? n : have;
+		if (n > have)
+			break;
+	}
+	if (!total) {
+		*used = 0;
+		return 0;
+	}
+	conns = malloc(total * sizeof(*conns));
+	if (!conns)
+		return -1;
+	*connsp = conns;
+
+	off = 0;
+	while (len - off >= sizeof(h) && !memcmp(p + off, TICKLE_BIN_MAGIC, 4)) {
+		memcpy(&h, p + off, sizeof(h));
+		off += sizeof(h);
+		alen = h.family == 4 ? 4 : h.family == 6 ? 16 : 0;
+		if (h.version != TICKLE_BIN_VERSION || !alen) {
+			fprintf(stderr, "Unknown packed block (version %u, family %u)\n",
+				h.version, h.family);
+			(*bad)++;
+			off = len;
+			break;
+		}
+		rlen = 2 * alen + 4;
+		n = ntohl(h.count);
+		have = (len - off) / rlen;
+		if (n > have) {
+			fprintf(stderr, "Packed block cut short, %zu of %zu connections\n",
+				have, n);
+			*bad += n - have;
+		}
+		for (; n && have; n--, have--, off += rlen)
+			unpack_conn(&conns[(*count)++], alen, p + off);
+		if (n) {
+			off = len;
+			break;
+		}
+	}
+	*used = off;
+	return 0;
+}
+
+/*
+ * Add the text lines in p to set, skipping (and counting) lines we
+ * can't parse.  Lines may carry a '+' or '-' in front of the first
+ * address, as written to the --daemon journal, to add or remove a
+ * connection; so a state file followed by its journal gives the
+ * current list.
+ */
+static int read_text_conns(const char *p, size_t len, struct conn_set *set,
+			   unsigned *bad)
+{
+	struct tickle_conn c;
+	char addrline[256], addr1[128], addr2[128], *a1;
+	const char *eol;
+	unsigned lineno = 0;
+	size_t n;
+
+	for (; len; p += n, len -= n) {
+		eol = memchr(p, '\n', len);
+		n = eol ? (size_t)(eol - p) + 1 : len;
+		memcpy(addrline, p, n < sizeof(addrline) ? n : sizeof(addrline) - 1);
+		addrline[n < sizeof(addrline) ? n : sizeof(addrline) - 1] = 0;
+		lineno++;
+		switch (sscanf(addrline, "%127s %127s", addr1, addr2)) {
+		case EOF:
+			continue;
+		case 2:
+			a1 = addr1 + (addr1[0] == '+' || addr1[0] == '-');
+			if (parse_ip_port(a1, &c.src) || parse_ip_port(addr2, &c.dst))
+				break;
+			if (addr1[0] == '-') {
+				conn_set_del(set, &c);
+				continue;
+			}
+			if (conn_set_add(set, &c) < 0)
+				return -1;
+			continue;
+		}
+		fprintf(stderr, "Skipping bad connection on line %u: %s", lineno, addrline);
+		(*bad)++;
+	}
+	return 0;
+}
+
+/*
+ * Map fd if it is a regular file, read it all otherwise.  Returns NULL
+ * on error, *mapped tells how to let go of the buffer.
+ */
+static unsigned char *load_input(int fd, size_t *len, int *mapped)
+{
+	struct stat st;
+	unsigned char *buf = NULL, *p;
+	size_t size = 0;
+	ssize_t n;
+
+	*len = 0;
+	*mapped = 0;
+	if (!fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size > 0
+	    && lseek(fd, 0, SEEK_CUR) == 0) {
+		p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+		if (p != MAP_FAILED) {
+			*len = st.st_size;
+			*mapped = 1;
+			return p;
+		}
+	}
+	for (;;) {
+		if (*len == size) {
+			size = size ? 2 * size : 65536;
+			p = realloc(buf, size);
+			if (!p) {
+				fprintf(stderr, "Failed realloc()\n");
+				free(buf);
+				return NULL;
+			}
+			buf = p;
+		}
+		n = read(fd, buf + *len, size - *len);
+		if (n > 0)
+			*len += n;
+		else if (n == 0)
+			return buf;
+		else if (errno != EINTR) {
+			fprintf(stderr, "Failed to read connections (%s)\n", strerror(errno));
+			free(buf);
+			return NULL;
+		}
+	}
+}
+
+/*
+ * Read the connection list from fd: packed blocks if it starts with
+ * one, text lines after that.
+ */
+static int read_conns(int fd, struct tickle_conn **connsp, size_t *count,
+		      unsigned *bad)
+{
+	struct conn_set set;
+	unsigned char *buf;
+	size_t len, used, i;
+	int mapped, ret;
+
+	*bad = 0;
+	buf = load_input(fd, &len, &mapped);
+	if (!buf)
+		return -1;
+	memset(&set, 0, sizeof(set));
+	ret = read_packed_conns(buf, len, &used, connsp, count, bad);
+	if (!ret && used < len) {
+		/* journal lines follow, they need the set */
+		for (i = 0; i < *count && !ret; i++)
+			ret = conn_set_add(&set, &(*connsp)[i]) < 0;
+		free(*connsp);
+		if (!ret)
+			ret = read_text_conns((const char *)buf + used, len - used,
+					      &set, bad);
+		conn_set_pack(&set);
+		*connsp = set.conns;
+		*count = set.nconns;
+		set.conns = NULL;
+	}
+	if (mapped)
+		munmap(buf, len);
+	else
+		free(buf);
+	conn_set_free(&set);
+	if (ret) {
+		fprintf(stderr, "Out of memory reading connections\n");
+		free(*connsp);
+		return -1;
+	}
+	return 0;
+}
+
+#ifdef TICKLE_VERIFY
+/*
+ * --verify listens for what the peers send back.  A peer that gets a
+ * tickle answers with an ACK (or a RST) for the connection, which is
+ * all we want from it, so every connection is tickled once and then
+ * only the silent ones again, waiting twice as long after each round,
+ * up to -n rounds.  Raw TCP sockets see a copy of every incoming
+ * segment; a socket filter passes only ACKs and RSTs to the VIP.
+ *
+ * --kill goes one step further, like CTDB's killtcp: the ACK a peer
+ * answers with carries the sequence numbers it expects, so a RST built
+ * from them is accepted and the peer drops the connection at once
+ * instead of waiting for its retransmissions to time out.
+ */
+#define VERIFY_TIMEOUT	0.2	/* seconds to wait after the first round */
+
+struct verify_state {
+	struct conn_set		set;		/* maps answers to indices */
+	double			*answered;	/* time of the answer, or -1 */
+	size_t			nanswered;
+	int			kill;
+	struct timespec		epoch;
+};
+
+/* The local address shared by all connections of family, or NULL */
+static const sock_addr *common_vip(const struct tickle_conn *conns, size_t count,
+				   int family)
+{
+	const sock_addr *vip = NULL;
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		if (conns[i].src.sa.sa_family != family)
+			continue;
+		if (vip && !addr_equal(vip, &conns[i].src))
+			return NULL;
+		vip = &conns[i].src;
+	}
+	return vip;
+}
+
+static int open_reply_socket(int family, const sock_addr *vip)
+{
+	struct sock_filter code[16];
+	struct sock_fprog prog;
+	const uint32_t *addr;
+	int fd, n = 0, i, naddr = 0, one = 1, size = 8 << 20;
+
+	fd = socket(family, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+	if (fd == -1) {
+		fprintf(stderr, "Failed to open reply socket (%s)\n", strerror(errno));
+		return -1;
+	}
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)))
+		setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	if (family == AF_INET6)
+		setsockopt(fd, IPPROTO_IPV6, IPV6_RECVPKTINFO, &one, sizeof(one));
+
+	/* the destination address, if all tickles came from one VIP */
+	if (vip) {
+		addr = family == AF_INET ? &vip->ip.sin_addr.s_addr
+					 : (const uint32_t *)vip->ip6.sin6_addr.s6_addr;
+		naddr = family == AF_INET ? 1 : 4;
+		for (i = 0; i < naddr; i++) {
+			code[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+				SKF_NET_OFF + (family == AF_INET ? 16 : 24) + 4 * i);
+			/* jf is patched to reach the drop below */
+			code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+				ntohl(addr[i]), 0, 0);
+		}
+	}
+	/* IPv4 raw sockets get the IP header, IPv6 ones the TCP header */
+	if (family == AF_INET) {
+		code[n++] = (struct sock_filter)BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 0);
+		code[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_B | BPF_IND, 13);
+	} else {
+		code[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 13);
+	}
+	code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K,
+						 TH_ACK | TH_RST, 0, 1);
+	code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0xffff);
+	code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0);
+	for (i = 0; i < 2 * naddr; i += 2)
+		code[i + 1].jf = n - 1 - (i + 2);
+
+	prog.len = n;
+	prog.filter = code;
+	if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)))
+		fprintf(stderr, "Failed to filter replies (%s)\n", strerror(errno));
+	return fd;
+}
+
+/*
+ * Mark the connections the segments queued on fd belong to as
+ * answered, and with --kill reset the ones that answered with an ACK.
+ */
+static void read_replies(int fd, int family, struct verify_state *v)
+{
+	unsigned char buf[128], cbuf[CMSG_SPACE(sizeof(struct in6_pktinfo))];
+	struct in6_pktinfo *pi;
+	struct cmsghdr *cm;
+	struct iovec iov;
+	struct msghdr msg;
+	struct tickle_conn c;
+	const struct iphdr *ip;
+	const struct tcphdr *tcp;
+	sock_addr from;
+	size_t *slot;
+	ssize_t len;
+
+	for (;;) {
+		memset(&msg, 0, sizeof(msg));
+		iov.iov_base = buf;
+		iov.iov_len = sizeof(buf);
+		msg.msg_name = &from;
+		msg.msg_namelen = sizeof(from);
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = cbuf;
+		msg.msg_controllen = sizeof(cbuf);
+		len = recvmsg(fd, &msg, 0);
+		if (len == -1)
+			break;
+
+		memset(&c, 0, sizeof(c));
+		if (family == AF_INET) {
+			ip = (const struct iphdr *)buf;
+			if (len < (ssize_t)sizeof(*ip) || len < ip->ihl * 4 + 14)
+				continue;
+			tcp = (const struct tcphdr *)(buf + ip->ihl * 4);
+			c.src.ip.sin_family = c.dst.ip.sin_family = AF_INET;
+			c.src.ip.sin_addr.s_addr = ip->daddr;
+			c.src.ip.sin_port = tcp->dest;
+			c.dst.ip.sin_addr.s_addr = ip->saddr;
+			c.dst.ip.sin_port = tcp->source;
+		} else {
+			if (len < 14)
+				continue;
+			tcp = (const struct tcphdr *)buf;
+			c.src.ip6.sin6_family = c.dst.ip6.sin6_family = AF_INET6;
+			for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+				if (cm->cmsg_level == IPPROTO_IPV6
+				    && cm->cmsg_type == IPV6_PKTINFO) {
+					pi = (struct in6_pktinfo *)CMSG_DATA(cm);
+					c.src.ip6.sin6_addr = pi->ipi6_addr;
+				}
+			}
+			c.src.ip6.sin6_port = tcp->dest;
+			c.dst.ip6.sin6_addr = from.ip6.sin6_addr;
+			c.dst.ip6.sin6_port = tcp->source;
+		}
+		/* without the filter we see everything */
+		if (!tcp->ack && !tcp->rst)
+			continue;
+		slot = conn_set_slot(&v->set, &c);
+		if (!*slot || v->answered[*slot - 1] >= 0)
+			continue;
+		/* seq and ack stay in network byte order */
+		if (v->kill && !tcp->rst
+		    && send_tickle_ack(&c.dst, &c.src, tcp->ack_seq, tcp->seq, 1))
+			continue;
+		v->answered[*slot - 1] = elapsed_since(&v->epoch);
+		v->nanswered++;
+	}
+	if (v->kill && flush_tickle_acks())
+		fprintf(stderr, "Error while sending resets\n");
+}
+
+static int workers_done(struct tickle_worker *workers, int threads)
+{
+	int i;
+
+	for (i = 0; i < threads; i++) {
+		if (!__atomic_load_n(&workers[i].done, __ATOMIC_ACQUIRE))
+			return 0;
+	}
+	return 1;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Tickle conns until they all answered or rounds run out, then print
+ * the answer latencies and the connections that never answered.
+ * Returns the number of those.
+ */
+static size_t verify_tickles(struct tickle_worker *workers, int threads,
+			     const struct tickle_conn *conns, size_t count,
+			     int rounds, int kill)
+{
+	static const int families[] = { AF_INET, AF_INET6 };
+	struct verify_state v;
+	struct tickle_conn *round = NULL;
+	struct pollfd pfd[2];
+	double *sent = NULL, *rsent = NULL, timeout, end;
+	size_t *ridx = NULL, i, n;
+	char s1[64], s2[64];
+	int f, k, npfd = 0, pfam[2];
+
+	memset(&v, 0, sizeof(v));
+	v.kill = kill;
+	for (i = 0; i < count; i++) {
+		if (conn_set_add(&v.set, &conns[i]) < 0)
+			goto oom;
+	}
+	count = v.set.nconns;
+	sent = malloc(count * sizeof(*sent));
+	v.answered = malloc(count * sizeof(*v.answered));
+	rsent = malloc(count * sizeof(*rsent));
+	ridx = malloc(count * sizeof(*ridx));
+	round = malloc(count * sizeof(*round));
+	if (count && (!sent || !v.answered || !rsent || !ridx || !round))
+		goto oom;
+	for (i = 0; i < count; i++)
+		sent[i] = v.answered[i] = -1;
+
+	for (f = 0; f < 2; f++) {
+		for (i = 0; i < count && v.set.conns[i].src.sa.sa_family != families[f]; i++)
+			;
+		if (i == count)
+			continue;
+		pfd[npfd].fd = open_reply_socket(families[f],
+				common_vip(v.set.conns, count, families[f]));
+		pfd[npfd].events = POLLIN;
+		pfam[npfd] = families[f];
+		if (pfd[npfd].fd != -1)
+			npfd++;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &v.epoch);
+	for (k = 0, timeout = VERIFY_TIMEOUT; k < rounds && v.nanswered < count;
+	     k++, timeout *= 2) {
+		for (i = 0, n = 0; i < count; i++) {
+			if (v.answered[i] < 0) {
+				round[n] = v.set.conns[i];
+				ridx[n++] = i;
+			}
+		}
+		for (f = 0; f < threads; f++)
+			workers[f].epoch = &v.epoch;
+		shard_conns(workers, threads, round, n, rsent);
+		start_workers(workers, threads, 0);
+		/* answers come in while the senders are still busy */
+		end = -1;
+		while (v.nanswered < count) {
+			if (end < 0 && workers_done(workers, threads))
+				end = elapsed_since(&v.epoch) + timeout;
+			if (end >= 0 && elapsed_since(&v.epoch) >= end)
+				break;
+			if (poll(pfd, npfd, 10) <= 0)
+				continue;
+			for (f = 0; f < npfd; f++) {
+				if (pfd[f].revents & POLLIN)
+					read_replies(pfd[f].fd, pfam[f], &v);
+			}
+		}
+		join_workers(workers, threads);
+		for (i = 0; i < n; i++) {
+			if (sent[ridx[i]] < 0)
+				sent[ridx[i]] = rsent[i];
+		}
+	}
+	for (f = 0; f < npfd; f++)
+		close(pfd[f].fd);
+	/* the resets went out from this thread */
+	workers[0].stats.sent   += tickle_stats.sent;
+	workers[0].stats.failed += tickle_stats.failed;
+	close_tickle_sockets();
+
+	/* latency from the first tickle to the first answer */
+	for (i = 0, n = 0; i < count; i++) {
+		if (v.answered[i] >= 0)
+			rsent[n++] = (v.answered[i] - sent[i]) * 1000;
+	}
+	qsort(rsent, n, sizeof(*rsent), cmp_double);
+	printf("tickle_tcp: %zu of %zu connections %s", n, count,
+	       kill ? "reset" : "answered");
+	if (n)
+		printf(", latency p50 %.1fms p90 %.1fms p99 %.1fms max %.1fms",
+		       rsent[n / 2], rsent[n * 9 / 10], rsent[n * 99 / 100], rsent[n - 1]);
+	printf("\n");
+	for (i = 0; i < count; i++) {
+		if (v.answered[i] < 0)
+			printf("unanswered\t%s\t%s\n",
+			       format_addr(&v.set.conns[i].src, s1, sizeof(s1)),
+			       format_addr(&v.set.conns[i].dst, s2, sizeof(s2)));
+	}
+	n = count - n;
+	goto out;
+oom:
+	fprintf(stderr, "Out of memory verifying tickles\n");
+	n = count;
+out:
+	free(sent);
+	free(v.answered);
+	free(rsent);
+	free(ridx);
+	free(round);
+	conn_set_free(&v.set);
+	return n;
+}
+#endif
+
+#ifdef TICKLE_CAPTURE
+/*
+ * --capture asks the kernel for the established TCP connections of one
+ * local address through NETLINK_SOCK_DIAG.  A bytecode filter on the
+ * source address runs in the kernel, so only that address' sockets are
+ * copied out.  They are written in the format main() reads from stdin.
+ */
+
+/* IPv4 peers of dual stack sockets are turned into plain IPv4 */
+static void diag_addr(sock_addr *a, int family, const uint32_t *addr, uint16_t port)
+{
+	memset(a, 0, sizeof(*a));
+	if (family == AF_INET6 && IN6_IS_ADDR_V4MAPPED((const struct in6_addr *)addr)) {
+		family = AF_INET;
+		addr += 3;
+	}
+	if (family == AF_INET) {
+		a->ip.sin_family = AF_INET;
+		a->ip.sin_port = port;
+		memcpy(&a->ip.sin_addr, addr, 4);
+	} else {
+		a->ip6.sin6_family = AF_INET6;
+		a->ip6.sin6_port = port;
+		memcpy(&a->ip6.sin6_addr, addr, 16);
+	}
+}
+
+static void diag_conn(struct tickle_conn *c, const struct inet_diag_msg *msg)
+{
+	diag_addr(&c->src, msg->idiag_family, msg->id.idiag_src, msg->id.idiag_sport);
+	diag_addr(&c->dst, msg->idiag_family, msg->id.idiag_dst, msg->id.idiag_dport);
+}
+
+static int print_conn(const struct tickle_conn *c, void *arg)
+{
+	char s1[64], s2[64];
+
+	fprintf(arg, "%s\t%s\n", format_addr(&c->src, s1, sizeof(s1)),
+		format_addr(&c->dst, s2, sizeof(s2)));
+	return 0;
+}
+
+static int set_add_cb(const struct tickle_conn *c, void *arg)
+{
+	return conn_set_add(arg, c) < 0 ? -1 : 0;
+}
+
+/*
+ * --packed: write state files in the format of read_packed_conns().
+ * Write errors are left on out for commit_state_tmp() to see.
+ */
+static int packed_state;
+
+static void write_packed(FILE *out, const struct tickle_conn *conns, size_t n)
+{
+	static const int families[] = { AF_INET, AF_INET6 };
+	struct tickle_bin_hdr h;
+	unsigned char r[36];
+	size_t i, count;
+	int f, alen;
+
+	for (f = 0; f < 2; f++) {
+		for (i = 0, count = 0; i < n; i++) {
+			if (conns[i].src.sa.sa_family == families[f]
+			    && conns[i].dst.sa.sa_family == families[f])
+				count++;
+		}
+		if (!count)
+			continue;
+		alen = families[f] == AF_INET ? 4 : 16;
+		memset(&h, 0, sizeof(h));
+		memcpy(h.magic, TICKLE_BIN_MAGIC, 4);
+		h.version = TICKLE_BIN_VERSION;
+		h.family = alen == 4 ? 4 : 6;
+		h.count = htonl(count);
+		fwrite(&h, sizeof(h), 1, out);
+		for (i = 0; i < n; i++) {
+			if (conns[i].src.sa.sa_family != families[f]
+			    || conns[i].dst.sa.sa_family != families[f])
+				continue;
+			if (alen == 4) {
+				memcpy(r, &conns[i].src.ip.sin_addr, 4);
+				memcpy(r + 4, &conns[i].dst.ip.sin_addr, 4);
+			} else {
+				memcpy(r, &conns[i].src.ip6.sin6_addr, 16);
+				memcpy(r + 16, &conns[i].dst.ip6.sin6_addr, 16);
+			}
+			memcpy(r + 2 * alen, &conns[i].src.ip.sin_port, 2);
+			memcpy(r + 2 * alen + 2, &conns[i].dst.ip.sin_port, 2);
+			fwrite(r, 2 * alen + 4, 1, out);
+		}
+	}
+}
+
+static void write_state(FILE *out, const struct tickle_conn *conns, size_t n)
+{
+	size_t i;
+
+	if (packed_state) {
+		write_packed(out, conns, n);
+		return;
+	}
+	for (i = 0; i < n; i++)
+		print_conn(&conns[i], out);
+}
+
+static int capture_family(int nl, int family, const sock_addr *vip,
+			  int (*cb)(const struct tickle_conn *c, void *arg), void *arg)
+{
+	static unsigned seq;
+	char req[NLMSG_SPACE(sizeof(struct inet_diag_req_v2)) + RTA_SPACE(
+		 sizeof(struct inet_diag_bc_op) + sizeof(struct inet_diag_hostcond) + 16)];
+	struct nlmsghdr *nh = (struct nlmsghdr *)req;
+	struct inet_diag_req_v2 *r = NLMSG_DATA(nh);
+	struct inet_diag_bc_op *op;
+	struct inet_diag_hostcond *cond;
+	struct sockaddr_nl nladdr;
+	struct tickle_conn c;
+	struct rtattr *rta;
+	char buf[32768];
+	int alen, oplen;
+	ssize_t n;
+
+	alen = vip->sa.sa_family == AF_INET ? 4 : 16;
+	oplen = sizeof(*op) + sizeof(*cond) + alen;
+
+	memset(req, 0, sizeof(req));
+	nh->nlmsg_type  = SOCK_DIAG_BY_FAMILY;
+	nh->nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	nh->nlmsg_seq   = ++seq;
+	r->sdiag_family   = family;
+	r->sdiag_protocol = IPPROTO_TCP;
+	r->idiag_states   = 1 << TCP_ESTABLISHED;
+
+	/* one op: source address == vip jumps to the end (accept),
+	 * anything else jumps past it (reject) */
+	rta = (struct rtattr *)(req + NLMSG_SPACE(sizeof(*r)));
+	rta->rta_type = INET_DIAG_REQ_BYTECODE;
+	rta->rta_len  = RTA_LENGTH(oplen);
+	op = RTA_DATA(rta);
+	op->code = INET_DIAG_BC_S_COND;
+	op->yes  = oplen;
+	op->no   = oplen + 4;
+	cond = (struct inet_diag_hostcond *)(op + 1);
+	cond->family     = vip->sa.sa_family;
+	cond->prefix_len = alen * 8;
+	cond->port       = -1;
+	if (vip->sa.sa_family == AF_INET)
+		memcpy(cond->addr, &vip->ip.sin_addr, alen);
+	else
+		memcpy(cond->addr, &vip->ip6.sin6_addr, alen);
+	nh->nlmsg_len = NLMSG_SPACE(sizeof(*r)) + rta->rta_len;
+
+	memset(&nladdr, 0, sizeof(nladdr));
+	nladdr.nl_family = AF_NETLINK;
+	if (sendto(nl, req, nh->nlmsg_len, 0,
+		   (struct sockaddr *)&nladdr, sizeof(nladdr)) < 0)
+		return -1;
+
+	for (;;) {
+		n = recv(nl, buf, sizeof(buf), 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		for (nh = (struct nlmsghdr *)buf; NLMSG_OK(nh, (size_t)n);
+		     nh = NLMSG_NEXT(nh, n)) {
+			if (nh->nlmsg_seq != seq)
+				continue;
+			if (nh->nlmsg_type == NLMSG_DONE)
+				return 0;
+			if (nh->nlmsg_type == NLMSG_ERROR) {
+				errno = -((struct nlmsgerr *)NLMSG_DATA(nh))->error;
+				return -1;
+			}
+			diag_conn(&c, NLMSG_DATA(nh));
+			if (cb(&c, arg))
+				return -1;
+		}
+	}
+}
+
+/* Dump all established connections of vip, dual stack ones included */
+static int capture_vip(int nl, const sock_addr *vip,
+		       int (*cb)(const struct tickle_conn *c, void *arg), void *arg)
+{
+	if (vip->sa.sa_family == AF_INET6)
+		return capture_family(nl, AF_INET6, vip, cb, arg);
+	if (capture_family(nl, AF_INET, vip, cb, arg))
+		return -1;
+	/* a host without IPv6 has no dual stack sockets */
+	if (capture_family(nl, AF_INET6, vip, cb, arg) && errno != ENOENT)
+		return -1;
+	return 0;
+}
+
+/* Open a temporary file next to path to be renamed over it later */
+static FILE *open_state_tmp(const char *path, char **tmp)
+{
+	FILE *out;
+	int fd;
+
+	if (asprintf(tmp, "%s.XXXXXX", path) < 0) {
+		fprintf(stderr, "Failed asprintf()\n");
+		return NULL;
+	}
+	fd = mkstemp(*tmp);
+	if (fd == -1 || fchmod(fd, 0644) || !(out = fdopen(fd, "w"))) {
+		fprintf(stderr, "Failed to create %s (%s)\n", *tmp, strerror(errno));
+		if (fd != -1) {
+			close(fd);
+			unlink(*tmp);
+		}
+		free(*tmp);
+		return NULL;
+	}
+	return out;
+}
+
+/*
+ * Sync and rename tmp over path if ret is 0 and every write to out went
+ * through, discard it otherwise.
+ */
+static int commit_state_tmp(FILE *out, char *tmp, const char *path, int ret)
+{
+	if (!ret && (fflush(out) || ferror(out) || fsync(fileno(out)))) {
+		fprintf(stderr, "Failed to write %s (%s)\n", tmp, strerror(errno));
+		ret = -1;
+	}
+	if (fclose(out))
+		ret = -1;
+	if (!ret && rename(tmp, path)) {
+		fprintf(stderr, "Failed to rename %s to %s (%s)\n", tmp, path,
+			strerror(errno));
+		ret = -1;
+	}
+	if (ret)
+		unlink(tmp);
+	free(tmp);
+	return ret;
+}
+
+/*
+ * Write the established connections of ip to path, or to stdout if
+ * path is NULL.  path is replaced atomically, so a reader (or a sync
+ * script) never sees a partial state file.
+ */
+static int capture_connections(const char *ip, const char *path)
+{
+	struct conn_set set;
+	sock_addr vip;
+	char *tmp = NULL;
+	FILE *out = stdout;
+	int nl, ret;
+
+	if (parse_ip(ip, NULL, 0, &vip))
+		return -1;
+
+	nl = socket(AF_NETLINK, SOCK_RAW, NETLINK_SOCK_DIAG);
+	if (nl == -1) {
+		fprintf(stderr, "Failed to open sock_diag socket (%s)\n", strerror(errno));
+		return -1;
+	}
+	if (path && !(out = open_state_tmp(path, &tmp))) {
+		close(nl);
+		return -1;
+	}
+
+	if (packed_state) {
+		/* the block headers need the counts up front */
+		memset(&set, 0, sizeof(set));
+		ret = capture_vip(nl, &vip, set_add_cb, &set);
+		if (!ret)
+			write_packed(out, set.conns, set.nconns);
+		conn_set_free(&set);
+	} else {
+		ret = capture_vip(nl, &vip, print_conn, out);
+	}
+	if (ret)
+		fprintf(stderr, "Failed to dump connections of %s (%s)\n", ip, strerror(errno));
+	close(nl);
+
+	if (path)
+		return commit_state_tmp(out, tmp, path, ret);
+	return fflush(out) || ferror(out) || ret ? -1 : 0;
+}
+
+/*
+ * --daemon keeps the state file current instead of taking one snapshot.
+ * After the first dump every change to the established connections of
+ * the VIP is appended to <file>.journal as a '+' or '-' line, which
+ * read_conns() applies on top of <file>.  Changes come from the socket
+ * destroy events of sock_diag and, if the kernel tracks connections,
+ * from conntrack events.  A filtered dump every few seconds catches
+ * what the events missed.  Once the journal outgrows the connection set
+ * <file> is rewritten and the journal starts over.
+ */
+struct conn_journal {
+	FILE		*fp;
+	const char	*state;
+	const char	*path;		/* <file>.journal */
+	off_t		own;		/* where this generation's lines start */
+	unsigned long	entries;	/* lines since then */
+};
+
+static volatile sig_atomic_t daemon_stop;
+
+static void daemon_signal(int sig)
+{
+	daemon_stop = sig;
+}
+
+static void journal_conn(struct conn_journal *j, int sign, const struct tickle_conn *c)
+{
+	char s1[64], s2[64];
+
+	fprintf(j->fp, "%c%s\t%s\n", sign, format_addr(&c->src, s1, sizeof(s1)),
+		format_addr(&c->dst, s2, sizeof(s2)));
+	j->entries++;
+}
+
+static void track_conn(struct conn_set *set, struct conn_journal *j,
+		       const struct tickle_conn *c, int up)
+{
+	if (up ? conn_set_add(set, c) == 1 : conn_set_del(set, c) == 1)
+		journal_conn(j, up ? '+' : '-', c);
+}
+
+/* Bring set in line with a fresh dump, journaling the differences */
+static int resync_conns(int nl, const sock_addr *vip, struct conn_set *set,
+			struct conn_journal *j)
+{
+	struct conn_set now;
+	size_t i;
+	int ret;
+
+	memset(&now, 0, sizeof(now));
+	ret = capture_vip(nl, vip, set_add_cb, &now);
+	if (ret) {
+		fprintf(stderr, "Failed to dump connections (%s)\n", strerror(errno));
+	} else {
+		for (i = 0; i < now.nconns; i++)
+			track_conn(set, j, &now.conns[i], 1);
+		for (i = 0; i < set->nconns; i++) {
+			if (set->live[i] && !conn_set_has(&now, &set->conns[i]))
+				track_conn(set, j, &set->conns[i], 0);
+		}
+	}
+	conn_set_free(&now);
+	return ret;
+}
+
+/*
+ * Rewrite the state file from set and start a new journal file.  The
+ * journal is never truncated in place: a reader that opened the old
+ * state file may not have opened the journal yet.  The new journal
+ * starts with the lines written since the old state file, renamed into
+ * place after the new state file, so either state file followed by
+ * either journal gives the current set; replaying changes the state
+ * already has is harmless.
+ */
+static int compact_journal(struct conn_set *set, struct conn_journal *j)
+{
+	char buf[8192], *tmp, *jtmp;
+	FILE *out, *jout;
+	off_t off;
+	ssize_t n;
+
+	if (!(jout = open_state_tmp(j->path, &jtmp)))
+		return -1;
+	if (fflush(j->fp)) {
+		fprintf(stderr, "Failed to write %s (%s)\n", j->path, strerror(errno));
+		return commit_state_tmp(jout, jtmp, j->path, -1);
+	}
+	for (off = j->own; (n = pread(fileno(j->fp), buf, sizeof(buf), off)) > 0; off += n)
+		fwrite(buf, 1, n, jout);
+	if (n < 0) {
+		fprintf(stderr, "Failed to read %s (%s)\n", j->path, strerror(errno));
+		return commit_state_tmp(jout, jtmp, j->path, -1);
+	}
+
+	conn_set_pack(set);
+	if (!(out = open_state_tmp(j->state, &tmp)))
+		return commit_state_tmp(jout, jtmp, j->path, -1);
+	write_state(out, set->conns, set->nconns);
+	if (commit_state_tmp(out, tmp, j->state, 0))
+		return commit_state_tmp(jout, jtmp, j->path, -1);
+
+	/* like commit_state_tmp(), but jout stays open as the journal */
+	if (fflush(jout) || ferror(jout) || fsync(fileno(jout))
+	    || rename(jtmp, j->path)) {
+		fprintf(stderr, "Failed to replace %s (%s)\n", j->path, strerror(errno));
+		fclose(jout);
+		unlink(jtmp);
+		free(jtmp);
+		return -1;
+	}
+	free(jtmp);
+	fclose(j->fp);
+	j->fp = jout;
+	j->own = off - j->own;
+	j->entries = 0;
+	return 0;
+}
+
+static int open_event_socket(int proto, const int *groups, int ngroups)
+{
+	struct sockaddr_nl nladdr;
+	int fd, i;
+
+	fd = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, proto);
+	if (fd == -1)
+		return -1;
+	/* multicast only reaches sockets with a port id */
+	memset(&nladdr, 0, sizeof(nladdr));
+	nladdr.nl_family = AF_NETLINK;
+	if (bind(fd, (struct sockaddr *)&nladdr, sizeof(nladdr))) {
+		close(fd);
+		return -1;
+	}
+	for (i = 0; i < ngroups; i++) {
+		if (setsockopt(fd, SOL_NETLINK, NETLINK_ADD_MEMBERSHIP,
+			       &groups[i], sizeof(groups[i]))) {
+			close(fd);
+			return -1;
+		}
+	}
+	return fd;
+}
+
+#ifdef TICKLE_CONNTRACK
+static void parse_nlattrs(const struct nlattr **tb, int max, const void *data, int len)
+{
+	const struct nlattr *a = data;
+	int type;
+
+	memset(tb, 0, (max + 1) * sizeof(*tb));
+	while (len >= (int)sizeof(*a) && a->nla_len >= sizeof(*a) && a->nla_len <= len) {
+		type = a->nla_type & NLA_TYPE_MASK;
+		if (type <= max)
+			tb[type] = a;
+		len -= NLA_ALIGN(a->nla_len);
+		a = (const struct nlattr *)((const char *)a + NLA_ALIGN(a->nla_len));
+	}
+}
+
+#define NLA_DATA(a)	((const void *)((const char *)(a) + NLA_HDRLEN))
+#define NLA_PAYLOAD(a)	((a)->nla_len - NLA_HDRLEN)
+#define PARSE_NESTED(tb, max, a)	parse_nlattrs(tb, max, NLA_DATA(a), NLA_PAYLOAD(a))
+
+/*
+ * Turn a conntrack event into a connection of vip.  Returns 1 for an
+ * established connection, -1 for one that is closing or gone and 0 if
+ * the event is of no interest.
+ */
+static int ct_event(const struct nlmsghdr *nh, const sock_addr *vip,
+		    struct tickle_conn *c)
+{
+	const struct nfgenmsg *nfg = NLMSG_DATA(nh);
+	const struct nlattr *tb[CTA_MAX + 1], *tuple[CTA_TUPLE_MAX + 1];
+	const struct nlattr *ip[CTA_IP_MAX + 1], *proto[CTA_PROTO_MAX + 1];
+	const struct nlattr *info[CTA_PROTOINFO_MAX + 1];
+	const struct nlattr *tcp[CTA_PROTOINFO_TCP_MAX + 1];
+	const struct nlattr *src, *dst;
+	uint32_t a[4], b[4];
+	sock_addr orig_src, orig_dst;
+	int state;
+
+	if (nh->nlmsg_len < NLMSG_SPACE(sizeof(*nfg)))
+		return 0;
+	parse_nlattrs(tb, CTA_MAX, (const char *)nfg + NLMSG_ALIGN(sizeof(*nfg)),
+		      nh->nlmsg_len - NLMSG_SPACE(sizeof(*nfg)));
+	if (!tb[CTA_TUPLE_ORIG])
+		return 0;
+	PARSE_NESTED(tuple, CTA_TUPLE_MAX, tb[CTA_TUPLE_ORIG]);
+	if (!tuple[CTA_TUPLE_IP] || !tuple[CTA_TUPLE_PROTO])
+		return 0;
+	PARSE_NESTED(proto, CTA_PROTO_MAX, tuple[CTA_TUPLE_PROTO]);
+	if (!proto[CTA_PROTO_NUM] || !proto[CTA_PROTO_SRC_PORT] || !proto[CTA_PROTO_DST_PORT]
+	    || *(const uint8_t *)NLA_DATA(proto[CTA_PROTO_NUM]) != IPPROTO_TCP)
+		return 0;
+
+	PARSE_NESTED(ip, CTA_IP_MAX, tuple[CTA_TUPLE_IP]);
+	if (nfg->nfgen_family == AF_INET) {
+		src = ip[CTA_IP_V4_SRC];
+		dst = ip[CTA_IP_V4_DST];
+	} else {
+		src = ip[CTA_IP_V6_SRC];
+		dst = ip[CTA_IP_V6_DST];
+	}
+	if (!src || !dst || NLA_PAYLOAD(src) > sizeof(a) || NLA_PAYLOAD(dst) > sizeof(b))
+		return 0;
+	memcpy(a, NLA_DATA(src), NLA_PAYLOAD(src));
+	memcpy(b, NLA_DATA(dst), NLA_PAYLOAD(dst));
+	diag_addr(&orig_src, nfg->nfgen_family, a,
+		  *(const uint16_t *)NLA_DATA(proto[CTA_PROTO_SRC_PORT]));
+	diag_addr(&orig_dst, nfg->nfgen_family, b,
+		  *(const uint16_t *)NLA_DATA(proto[CTA_PROTO_DST_PORT]));
+
+	/* the VIP is the local end, whichever side opened the connection */
+	if (addr_equal(&orig_dst, vip)) {
+		c->src = orig_dst;
+		c->dst = orig_src;
+	} else if (addr_equal(&orig_src, vip)) {
+		c->src = orig_src;
+		c->dst = orig_dst;
+	} else {
+		return 0;
+	}
+
+	if (NFNL_MSG_TYPE(nh->nlmsg_type) == IPCTNL_MSG_CT_DELETE)
+		return -1;
+	if (!tb[CTA_PROTOINFO])
+		return 0;
+	PARSE_NESTED(info, CTA_PROTOINFO_MAX, tb[CTA_PROTOINFO]);
+	if (!info[CTA_PROTOINFO_TCP])
+		return 0;
+	PARSE_NESTED(tcp, CTA_PROTOINFO_TCP_MAX, info[CTA_PROTOINFO_TCP]);
+	if (!tcp[CTA_PROTOINFO_TCP_STATE])
+		return 0;
+	state = *(const uint8_t *)NLA_DATA(tcp[CTA_PROTOINFO_TCP_STATE]);
+	if (state == TCP_CONNTRACK_ESTABLISHED)
+		return 1;
+	if (state >= TCP_CONNTRACK_FIN_WAIT && state <= TCP_CONNTRACK_CLOSE)
+		return -1;
+	return 0;
+}
+#endif
+
+/*
+ * Apply all pending events of one event socket.  Returns -1 if the
+ * kernel dropped events and a resync is needed.
+ */
+static int read_events(int fd, const sock_addr *vip, struct conn_set *set,
+		       struct conn_journal *j)
+{
+	char buf[32768];
+	struct nlmsghdr *nh;
+	struct tickle_conn c;
+	ssize_t n;
+	int up;
+
+	for (;;) {
+		n = recv(fd, buf, sizeof(buf), 0);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return errno == EAGAIN ? 0 : -1;
+		}
+		for (nh = (struct nlmsghdr *)buf; NLMSG_OK(nh, (size_t)n);
+		     nh = NLMSG_NEXT(nh, n)) {
+			if (nh->nlmsg_type == SOCK_DIAG_BY_FAMILY) {
+				/* a socket was destroyed */
+				diag_conn(&c, NLMSG_DATA(nh));
+				if (addr_equal(&c.src, vip))
+					track_conn(set, j, &c, 0);
+				continue;
+			}
+#ifdef TICKLE_CONNTRACK
+			if (NFNL_SUBSYS_ID(nh->nlmsg_type) == NFNL_SUBSYS_CTNETLINK
+			    && (up = ct_event(nh, vip, &c)) != 0)
+				track_conn(set, j, &c, up > 0);
+#else
+			(void)up;
+#endif
+		}
+	}
+}
+
+static int follow_connections(const char *ip, const char *path, int resync)
+{
+	static const int diag_groups[] = {
+		SKNLGRP_INET_TCP_DESTROY, SKNLGRP_INET6_TCP_DESTROY
+	};
+#ifdef TICKLE_CONNTRACK
+	static const int ct_groups[] = {
+		NFNLGRP_CONNTRACK_NEW, NFNLGRP_CONNTRACK_UPDATE, NFNLGRP_CONNTRACK_DESTROY
+	};
+#endif
+	struct pollfd pfd[2];
+	struct conn_journal j;
+	struct conn_set set;
+	struct sigaction sa;
+	struct timespec last;
+	char *jpath = NULL;
+	sock_addr vip;
+	int nl, npfd = 0, i, lost, ret = -1;
+
+	if (parse_ip(ip, NULL, 0, &vip))
+		return -1;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = daemon_signal;
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGHUP, &sa, NULL);
+
+	nl = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_SOCK_DIAG);
+	if (nl == -1) {
+		fprintf(stderr, "Failed to open sock_diag socket (%s)\n", strerror(errno));
+		return -1;
+	}
+	/* subscribe before the first dump so nothing falls in between */
+	pfd[npfd].fd = open_event_socket(NETLINK_SOCK_DIAG, diag_groups, 2);
+	if (pfd[npfd].fd != -1)
+		npfd++;
+	else
+		fprintf(stderr, "No socket destroy events (%s)\n", strerror(errno));
+#ifdef TICKLE_CONNTRACK
+	pfd[npfd].fd = open_event_socket(NETLINK_NETFILTER, ct_groups, 3);
+	if (pfd[npfd].fd != -1)
+		npfd++;
+#endif
+	for (i = 0; i < npfd; i++)
+		pfd[i].events = POLLIN;
+
+	memset(&set, 0, sizeof(set));
+	memset(&j, 0, sizeof(j));
+	j.state = path;
+	/* an old journal is relative to the old state file: keep it all */
+	if (asprintf(&jpath, "%s.journal", path) < 0
+	    || !(j.fp = fopen(jpath, "a+"))) {
+		fprintf(stderr, "Failed to open the journal of %s\n", path);
+		goto out;
+	}
+	j.path = jpath;
+	if (capture_vip(nl, &vip, set_add_cb, &set) || compact_journal(&set, &j)) {
+		fprintf(stderr, "Failed to write the state of %s\n", ip);
+		goto out;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &last);
+	while (!daemon_stop) {
+		i = resync * 1000 - elapsed_since(&last) * 1000;
+		if (poll(pfd, npfd, i > 0 ? i : 0) < 0 && errno != EINTR)
+			break;
+		for (i = 0, lost = 0; i < npfd; i++) {
+			if ((pfd[i].revents & (POLLIN | POLLERR))
+			    && read_events(pfd[i].fd, &vip, &set, &j))
+				lost = 1;
+		}
+		if (lost || elapsed_since(&last) >= resync) {
+			resync_conns(nl, &vip, &set, &j);
+			clock_gettime(CLOCK_MONOTONIC, &last);
+		}
+		if (j.entries > set.count + 4096 && compact_journal(&set, &j))
+			fprintf(stderr, "Failed to compact the journal of %s\n", path);
+		fflush(j.fp);
+	}
+	ret = compact_journal(&set, &j);
+out:
+	if (j.fp)
+		fclose(j.fp);
+	free(jpath);
+	conn_set_free(&set);
+	for (i = 0; i < npfd; i++)
+		close(pfd[i].fd);
+	close(nl);
+	return ret;
+}
+#endif
+
+static void usage(void)
+{
+	printf("Usage: /usr/lib/heartbeat/tickle_tcp [ -n num ] [ -i iface ]"
+	       " [ -t threads ] [ -r rate ] [ --verify | --kill ]\n");
+	printf("Please note that this program need to read the list of\n");
+	printf("{local_ip:port remote_ip:port} from stdin.\n");
+	printf("With -i the tickles are written straight to iface through\n");
+	printf("a packet ring instead of the IP stack.\n");
+	printf("-t spreads the connections over that many sender threads\n");
+	printf("(0: one per CPU), -r limits the total tickles per second.\n");
+	printf("--verify waits for the peers to answer and tickles only the\n");
+	printf("silent ones again, up to num rounds, then prints the answer\n");
+	printf("latencies and the connections that never answered.\n");
+	printf("--kill does the same but answers each peer's ACK with a RST\n");
+	printf("in its sequence space, so the peer drops the connection.\n");
+	printf("The list may also be in the packed format written by --packed.\n");
+	printf("\n");
+	printf("       /usr/lib/heartbeat/tickle_tcp --capture ip [ -o file ]"
+	       " [ --packed ] [ --daemon [ --resync secs ] ]\n");
+	printf("writes the established TCP connections of the local address ip\n");
+	printf("in the same format to stdout, or atomically replaces file.\n");
+	printf("--packed writes fixed size binary records instead of text.\n");
+	printf("With --daemon it keeps running and appends every change to\n");
+	printf("file.journal, checking against a full dump every --resync\n");
+	printf("seconds (default 10).  \"cat file file.journal\" gives the\n");
+	printf("current connections.\n");
+	exit(1);
+}
+
+#define OPTION_STRING "n:i:t:r:c:o:dI:PVKh"
+
+static const struct option long_options[] = {
+	{ "capture",	required_argument,	NULL, 'c' },
+	{ "output",	required_argument,	NULL, 'o' },
+	{ "daemon",	no_argument,		NULL, 'd' },
+	{ "resync",	required_argument,	NULL, 'I' },
+	{ "packed",	no_argument,		NULL, 'P' },
+	{ "verify",	no_argument,		NULL, 'V' },
+	{ "kill",	no_argument,		NULL, 'K' },
+	{ "help",	no_argument,		NULL, 'h' },
+	{ NULL, 0, NULL, 0 }
+};
+
+int main(int argc, char *argv[])
+{
+	int optchar, i, num = 1, threads = 1, cont = 1;
+	const char *iface = NULL, *capture = NULL, *output = NULL;
+	int follow = 0, resync = 10, packed = 0, verify = 0;
+#ifdef TICKLE_VERIFY
+	int kill_conns = 0;
+#endif
+	double rate = 0;
+	struct tickle_conn *conns;
+	struct tickle_worker *workers;
+	struct tickle_stats total = { 0, 0 };
+	struct timespec start;
+	cpu_set_t allowed;
+	size_t count, unanswered = 0;
+	unsigned bad;
+	int cpu, ncpus;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	while(cont) {
+		optchar = getopt_long(argc, argv, OPTION_STRING, long_options, NULL);
+		switch(optchar) {
+		case 'n':
+			num = atoi(optarg);
+			break;
+		case 'i':
+#ifdef TICKLE_TX_RING
+			iface = optarg;
+#else
+			fprintf(stderr, "-i is not supported on this platform\n");
+			exit(EXIT_FAILURE);
+#endif
+			break;
+		case 't':
+			threads = atoi(optarg);
+			break;
+		case 'r':
+			rate = atof(optarg);
+			break;
+		case 'c':
+			capture = optarg;
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		case 'd':
+			follow = 1;
+			break;
+		case 'I':
+			resync = atoi(optarg);
+			break;
+		case 'P':
+			packed = 1;
+			break;
+		case 'K':
+		case 'V':
+#ifdef TICKLE_VERIFY
+			verify = 1;
+			kill_conns |= optchar == 'K';
+#else
+			fprintf(stderr, "--verify and --kill are not supported on this platform\n");
+			exit(EXIT_FAILURE);
+#endif
+			break;
+		case 'h':
+			usage();
+			exit(EXIT_SUCCESS);
+			break;
+		case EOF:
+			cont = 0;
+			break;
+		default:
+			fprintf(stderr, "unknown option, please use '-h' for usage.\n");
+			exit(EXIT_FAILURE);
+			break;
+		};
+	}
+
+	if ((output || packed) && !capture) {
+		fprintf(stderr, "-o and --packed only go with --capture\n");
+		exit(EXIT_FAILURE);
+	}
+	if (follow && (!output || resync <= 0)) {
+		fprintf(stderr, "--daemon needs -o and a positive --resync\n");
+		exit(EXIT_FAILURE);
+	}
+	if (capture) {
+#ifdef TICKLE_CAPTURE
+		packed_state = packed;
+		if (follow)
+			return follow_connections(capture, output, resync) ? -1 : 0;
+		return capture_connections(capture, output) ? -1 : 0;
+#else
+		fprintf(stderr, "--capture is not supported on this platform\n");
+		exit(EXIT_FAILURE);
+#endif
+	}
+
+#ifdef TICKLE_TX_RING
+	if (iface && load_tickle_hops(iface))
+		exit(EXIT_FAILURE);
+#endif
+
+	if (read_conns(STDIN_FILENO, &conns, &count, &bad))
+		exit(EXIT_FAILURE);
+
+	if (sched_getaffinity(0, sizeof(allowed), &allowed))
+		CPU_ZERO(&allowed);
+	ncpus = CPU_COUNT(&allowed);
+	if (threads <= 0)
+		threads = ncpus > 0 ? ncpus : 1;
+	if ((size_t)threads > count)
+		threads = count ? count : 1;
+
+	workers = calloc(threads, sizeof(*workers));
+	if (!workers) {
+		fprintf(stderr, "Failed calloc()\n");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0, cpu = -1; i < threads; i++) {
+		workers[i].cpu = -1;
+		if (threads > 1 && ncpus > 0) {
+			/* the i-th CPU we may run on, round robin */
+			do {
+				cpu = (cpu + 1) % CPU_SETSIZE;
+			} while (!CPU_ISSET(cpu, &allowed));
+			workers[i].cpu = cpu;
+		}
+		workers[i].iface = iface;
+		workers[i].num   = verify ? 1 : num;
+		workers[i].rate  = rate / threads;
+	}
+
+#ifdef TICKLE_VERIFY
+	if (verify) {
+		unanswered = verify_tickles(workers, threads, conns, count, num, kill_conns);
+	} else
+#endif
+	{
+		shard_conns(workers, threads, conns, count, NULL);
+		start_workers(workers, threads, 1);
+		join_workers(workers, threads);
+	}
+
+	for (i = 0; i < threads; i++) {
+		total.sent   += workers[i].stats.sent;
+		total.failed += workers[i].stats.failed;
+	}
+	printf("tickle_tcp: sent %lu, failed %lu, skipped %u bad lines, elapsed %.3fs\n",
+	       total.sent, total.failed, bad, elapsed_since(&start));
+
+	free(workers);
+	free(conns);
+	return total.failed || bad || unanswered ? -1 : 0;
+}